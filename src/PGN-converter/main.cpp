@@ -7,15 +7,61 @@ int main(int argc, char* argv[]) {
 
 	chess::attacks::init();
 	chess::pgn::init();
+	chess::Position::init();
+
+	if (argc < 3) {
+		std::cout << "Usage: pgn_converter <pgn> <training data> [options]\n"
+			<< "  --min-ply <n>      skip positions before ply n\n"
+			<< "  --max-ply <n>      skip positions after ply n\n"
+			<< "  --max-score <n>    skip positions with |score| > n\n"
+			<< "  --skip-in-check    skip positions where the side to move is in check\n"
+			<< "  --skip-captures    skip positions where the best move is a capture\n"
+			<< "  --skip-book        skip positions with a book move comment\n"
+			<< "  --threads <n>      number of worker threads\n"
+			<< "  --pin              pin the threads to CPUs, spread over NUMA nodes\n"
+			<< "The output format is chosen by the extension of the training data: .td,\n"
+			<< ".tdp (packed), .txt (text) or .tdc (chained games, a few bytes per position)." << std::endl;
+		return 1;
+	}
 
 	std::filesystem::path pgn = argv[1];
 	std::filesystem::path trainingData = argv[2];
 
+	chess::pgn::Filter filter;
+	size_t numThreads = 1;
+	bool pin = false;
+	for (int i = 3; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (arg == "--min-ply" && i+1 < argc) filter.minPly = std::stoi(argv[++i]);
+		else if (arg == "--max-ply" && i+1 < argc) filter.maxPly = std::stoi(argv[++i]);
+		else if (arg == "--max-score" && i+1 < argc) filter.maxScore = std::stoi(argv[++i]);
+		else if (arg == "--skip-in-check") filter.skipInCheck = true;
+		else if (arg == "--skip-captures") filter.skipCaptures = true;
+		else if (arg == "--skip-book") filter.skipBook = true;
+		else if (arg == "--threads" && i+1 < argc) numThreads = std::stoul(argv[++i]);
+		else if (arg == "--pin") pin = true;
+		else {
+			std::cout << "Unknown option " << arg << "." << std::endl;
+			return 1;
+		}
+	}
+
 	std::cout << "Converting " << pgn << " to " << trainingData << "." << std::endl;
 
-	chess::pgn::Converter converter(pgn, trainingData);
-	converter.convert();
+	chess::pgn::Converter converter(pgn, trainingData, filter);
+	ThreadPool pool(numThreads, pin);
+	converter.convert(pool);
+
+	const chess::pgn::FilterStats& stats = converter.stats;
+	std::cout << "Positions written: " << stats.written << std::endl;
+	std::cout << "Positions skipped: "
+		<< stats.ply << " (ply), "
+		<< stats.score << " (score), "
+		<< stats.inCheck << " (in check), "
+		<< stats.capture << " (capture), "
+		<< stats.book << " (book)" << std::endl;
+	if (numThreads > 1) pool.printStats(std::cout);
 
 	auto t1 = std::chrono::high_resolution_clock::now();
 	std::cout << "Elapsed time: " << (t1-t0).count() * 1e-9 << std::endl;
-}
\ No newline at end of file
+}
@@ -4,20 +4,86 @@
 #include<cstring>
 #include<filesystem>
 #include<fstream>
+#include<functional>
 #include<iostream>
+#include<limits>
 #include<string>
 #include<vector>
 
 #include"pgn_position.h"
+#include"../mapped_file.h"
+#include"../thread_pool.h"
+#include"../training_data_formats.h"
 
 namespace chess {
 
 	namespace pgn {
 
+		// Decides which scored positions are written to the training data.
+		// The default filter accepts every position.
+		struct Filter {
+			uint16_t minPly = 0;
+			uint16_t maxPly = std::numeric_limits<uint16_t>::max();
+			Score maxScore = MATE_SCORE;
+			bool skipInCheck = false;
+			bool skipCaptures = false;
+			bool skipBook = false;
+		};
+
+		struct FilterStats {
+			size_t written;
+			size_t ply;
+			size_t score;
+			size_t inCheck;
+			size_t capture;
+			size_t book;
+
+			FilterStats& operator+=(const FilterStats& other) {
+				written += other.written;
+				ply += other.ply;
+				score += other.score;
+				inCheck += other.inCheck;
+				capture += other.capture;
+				book += other.book;
+				return *this;
+			}
+		};
+
+		// Whether filter accepts a position, counts it in stats either way.
+		inline bool accept(const Filter& filter, uint16_t ply, Score score, bool inCheck, bool isCapture, bool isBook, FilterStats& stats) {
+			if (ply < filter.minPly || ply > filter.maxPly) {
+				++stats.ply;
+				return false;
+			}
+			if (std::abs(score) > filter.maxScore) {
+				++stats.score;
+				return false;
+			}
+			if (filter.skipInCheck && inCheck) {
+				++stats.inCheck;
+				return false;
+			}
+			if (filter.skipCaptures && isCapture) {
+				++stats.capture;
+				return false;
+			}
+			if (filter.skipBook && isBook) {
+				++stats.book;
+				return false;
+			}
+			++stats.written;
+			return true;
+		}
+
 		struct Converter {
 			std::filesystem::path pgn;
 			std::filesystem::path trainingData;
+			Filter filter;
+			FilterStats stats;
 			std::vector<char>buffer;
+			// by the extension of trainingData; chained output also stores the
+			// positions that are not written, as hidden links between the others
+			TrainingData::Writer writer;
 			Position position;
 			std::string fen;
 			int8_t gameResult;
@@ -26,29 +92,106 @@ namespace chess {
 			bool foundFEN;
 			bool isTagPair;
 
+			// properties of the position stored in fen
+			bool fenPending; // neither written nor hidden yet
+			uint16_t ply;
+			bool inCheck;
+			bool isCapture;
+
+			// properties of the current comment
+			bool foundScore;
+			bool isBook;
+
+			// optional callbacks for tools replaying the games
+			std::function<void(const Position&)> onGameStart;
+			std::function<void(const Position&)> onMove;
+
 			Converter(
 				std::filesystem::path pgn,
-				std::filesystem::path trainingData
+				std::filesystem::path trainingData,
+				Filter filter = {}
 			) :
-				pgn(pgn), trainingData(trainingData) {}
+				pgn(pgn), trainingData(trainingData), filter(filter), writer(TrainingData::formatOf(trainingData)) {}
 
 			void convert() {
+				parse();
+
+				std::ofstream os(trainingData, std::ios::out | std::ios::binary);
+				os.write(buffer.data(), buffer.size());
+			}
+
+			// Converts chunks of games on pool, with the same output as convert().
+			void convert(ThreadPool& pool) {
+				MappedFile file;
+				bool opened = file.open(pgn);
+				assert(opened);
+				std::string_view text(file.data, file.size);
+				std::vector<size_t> bounds = splitGames(text, GAMES_PER_TASK);
+
+				std::vector<Converter> parts(bounds.size() - 1, Converter(pgn, trainingData, filter));
+				pool.run(parts.size(), [&](size_t task, size_t) {
+					parts[task].parse(text.substr(bounds[task], bounds[task+1] - bounds[task]));
+				});
+
+				std::ofstream os(trainingData, std::ios::out | std::ios::binary);
+				stats = {};
+				for (const Converter& part : parts) {
+					os.write(part.buffer.data(), part.buffer.size());
+					stats += part.stats;
+				}
+			}
+
+			// Reads the games and stores the training data in buffer.
+			void parse() {
 				std::ifstream is(pgn);
 				assert(is.is_open());
 				std::string line;
+				reset();
+
+				while (std::getline(is, line))
+					processLine(line);
+				writer.finish(buffer);
+			}
+
+			// Same as parse() for games already in memory.
+			void parse(std::string_view text) {
+				reset();
+
+				while (!text.empty()) {
+					size_t eol = text.find('\n');
+					processLine(text.substr(0, eol));
+					text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
+				}
+				writer.finish(buffer);
+			}
+
+			void reset() {
 				buffer = {};
+				stats = {};
 				isComment = false;
 				isTagPair = true;
 				foundFEN = false;
+				fenPending = false;
+			}
 
-				size_t lineCount{};
-				while (std::getline(is, line)) {
-					processLine(line);
-					++lineCount;
-				}
+			// games per task of convert(ThreadPool&)
+			static constexpr size_t GAMES_PER_TASK = 64;
 
-				std::ofstream os(trainingData, std::ios::out | std::ios::binary);
-				os.write(buffer.data(), buffer.size());
+			// Offsets of every n-th game in text and of its end. A game starts
+			// with a tag pair line that follows an empty line.
+			static std::vector<size_t> splitGames(std::string_view text, size_t n) {
+				std::vector<size_t> bounds = { 0 };
+				size_t games = 0;
+				bool emptyLine = false;
+				for (size_t idx = 0; idx < text.size();) {
+					size_t eol = std::min(text.find('\n', idx), text.size());
+					std::string_view line = text.substr(idx, eol - idx);
+					if (emptyLine && !line.empty() && line[0] == '[' && ++games % n == 0) bounds.push_back(idx);
+					emptyLine = line.empty() || line == "\r";
+					idx = eol + 1;
+				}
+				if (bounds.back() != text.size()) bounds.push_back(text.size());
+				return bounds;
 			}
 
 			void processLine(std::string_view line) {
@@ -56,8 +199,11 @@ namespace chess {
 					if (isTagPair) {
 						if (!foundFEN)
 							position = Position::startPosition();
+						if (onGameStart) onGameStart(position);
 						isTagPair = false;
 						foundFEN = false;
+						fenPending = false;
+						writer.finish(buffer);
 					}
 					return;
 				}
@@ -89,54 +235,38 @@ namespace chess {
 						size_t spaceIdx = line.find_first_of(' ', idx);
 						size_t len = spaceIdx == std::string_view::npos ? line.size() - idx : spaceIdx - idx;
 
-						if (line[idx] == '{') isComment = true;
+						if (line[idx] == '{') {
+							isComment = true;
+							foundScore = false;
+							isBook = false;
+						}
 
 						// comment, read score
 						if (isComment) {
-							bool foundScore = false;
+							std::string_view token = line.substr(idx, len);
 
-							if (line[idx+1] == '+') {
-								foundScore = true;
-								uint8_t slashIdx = line.find_first_of('/', idx);
-								assert(slashIdx != std::string_view::npos);
+							if (token.find("book") != std::string_view::npos)
+								isBook = true;
 
-								if (line[idx+2] == 'M')
-									score = MATE_SCORE - std::stoi(std::string(line.substr(idx+3, slashIdx-idx-3)));
-								else
-									score = 100 * ::atof(std::string(line.substr(idx+2, slashIdx-idx-2)).c_str());
-							}
-
-							else if (line[idx+1] == '-') {
+							if (token.size() >= 2 && token[0] == '{' && (token[1] == '+' || token[1] == '-')) {
 								foundScore = true;
-								uint8_t slashIdx = line.find_first_of('/', idx);
+								size_t slashIdx = token.find_first_of('/');
 								assert(slashIdx != std::string_view::npos);
 
-								if (line[idx+2] == 'M')
-									score = -MATE_SCORE + std::stoi(std::string(line.substr(idx+3, slashIdx-idx-3)));
+								if (token[2] == 'M')
+									score = MATE_SCORE - std::stoi(std::string(token.substr(3, slashIdx-3)));
 								else
-									score = -100 * ::atof(std::string(line.substr(idx+2, slashIdx-idx-2)).c_str());
+									score = 100 * ::atof(std::string(token.substr(2, slashIdx-2)).c_str());
+
+								if (token[1] == '-')
+									score = -score;
 							}
 
-							if (line[idx+len-1] == '}')
+							if (len && token[len-1] == '}') {
 								isComment = false;
 
-							// store extended FEN in buffer
-							if (foundScore) {
-								assert(fen.size() <= 255);
-								uint8_t fenSize = fen.size();
-								int8_t relativeGameResult = position.stm ? gameResult : -gameResult;
-
-								size_t offset = buffer.size();
-								buffer.resize(offset +
-									sizeof(uint8_t) + fenSize + sizeof(Score) + sizeof(int8_t)
-								);
-
-								buffer[offset++] = fenSize;
-								std::memcpy(&buffer[offset], fen.data(), fenSize);
-								offset += fenSize;
-								std::memcpy(&buffer[offset], &score, sizeof(Score));
-								offset += sizeof(Score);
-								buffer[offset] = relativeGameResult;
+								if (foundScore && accept(filter, ply, score, inCheck, isCapture, isBook, stats))
+									write();
 							}
 						}
 
@@ -145,14 +275,48 @@ namespace chess {
 							line.substr(idx, len) != "0-1"&&
 							line.substr(idx, len) != "1/2-1/2")
 						{
+							std::string_view move = line.substr(idx, len);
+							if (fenPending) write(true);
 							fen = position.fen();
-							position.applyMove(line.substr(idx, len));
+							fenPending = true;
+							ply = position.ply;
+							inCheck = position.inCheck();
+							isCapture = move.find('x') != std::string_view::npos;
+							position.applyMove(move);
+							if (onMove) onMove(position);
 						}
 
 						idx += len + 1;
 					}
 				}
 			}
+
+			// store extended FEN in buffer, hidden positions only in the chained format
+			void write(bool hidden = false) {
+				assert(fen.size() <= 255);
+				uint8_t fenSize = fen.size();
+				int8_t relativeGameResult = position.stm ? gameResult : -gameResult;
+				fenPending = false;
+
+				if (writer.format != TrainingData::TD) {
+					TrainingDataEntry e = { PackedPosition(fen), hidden ? Score(0) : score, relativeGameResult };
+					writer.write(buffer, e, hidden);
+					return;
+				}
+				if (hidden) return;
+
+				size_t offset = buffer.size();
+				buffer.resize(offset +
+					sizeof(uint8_t) + fenSize + sizeof(Score) + sizeof(int8_t)
+				);
+
+				buffer[offset++] = fenSize;
+				std::memcpy(&buffer[offset], fen.data(), fenSize);
+				offset += fenSize;
+				std::memcpy(&buffer[offset], &score, sizeof(Score));
+				offset += sizeof(Score);
+				buffer[offset] = relativeGameResult;
+			}
 		};
 
 	} // namespace pgn
@@ -1,5 +1,10 @@
 #pragma once
 
+#include<cassert>
+#include<cstring>
+#include<sstream>
+#include<string>
+
 #include"../chess/attacks.h"
 
 namespace chess {
@@ -24,6 +29,24 @@ namespace chess {
 			};
 		};
 
+		// Pieces added to and removed from the board by the last move,
+		// used to update accumulators incrementally.
+		struct DirtyPieces {
+			static constexpr int MAX_SIZE = 4;
+
+			uint8_t size;
+			Piece piece[MAX_SIZE];
+			Square square[MAX_SIZE];
+			bool added[MAX_SIZE];
+
+			void push(Piece pc, Square s, bool add) {
+				if (size == MAX_SIZE) return;
+				piece[size] = pc;
+				square[size] = s;
+				added[size++] = add;
+			}
+		};
+
 		struct FenTableEntry {
 			bool setPiece;
 			Piece piece;
@@ -46,6 +69,7 @@ namespace chess {
 			Square epSquare;
 			uint8_t rule50Cnt;
 			uint16_t ply;
+			DirtyPieces dirty;
 
 			Position() = default;
 			Position(std::string_view fen);
@@ -94,6 +118,11 @@ namespace chess {
 			void movePiece(Square from, Square to);
 
 			Bitboard pinned() const;
+			Bitboard attackersTo(Square s, Color c) const;
+
+			bool inCheck() const {
+				return (bool)attackersTo(kingSquare(stm), !stm);
+			}
 		};
 
 		void init() {
@@ -183,7 +212,8 @@ namespace chess {
 
 			// en passant target square
 			if (fen[idx] != '-') {
-				epSquare = square::make(file::CHAR_IDENTIFYERS[idx++], rank::CHAR_IDENTIFYERS[idx++]);
+				epSquare = square::make(fen.substr(idx, 2));
+				++idx;
 			}
 
 			idx += 2;
@@ -205,6 +235,8 @@ namespace chess {
 				ply = 2 * (numeric - 1) + stm;
 				idx = len - 1;
 			}
+
+			dirty.size = 0;
 		}
 
 		std::string Position::fen() const {
@@ -250,6 +282,7 @@ namespace chess {
 
 			Square newEpSquare = NO_SQUARE;
 			++rule50Cnt;
+			dirty.size = 0;
 
 			if (pt == PAWN) {
 				rule50Cnt = 0;
@@ -473,6 +506,7 @@ namespace chess {
 		}
 
 		void Position::setPiece(Square s, Piece pc) {
+			dirty.push(pc, s, true);
 			board[s] = pc;
 			byPieceType[pieceType::make(pc)].set(s);
 			byColor[color::make(pc)].set(s);
@@ -480,6 +514,7 @@ namespace chess {
 		}
 
 		void Position::removePiece(Square s) {
+			dirty.push(board[s], s, false);
 			byPieceType[pieceType::make(board[s])].clear(s);
 			byColor[color::make(board[s])].clear(s);
 			board[s] = NO_PIECE;
@@ -513,6 +548,16 @@ namespace chess {
 			return pinned;
 		}
 
+		// pieces of color c attacking square s
+		Bitboard Position::attackersTo(Square s, Color c) const {
+			return piecesByColor(c) & (
+				attacks::pawnAttacks[!c][s] & pieces(PAWN) |
+				attacks::knightAttacks[s] & pieces(KNIGHT) |
+				attacks::kingAttacks[s] & pieces(KING) |
+				attacks::attacks<BISHOP>(s, occupied) & (pieces(BISHOP) | pieces(QUEEN)) |
+				attacks::attacks<ROOK>(s, occupied) & (pieces(ROOK) | pieces(QUEEN)));
+		}
+
 		inline std::ostream& operator<<(std::ostream& os, const Position& position) {
 			const std::string hor = "+---+---+---+---+---+---+---+---+";
 			const std::string ver = "|";
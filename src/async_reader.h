@@ -0,0 +1,442 @@
+#pragma once
+
+#include<algorithm>
+#include<cerrno>
+#include<cstdint>
+#include<cstring> // std::memset
+#include<filesystem>
+#include<fstream>
+#include<new>
+#include<vector>
+
+#if !defined(_WIN32)
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
+#if defined(__linux__)
+#include<linux/io_uring.h>
+#include<sys/mman.h>
+#include<sys/syscall.h>
+#include<sys/uio.h>
+#endif
+
+// Reads ranges of a file into a pool of buffers while the caller works on
+// others. On Linux the reads are queued with io_uring into buffers that are
+// registered with the kernel, so that a read costs no syscall of its own and
+// no page pinning; with direct I/O they bypass the page cache. Where io_uring
+// is not available, e.g. blocked by a container, the reads are done with
+// pread when they are waited for.
+struct AsyncReader {
+    // of the buffers, offsets and sizes of direct reads
+    static constexpr size_t ALIGNMENT = 4096;
+
+    // A LOST slot had a read in flight when io_uring failed and could not be
+    // waited for, the kernel may still write into its buffer.
+    enum SlotState : uint8_t { FREE, READING, DONE, FAILED, LOST };
+
+    struct Slot {
+        char* buffer;
+        uint64_t offset;        // of the read, aligned down for direct reads
+        size_t size;            // bytes to read from offset
+        size_t done;            // bytes read
+        size_t skip;            // from the aligned offset to the requested one
+        size_t requested;       // bytes from the requested offset
+        SlotState state = FREE;
+        bool queued = false;    // a read of it is in the ring
+    };
+
+    std::vector<Slot> slots;
+    char* memory = nullptr;
+    size_t slotSize = 0;
+    size_t numReading = 0;
+    bool direct = false;
+    bool fixedBuffers = false;  // the buffers are registered
+
+#if defined(_WIN32)
+    std::ifstream is;
+#else
+    int fd = -1;
+    int bufferedFd = -1;        // fd without O_DIRECT, for pread
+#endif
+
+#if defined(__linux__)
+    int ringFd = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+#endif
+
+    AsyncReader() = default;
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    ~AsyncReader() {
+        close();
+    }
+
+    // Opens file with queueDepth buffers for reads of up to maxReadSize bytes.
+    // Direct I/O is only used where the file system supports it.
+    bool open(const std::filesystem::path& file, size_t queueDepth, size_t maxReadSize, bool direct) {
+        close();
+        if (!queueDepth) return false;
+
+#if defined(_WIN32)
+        is.open(file, std::ios::binary);
+        if (!is.is_open()) return false;
+        this->direct = false;
+#else
+        bufferedFd = ::open(file.c_str(), O_RDONLY);
+        if (bufferedFd < 0) return false;
+        fd = bufferedFd;
+#if defined(O_DIRECT)
+        if (direct) {
+            int directFd = ::open(file.c_str(), O_RDONLY | O_DIRECT);
+            if (directFd >= 0) fd = directFd;
+        }
+#endif
+        this->direct = fd != bufferedFd;
+#endif
+
+        // a read may start and end in the middle of an aligned block
+        slotSize = (maxReadSize + 2 * ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        memory = (char*)::operator new(slotSize * queueDepth, std::align_val_t(ALIGNMENT));
+        slots.resize(queueDepth);
+        for (size_t i = 0; i < queueDepth; ++i)
+            slots[i].buffer = memory + i * slotSize;
+
+#if defined(__linux__)
+        setupRing(queueDepth);
+#endif
+        return true;
+    }
+
+    void close() {
+        if (memory) {
+            for (size_t i = 0; i < slots.size(); ++i)
+                release((int)i);
+            // the memory of a lost slot is never freed
+            if (std::none_of(slots.begin(), slots.end(), [](const Slot& slot) { return slot.state == LOST; }))
+                ::operator delete(memory, std::align_val_t(ALIGNMENT));
+        }
+        memory = nullptr;
+        slots.clear();
+        numReading = 0;
+
+#if defined(__linux__)
+        closeRing();
+#endif
+
+#if defined(_WIN32)
+        is.close();
+#else
+        if (fd >= 0 && fd != bufferedFd) ::close(fd);
+        if (bufferedFd >= 0) ::close(bufferedFd);
+        fd = bufferedFd = -1;
+#endif
+    }
+
+    bool isOpen() const {
+        return memory;
+    }
+
+    bool usesIoUring() const {
+#if defined(__linux__)
+        return ringFd >= 0;
+#else
+        return false;
+#endif
+    }
+
+    // Queues a read of size bytes at offset, returns the slot that receives
+    // them or -1 if every slot is in use or lost. The reads start with
+    // submitQueued(), all of them with one syscall, or when one is waited for.
+    int queue(uint64_t offset, size_t size) {
+        int i = 0;
+        while (i < (int)slots.size() && slots[i].state != FREE) ++i;
+        if (i == (int)slots.size()) return -1;
+
+        Slot& slot = slots[i];
+        uint64_t begin = direct ? offset / ALIGNMENT * ALIGNMENT : offset;
+        uint64_t end = direct ? (offset + size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT : offset + size;
+        slot.offset = begin;
+        slot.size = end - begin;
+        slot.skip = offset - begin;
+        slot.requested = size;
+        slot.done = 0;
+        slot.state = READING;
+        ++numReading;
+
+#if defined(__linux__)
+        if (ringFd >= 0) queueRead(i);
+#endif
+        return i;
+    }
+
+    // Starts the queued reads.
+    void submitQueued() {
+#if defined(__linux__)
+        if (ringFd >= 0 && *sqTail != __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) && !enter(0)) fallBack();
+#endif
+    }
+
+    // Waits for the read into slot i, returns its data or nullptr if it failed.
+    const char* wait(int i) {
+        Slot& slot = slots[i];
+        while (slot.state == READING) {
+#if defined(__linux__)
+            if (ringFd >= 0) {
+                if (!reap() && !enter(1)) fallBack();
+                continue;
+            }
+#endif
+            finish(i, readSync(slot));
+        }
+        return slot.state == DONE ? slot.buffer + slot.skip : nullptr;
+    }
+
+    // Bytes of the requested range read into slot i, less than requested
+    // at the end of the file.
+    size_t readSize(int i) const {
+        const Slot& slot = slots[i];
+        return slot.done > slot.skip ? std::min(slot.done - slot.skip, slot.requested) : 0;
+    }
+
+    // Reads size bytes at offset into data now, with pread, for a few bytes
+    // not worth a buffer. Returns the bytes read, less at the end of the file.
+    size_t readNow(uint64_t offset, char* data, size_t size) {
+#if defined(_WIN32)
+        is.clear();
+        is.seekg(offset);
+        is.read(data, size);
+        return is.gcount();
+#else
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = ::pread(bufferedFd, data + done, size - done, (off_t)(offset + done));
+            if (n <= 0) break;
+            done += n;
+        }
+        return done;
+#endif
+    }
+
+    // Frees slot i, waiting for its read first.
+    void release(int i) {
+        if (slots[i].state == READING) wait(i);
+        if (slots[i].state != LOST) slots[i].state = FREE;
+    }
+
+    size_t reading() const {
+        return numReading;
+    }
+
+private:
+    // Reads the rest of the slot, stopping at the end of the file.
+    bool readSync(Slot& slot) {
+#if defined(_WIN32)
+        is.clear();
+        is.seekg(slot.offset + slot.done);
+        is.read(slot.buffer + slot.done, slot.size - slot.done);
+        slot.done += is.gcount();
+        return slot.done == slot.size || is.eof();
+#else
+        while (slot.done < slot.size) {
+            ssize_t n = ::pread(bufferedFd, slot.buffer + slot.done, slot.size - slot.done, (off_t)(slot.offset + slot.done));
+            if (n < 0) return false;
+            if (n == 0) break;
+            slot.done += n;
+        }
+        return true;
+#endif
+    }
+
+    void finish(int i, bool ok) {
+        slots[i].state = ok ? DONE : FAILED;
+        --numReading;
+    }
+
+#if defined(__linux__)
+    static int ioUringSetup(unsigned entries, io_uring_params* p) {
+        return (int)::syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return (int)::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+    }
+
+    static int ioUringRegister(int fd, unsigned opcode, const void* arg, unsigned nrArgs) {
+        return (int)::syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+    }
+
+    // Leaves ringFd at -1 if io_uring cannot be used, reads then use pread.
+    void setupRing(size_t queueDepth) {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        ringFd = ioUringSetup((unsigned)queueDepth, &p);
+        if (ringFd < 0) return;
+
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) sqRing = nullptr;
+        cqRing = singleMmap ? sqRing
+            : ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) cqRing = nullptr;
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        void* s = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        sqes = s == MAP_FAILED ? nullptr : (io_uring_sqe*)s;
+        if (!sqRing || !cqRing || !sqes) {
+            closeRing();
+            return;
+        }
+
+        char* sq = (char*)sqRing;
+        char* cq = (char*)cqRing;
+        sqHead = (unsigned*)(sq + p.sq_off.head);
+        sqTail = (unsigned*)(sq + p.sq_off.tail);
+        sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sqArray = (unsigned*)(sq + p.sq_off.array);
+        cqHead = (unsigned*)(cq + p.cq_off.head);
+        cqTail = (unsigned*)(cq + p.cq_off.tail);
+        cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+        // without registered buffers, e.g. over the locked memory limit,
+        // every read maps its buffer
+        std::vector<iovec> buffers(slots.size());
+        for (size_t i = 0; i < slots.size(); ++i)
+            buffers[i] = { slots[i].buffer, slotSize };
+        fixedBuffers = ioUringRegister(ringFd, IORING_REGISTER_BUFFERS, buffers.data(), (unsigned)buffers.size()) == 0;
+    }
+
+    void closeRing() {
+        if (sqes) ::munmap(sqes, sqesSize);
+        if (cqRing && cqRing != sqRing) ::munmap(cqRing, cqRingSize);
+        if (sqRing) ::munmap(sqRing, sqRingSize);
+        if (ringFd >= 0) ::close(ringFd);
+        sqes = nullptr;
+        sqRing = cqRing = nullptr;
+        ringFd = -1;
+        fixedBuffers = false;
+    }
+
+    // Adds the read of the rest of slot i to the submission queue, there is
+    // room since every slot has at most one read queued.
+    void queueRead(int i) {
+        Slot& slot = slots[i];
+        unsigned tail = *sqTail;
+        unsigned index = tail & *sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(io_uring_sqe));
+        sqe->opcode = fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(slot.buffer + slot.done);
+        sqe->len = (uint32_t)(slot.size - slot.done);
+        sqe->off = slot.offset + slot.done;
+        sqe->buf_index = (uint16_t)i;
+        sqe->user_data = (uint64_t)i;
+        sqArray[index] = index;
+        slot.queued = true;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    // Submits every queued read that the kernel has not taken yet and waits
+    // for minComplete reads, returns false if io_uring fails.
+    bool enter(unsigned minComplete) {
+        int r;
+        do {
+            unsigned toSubmit = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            r = ioUringEnter(ringFd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0);
+        } while (r < 0 && errno == EINTR);
+        return r >= 0;
+    }
+
+    // Handles the completed reads, returns false if there were none. A short
+    // read is continued unless it reached the end of the file.
+    bool reap() {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail) return false;
+        bool resubmit = false;
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes[head & *cqMask];
+            int i = (int)cqe.user_data;
+            Slot& slot = slots[i];
+            slot.queued = false;
+            if (cqe.res < 0) {
+                // e.g. direct I/O refused for this range
+                finish(i, readSync(slot));
+                continue;
+            }
+            slot.done += cqe.res;
+            if (cqe.res == 0 || slot.done == slot.size) finish(i, true);
+            else if (direct && slot.done % ALIGNMENT) finish(i, readSync(slot));
+            else {
+                queueRead(i);
+                resubmit = true;
+            }
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        if (resubmit && !enter(0)) fallBack();
+        return true;
+    }
+
+    // Gives up on io_uring after it failed. The ring is torn down in the
+    // background when it is closed, so the kernel may still write into the
+    // buffers of the reads in flight: they are waited for first, and if even
+    // that fails their slots are lost. The rest of every other unfinished
+    // read is done with pread.
+    void fallBack() {
+        // reads the kernel has not taken are not in flight
+        for (unsigned h = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE); h != *sqTail; ++h)
+            slots[sqes[sqArray[h & *sqMask]].user_data].queued = false;
+
+        auto inFlight = [&] {
+            return std::any_of(slots.begin(), slots.end(), [](const Slot& slot) { return slot.queued; });
+        };
+        while (inFlight()) {
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes[head & *cqMask];
+                Slot& slot = slots[cqe.user_data];
+                slot.queued = false;
+                if (cqe.res > 0) slot.done += cqe.res;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+            int r = 0;
+            if (inFlight())
+                do r = ioUringEnter(ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+                while (r < 0 && errno == EINTR);
+            if (r < 0) {
+                for (size_t i = 0; i < slots.size(); ++i)
+                    if (slots[i].queued) {
+                        slots[i].queued = false;
+                        slots[i].state = LOST;
+                        --numReading;
+                    }
+            }
+        }
+
+        closeRing();
+        for (size_t i = 0; i < slots.size(); ++i)
+            if (slots[i].state == READING) finish((int)i, readSync(slots[i]));
+    }
+#endif
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 #ifdef _MSC_VER
 #include<intrin.h>
 #endif
@@ -85,6 +87,21 @@ namespace chess {
 		}
 #endif
 
+		void mirrorHorizontal() {
+			constexpr uint64_t k1 = 0x5555555555555555;
+			constexpr uint64_t k2 = 0x3333333333333333;
+			constexpr uint64_t k4 = 0x0f0f0f0f0f0f0f0f;
+			data = data >> 1 & k1 | (data & k1) << 1;
+			data = data >> 2 & k2 | (data & k2) << 2;
+			data = data >> 4 & k4 | (data & k4) << 4;
+		}
+
+		Bitboard mirroredHorizontal() {
+			Bitboard copy(data);
+			copy.mirrorHorizontal();
+			return copy;
+		}
+
 		Square popLSB() {
 			Square s = LSB();
 			data &= data - 1;
@@ -1,3 +1,5 @@
+#pragma once
+
 #include<algorithm> // std::max
 #include<cstdlib> // std::abs
 #include<cstdint>
@@ -0,0 +1,220 @@
+#pragma once
+
+#include<charconv>
+#include<cstring> // std::memset
+#include<string>
+#include<string_view>
+
+#include"position.h"
+
+namespace chess {
+
+	// Position in 32 bytes for the training data loader: the occupied squares
+	// and one nibble per piece, in the order of the occupied squares from A1
+	// to H8. Has no mailbox board, so piece() is slow; feature extraction
+	// walks the pieces with forEachPiece() instead.
+	struct PackedPosition {
+		Bitboard occupied;
+		uint8_t pieces[16];
+		Square ksq[N_COLORS];
+		Color sideToMove;
+		CastlingRights castlingRights;
+		Square epSquare;
+		uint8_t rule50Cnt;
+		uint16_t ply;
+
+		PackedPosition() = default;
+		PackedPosition(std::string_view fen);
+		explicit PackedPosition(const Position& pos);
+
+		bool canCastle(uint8_t flag) const {
+			return castlingRights.data & flag;
+		}
+
+		bool canCastle() const {
+			return castlingRights.data;
+		}
+
+		Square kingSquare(Color c) const {
+			return ksq[c];
+		}
+
+		// piece of the i-th occupied square
+		Piece pieceAt(int i) const {
+			return pieces[i >> 1] >> (i & 1) * 4 & 0xf;
+		}
+
+		Piece piece(Square s) const {
+			if (!(occupied & Bitboard::fromSquare(s))) return NO_PIECE;
+			return pieceAt((occupied & (Bitboard::fromSquare(s).data - 1)).popcount());
+		}
+
+		// Calls f(square, piece) for every piece, in square order.
+		template<class F>
+		void forEachPiece(F&& f) const {
+			Bitboard bb = occupied;
+			for (int i = 0; bb; ++i)
+				f(bb.popLSB(), pieceAt(i));
+		}
+
+		Position unpack() const;
+		std::string fen() const;
+
+		void flip();
+		void mirror();
+
+	private:
+		void setPieceAt(int i, Piece pc) {
+			pieces[i >> 1] = pieces[i >> 1] & (0xf0 >> (i & 1) * 4) | pc << (i & 1) * 4;
+		}
+
+		// Packs the pieces of board, occupied has to be set.
+		void pack(const Piece* board) {
+			std::memset(pieces, 0, sizeof(pieces));
+			Bitboard bb = occupied;
+			for (int i = 0; bb; ++i)
+				setPieceAt(i, board[bb.popLSB()]);
+		}
+	};
+
+	static_assert(sizeof(PackedPosition) == 32);
+
+	// Parses the FEN like Position does, without a mailbox board: the pieces
+	// are listed from A8, so the index of each follows from the occupancy.
+	inline PackedPosition::PackedPosition(std::string_view fen) {
+		std::memset(this, 0, sizeof(PackedPosition));
+		size_t idx = 0;
+
+		Square squares[32];
+		Piece placed[32];
+		int n = 0;
+		Square sq = A8;
+		for (; idx < fen.size() && fen[idx] != ' '; ++idx) {
+			const FenTableEntry& e = Position::fenTable[fen[idx] & 0x7f];
+			if (e.setPiece && n < 32) {
+				squares[n] = sq;
+				placed[n++] = e.piece;
+				if (e.piece == WHITE_KING) ksq[WHITE] = sq;
+				else if (e.piece == BLACK_KING) ksq[BLACK] = sq;
+				occupied.set(sq);
+			}
+			sq += e.skip;
+		}
+		for (int i = 0; i < n; ++i)
+			setPieceAt((occupied & (Bitboard::fromSquare(squares[i]).data - 1)).popcount(), placed[i]);
+
+		auto field = [&]() {
+			while (idx < fen.size() && fen[idx] == ' ') ++idx;
+			size_t begin = idx;
+			while (idx < fen.size() && fen[idx] != ' ') ++idx;
+			return fen.substr(begin, idx - begin);
+		};
+
+		sideToMove = field() == "b" ? BLACK : WHITE;
+
+		for (char c : field()) {
+			switch (c) {
+			case 'K': castlingRights.data |= CastlingRights::WHITE_KING_SIDE; break;
+			case 'Q': castlingRights.data |= CastlingRights::WHITE_QUEEN_SIDE; break;
+			case 'k': castlingRights.data |= CastlingRights::BLACK_KING_SIDE; break;
+			case 'q': castlingRights.data |= CastlingRights::BLACK_QUEEN_SIDE; break;
+			}
+		}
+
+		std::string_view ep = field();
+		if (ep.size() == 2) epSquare = square::make(ep);
+
+		std::string_view rule50 = field();
+		std::from_chars(rule50.data(), rule50.data() + rule50.size(), rule50Cnt);
+
+		std::string_view moveNumber = field();
+		int numeric = 0;
+		if (std::from_chars(moveNumber.data(), moveNumber.data() + moveNumber.size(), numeric).ec == std::errc())
+			ply = 2 * (numeric - 1) + sideToMove;
+	}
+
+	inline PackedPosition::PackedPosition(const Position& pos) :
+		occupied(pos.occupied), ksq{ pos.ksq[WHITE], pos.ksq[BLACK] }, sideToMove(pos.sideToMove),
+		castlingRights(pos.castlingRights), epSquare(pos.epSquare), rule50Cnt(pos.rule50Cnt), ply(pos.ply)
+	{
+		pack(pos.board);
+	}
+
+	inline Position PackedPosition::unpack() const {
+		Position pos;
+		std::memset(&pos, 0, sizeof(Position));
+		forEachPiece([&](Square s, Piece pc) { pos.board[s] = pc; });
+		pos.ksq[WHITE] = ksq[WHITE];
+		pos.ksq[BLACK] = ksq[BLACK];
+		pos.occupied = occupied;
+		pos.sideToMove = sideToMove;
+		pos.castlingRights = castlingRights;
+		pos.epSquare = epSquare;
+		pos.rule50Cnt = rule50Cnt;
+		pos.ply = ply;
+		return pos;
+	}
+
+	inline std::string PackedPosition::fen() const {
+		constexpr char PIECE_CHARS[] = "?PNBRQK??pnbrqk";
+		Piece board[N_SQUARES] = {};
+		forEachPiece([&](Square s, Piece pc) { board[s] = pc; });
+
+		std::string fen;
+		for (Rank r = RANK_8; r >= RANK_1; --r) {
+			int empty = 0;
+			for (File f = FILE_A; f <= FILE_H; ++f) {
+				Piece pc = board[square::make(f, r)];
+				if (!pc) {
+					++empty;
+					continue;
+				}
+				if (empty) fen += char('0' + empty);
+				fen += PIECE_CHARS[pc];
+				empty = 0;
+			}
+			if (empty) fen += char('0' + empty);
+			if (r > RANK_1) fen += '/';
+		}
+
+		fen += sideToMove == WHITE ? " w " : " b ";
+		if (canCastle(CastlingRights::WHITE_KING_SIDE)) fen += 'K';
+		if (canCastle(CastlingRights::WHITE_QUEEN_SIDE)) fen += 'Q';
+		if (canCastle(CastlingRights::BLACK_KING_SIDE)) fen += 'k';
+		if (canCastle(CastlingRights::BLACK_QUEEN_SIDE)) fen += 'q';
+		if (!canCastle()) fen += '-';
+		fen += ' ';
+		fen += epSquare ? square::toString(epSquare) : "-";
+		fen += ' ' + std::to_string(rule50Cnt) + ' ' + std::to_string(ply / 2 + 1);
+		return fen;
+	}
+
+	// Same as Position::flip. The ranks change order, so the pieces are repacked.
+	inline void PackedPosition::flip() {
+		Piece board[N_SQUARES];
+		forEachPiece([&](Square s, Piece pc) { board[s ^ A8] = pc ^ 8; });
+		occupied.mirror();
+		pack(board);
+
+		Square wksq = ksq[WHITE];
+		ksq[WHITE] = ksq[BLACK] ^ A8;
+		ksq[BLACK] = wksq ^ A8;
+		sideToMove = !sideToMove;
+		castlingRights.data = castlingRights.data >> 2 | (castlingRights.data & 3) << 2;
+		if (epSquare) epSquare ^= A8;
+	}
+
+	// Same as Position::mirror, only valid without castling rights.
+	inline void PackedPosition::mirror() {
+		assert(!canCastle());
+		Piece board[N_SQUARES];
+		forEachPiece([&](Square s, Piece pc) { board[s ^ H1] = pc; });
+		occupied.mirrorHorizontal();
+		pack(board);
+
+		ksq[WHITE] ^= H1;
+		ksq[BLACK] ^= H1;
+		if (epSquare) epSquare ^= H1;
+	}
+
+} // namespace chess
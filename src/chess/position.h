@@ -1,4 +1,7 @@
-#include<cstring> // std::memset
+#pragma once
+
+#include<cassert>
+#include<cstring> // std::memcpy, std::memset
 #include<string>
 #include<sstream>
 
@@ -67,8 +70,47 @@ namespace chess {
 		Square kingSquare(Color c) const {
 			return ksq[c];
 		}
+
+		void flip();
+		void mirror();
 	};
 
+	// Mirrors the board vertically and swaps the colors of all pieces and the side to move.
+	inline void Position::flip() {
+		uint64_t ranks[N_RANKS];
+		std::memcpy(ranks, board, sizeof(board));
+		for (Rank r = RANK_1; r < N_RANKS; ++r) {
+			uint64_t pieces = ranks[RANK_8 - r];
+			// toggle the color bit of every non-empty square
+			pieces ^= ((pieces | pieces >> 1 | pieces >> 2) & 0x0101010101010101) << 3;
+			std::memcpy(&board[8 * r], &pieces, sizeof(uint64_t));
+		}
+
+		Square wksq = ksq[WHITE];
+		ksq[WHITE] = ksq[BLACK] ^ A8;
+		ksq[BLACK] = wksq ^ A8;
+		occupied.mirror();
+		sideToMove = !sideToMove;
+		castlingRights.data = castlingRights.data >> 2 | (castlingRights.data & 3) << 2;
+		if (epSquare) epSquare ^= A8;
+	}
+
+	// Mirrors the board horizontally. Only valid without castling rights.
+	inline void Position::mirror() {
+		assert(!canCastle());
+		for (Rank r = RANK_1; r < N_RANKS; ++r) {
+			Bitboard pieces;
+			std::memcpy(&pieces, &board[8 * r], sizeof(Bitboard));
+			pieces.mirror(); // byte swap reverses the files of a rank
+			std::memcpy(&board[8 * r], &pieces, sizeof(Bitboard));
+		}
+
+		ksq[WHITE] ^= H1;
+		ksq[BLACK] ^= H1;
+		occupied.mirrorHorizontal();
+		if (epSquare) epSquare ^= H1;
+	}
+
 	// From https://github.com/Luecx/CudAD/blob/main/src/position/fenparsing.h
 	void Position::init() {
 		std::memset(fenTable, 0, 128 * sizeof(FenTableEntry));
@@ -149,7 +191,8 @@ namespace chess {
 
 		// en passant target square
 		if (fen[idx] != '-') {
-			epSquare = square::make(file::CHAR_IDENTIFYERS[idx++], rank::CHAR_IDENTIFYERS[idx++]);
+			epSquare = square::make(fen.substr(idx, 2));
+			++idx;
 		}
 
 		idx += 2;
@@ -13,6 +13,20 @@ MAX_ACTIVE_FEATURES = 37
 WHITE = 0
 BLACK = 1
 
+# loader feature sets, see FeatureTransformer::FeatureSetId
+FEATURE_SET_KING_PIECES = 0
+FEATURE_SET_HALFKA_MIRRORED = 1
+FEATURE_SET_FACTORIZED = 2
+FEATURE_SET_KING_BUCKETS_4 = 3
+FEATURE_SET_KING_BUCKETS_8 = 4
+FEATURE_SET_KING_BUCKETS_16 = 5
+FEATURE_SET_KING_BUCKETS_32 = 6
+
+# loader augmentation flags
+NO_AUGMENTATION = 0
+AUGMENT_FLIP = 1
+AUGMENT_MIRROR = 2
+
 INPUT_SCALE = 127.
 OUTPUT_DIVISOR = 26.
 
@@ -1,99 +1,130 @@
 import ctypes
-import glob
 import numpy as np
-import os
 import sys
+import time
 import torch
 
 from constants import*
 
-# Default Visual Studio path
-libpath = os.path.abspath('build/Release/training_data_loader.dll')
+from library import lib, feature_set_info
 
-if not os.path.isfile(libpath):
-    local_libpath = [n for n in glob.glob('./*training_data_loader.*') if n.endswith('.so') or n.endswith('.dll') or n.endswith('.dylib')]
-    if not local_libpath:
-        print('Cannot find training_data_loader shared library.')
-        sys.exit(1)
-    libpath = os.path.abspath(local_libpath[0])
+if not lib:
+    print('Cannot find training_data_loader shared library.')
+    sys.exit(1)
 
-lib = ctypes.cdll.LoadLibrary(libpath)
-lib.init()
+# Tables of SamplingWeights, the keys of Config.sampling_weights: the
+# number of entries and the property each entry stands for.
+SAMPLING_WEIGHT_TABLES = {
+    'piece_count': 33,  # number of pieces including kings
+    'score_band': 16,   # |score| in steps of 100, the last holds every larger score
+    'result': 3,        # loss, draw and win of the side to move
+    'ply_band': 16      # ply in steps of 16, the last holds every later ply
+}
 
-class SparseBatch(ctypes.Structure):
-    _fields_ = [
-        ('size', ctypes.c_int64),
-        ('num_active_white_features', ctypes.c_int64),
-        ('num_active_black_features', ctypes.c_int64),
-        ('stm', ctypes.POINTER(ctypes.c_float)),
-        ('score', ctypes.POINTER(ctypes.c_float)),
-        ('game_result', ctypes.POINTER(ctypes.c_float)),
-        ('white_feature_indices', ctypes.POINTER(ctypes.c_int64)),
-        ('black_feature_indices', ctypes.POINTER(ctypes.c_int64)),
-        ('white_feature_values', ctypes.POINTER(ctypes.c_float)),
-        ('black_feature_values', ctypes.POINTER(ctypes.c_float))
+# The loader exports every batch as DLPack tensors, in this order:
+# stm, score, game result, white and black feature indices, white and
+# black feature values, see SparseBatchTensors.
+NUM_BATCH_TENSORS = 7
+
+_capsule_new = ctypes.pythonapi.PyCapsule_New
+_capsule_new.restype = ctypes.py_object
+_capsule_new.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]
+
+# Wraps a DLManagedTensor* without copying, torch calls its deleter
+# once the tensor is freed.
+def from_dlpack(managed_tensor):
+    return torch.utils.dlpack.from_dlpack(_capsule_new(managed_tensor, b'dltensor', None))
+
+# For CUDA the loader allocates the batch memory pinned, see
+# set_batch_memory_callbacks, so a batch is copied without a staging copy.
+_BATCH_MEMORY_CALLBACK = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_size_t)
+
+@_BATCH_MEMORY_CALLBACK
+def _pin_batch_memory(data, size):
+    torch.cuda.cudart().cudaHostRegister(data, size, 0)
+
+@_BATCH_MEMORY_CALLBACK
+def _unpin_batch_memory(data, size):
+    torch.cuda.cudart().cudaHostUnregister(data)
+
+def to_device(tensor, device):
+    return tensor.to(device=device, non_blocking=device.type == 'cuda')
+
+# Returns the batch on device and the tensors of the loader's memory, which
+# must live until an asynchronous copy is done.
+def get_tensors(managed_tensors, device, input_hsize):
+    host = [from_dlpack(t) for t in managed_tensors]
+    stm, score, game_result, white_feature_indices, black_feature_indices, white_feature_values, black_feature_values = [
+        to_device(t, device) for t in host
     ]
+    size = stm.shape[0]
 
-    def get_tensors(self, device):
-        stm = torch.from_numpy(
-            np.ctypeslib.as_array(self.stm, shape=(self.size, 1))
-        ).pin_memory().to(device=device, non_blocking=True)
-
-        score = torch.from_numpy(
-            np.ctypeslib.as_array(self.score, shape=(self.size, 1))
-        ).pin_memory().to(device=device, non_blocking=True)
-
-        game_result = torch.from_numpy(
-            np.ctypeslib.as_array(self.game_result, shape=(self.size, 1))
-        ).pin_memory().to(device=device, non_blocking=True)
-
-        white_feature_indices = torch.transpose(
-            torch.from_numpy(
-                np.ctypeslib.as_array(self.white_feature_indices, shape=(self.num_active_white_features, 2))
-            ).pin_memory().to(device=device, non_blocking=True), 
-            0, 1
-        ).long()
-        
-        black_feature_indices = torch.transpose(
-            torch.from_numpy(
-                np.ctypeslib.as_array(self.black_feature_indices, shape=(self.num_active_black_features, 2))
-            ).pin_memory().to(device=device, non_blocking=True), 
-            0, 1
-        ).long()
-
-        white_feature_values = torch.from_numpy(
-            np.ctypeslib.as_array(self.white_feature_values, shape=(self.num_active_white_features,))
-        ).pin_memory().to(device=device, non_blocking=True)
-
-        black_feature_values = torch.from_numpy(
-            np.ctypeslib.as_array(self.black_feature_values, shape=(self.num_active_black_features,))
-        ).pin_memory().to(device=device, non_blocking=True)
-
-        white_features = torch._sparse_coo_tensor_unsafe(
-            white_feature_indices, white_feature_values, (self.size, INPUT_HSIZE)
-        )
-        
-        black_features = torch._sparse_coo_tensor_unsafe(
-            black_feature_indices, black_feature_values, (self.size, INPUT_HSIZE)
-        )
+    white_features = torch._sparse_coo_tensor_unsafe(
+        white_feature_indices.t(), white_feature_values, (size, input_hsize)
+    )
+
+    black_features = torch._sparse_coo_tensor_unsafe(
+        black_feature_indices.t(), black_feature_values, (size, input_hsize)
+    )
 
-        white_features._coalesced_(True)
-        black_features._coalesced_(True)
+    white_features._coalesced_(True)
+    black_features._coalesced_(True)
+
+    return (white_features, black_features, stm, score, game_result), host
+
+class StreamStats(ctypes.Structure):
+    _fields_ = [
+        ('bytes_read', ctypes.c_uint64),
+        ('entries_parsed', ctypes.c_uint64),
+        ('entries_skipped', ctypes.c_uint64),
+        ('batches_built', ctypes.c_uint64),
+        ('io_time', ctypes.c_double),
+        ('compute_time', ctypes.c_double),
+        ('queue_occupancy', ctypes.c_uint64)
+    ]
 
-        return white_features, black_features, stm, score, game_result
+    def as_dict(self):
+        return {name: getattr(self, name) for name, _ in self._fields_}
 
 lib.create_sparse_batch_stream.restype = ctypes.c_void_p
-lib.create_sparse_batch_stream.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_float]
+lib.create_sparse_batch_stream.argtypes = [
+    ctypes.c_char_p, ctypes.c_size_t, ctypes.c_float, ctypes.c_uint8, ctypes.c_uint8,
+    ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_uint64
+]
 
 lib.destroy_sparse_batch_stream.argtypes = [ctypes.c_void_p]
 
-lib.next_sparse_batch.restype = ctypes.POINTER(SparseBatch)
-lib.next_sparse_batch.argtypes = [ctypes.c_void_p]
+# ctypes releases the GIL while the batch is built.
+lib.next_sparse_batch_tensors.restype = ctypes.c_bool
+lib.next_sparse_batch_tensors.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_void_p)]
 
-lib.destroy_sparse_batch.argtypes = [ctypes.c_void_p]
+lib.get_stream_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(StreamStats)]
+
+lib.set_sampling_weights.argtypes = [ctypes.c_void_p] + [ctypes.c_void_p] * 4
+
+lib.set_batch_memory_callbacks.argtypes = [ctypes.c_void_p, _BATCH_MEMORY_CALLBACK, _BATCH_MEMORY_CALLBACK]
+
+lib.set_shuffle.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_size_t]
+
+lib.set_async_read.restype = ctypes.c_bool
+lib.set_async_read.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_bool]
+
+lib.get_stream_state.restype = ctypes.c_size_t
+lib.get_stream_state.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+
+lib.set_stream_state.restype = ctypes.c_bool
+lib.set_stream_state.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+
+lib.enable_feature_counts.argtypes = [ctypes.c_void_p]
+
+lib.get_feature_counts.restype = ctypes.c_bool
+lib.get_feature_counts.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
 
 class Config:
-    def __init__(self, training_data, device, num_epochs, batch_size, lambda_, lr, lr_lambda, skip_entry_prob):
+    # rank and world_size default to those of torch.distributed, if it is initialized.
+    # shuffle_buffer is in positions and shuffle_block_size in bytes, 0 disables them.
+    # read_ahead is the number of blocks read asynchronously, 0 parses the mapped file.
+    def __init__(self, training_data, device, num_epochs, batch_size, lambda_, lr, lr_lambda, skip_entry_prob, augmentation=NO_AUGMENTATION, count_features=False, feature_set=FEATURE_SET_KING_PIECES, rank=None, world_size=None, seed=0, sampling_weights=None, shuffle_buffer=0, shuffle_block_size=0, read_ahead=0, direct_io=False):
         self.training_data = training_data
         self.device = device
         self.num_epochs = num_epochs
@@ -102,32 +133,126 @@ class Config:
         self.lr = lr
         self.lr_lambda = lr_lambda
         self.skip_entry_prob = skip_entry_prob
+        self.augmentation = augmentation
+        self.count_features = count_features
+        self.feature_set = feature_set
+        self.seed = seed
+        self.sampling_weights = sampling_weights or {}
+        for name, weights in self.sampling_weights.items():
+            if len(weights) != SAMPLING_WEIGHT_TABLES[name]:
+                raise Exception('Sampling weights {} need {} entries'.format(name, SAMPLING_WEIGHT_TABLES[name]))
+        self.shuffle_buffer = shuffle_buffer
+        self.shuffle_block_size = shuffle_block_size
+        self.read_ahead = read_ahead
+        self.direct_io = direct_io
+        self.input_hsize = feature_set_info(feature_set).input_size
+
+        distributed = torch.distributed.is_available() and torch.distributed.is_initialized()
+        self.rank = rank if rank is not None else torch.distributed.get_rank() if distributed else 0
+        self.world_size = world_size if world_size is not None else torch.distributed.get_world_size() if distributed else 1
 
+# Every rank and DataLoader worker reads its own shard of the training data,
+# so that each position is seen once per epoch over all of them. The stream is
+# created on the first iteration, in the worker process. Its random choices
+# depend only on config.seed, the epoch and the shard.
 class SparseBatchDataset(torch.utils.data.IterableDataset):
-    def __init__(self, config):
+    def __init__(self, config, epoch=0):
         super().__init__()
         self.config = config
+        self.epoch = epoch
+        self.stream = None
+        self.copy_time = 0
+        self.device = torch.device(self.config.device)
+        self.pending_copy = None
+        self.managed_tensors = (ctypes.c_void_p * NUM_BATCH_TENSORS)()
+        print('Initialize dataset')
+
+    def create_stream(self):
+        worker_info = torch.utils.data.get_worker_info()
         self.stream = lib.create_sparse_batch_stream(
-            ctypes.create_string_buffer(bytes(self.config.training_data, 'utf-8')), 
+            ctypes.create_string_buffer(bytes(self.config.training_data, 'utf-8')),
             self.config.batch_size,
-            self.config.skip_entry_prob
+            self.config.skip_entry_prob,
+            self.config.augmentation,
+            self.config.feature_set,
+            self.config.rank,
+            self.config.world_size,
+            worker_info.id if worker_info else 0,
+            worker_info.num_workers if worker_info else 1,
+            (self.config.seed + self.epoch * 0x9e3779b97f4a7c15) % 2**64
         )
-        print('Initialize dataset')
+        if self.device.type == 'cuda':
+            lib.set_batch_memory_callbacks(self.stream, _pin_batch_memory, _unpin_batch_memory)
+        if self.config.shuffle_buffer or self.config.shuffle_block_size:
+            lib.set_shuffle(self.stream, self.config.shuffle_buffer, self.config.shuffle_block_size)
+        if self.config.read_ahead and not lib.set_async_read(self.stream, self.config.read_ahead, self.config.direct_io):
+            raise Exception('Cannot read {}'.format(self.config.training_data))
+        if self.config.count_features:
+            lib.enable_feature_counts(self.stream)
+        if self.config.sampling_weights:
+            tables = [
+                np.ascontiguousarray(self.config.sampling_weights[name], dtype=np.float32)
+                if name in self.config.sampling_weights else None
+                for name in SAMPLING_WEIGHT_TABLES
+            ]
+            lib.set_sampling_weights(self.stream, *[t.ctypes.data if t is not None else None for t in tables])
 
     def __iter__(self):
+        if not self.stream:
+            self.create_stream()
         return self
     
     def __next__(self):
-        batch = lib.next_sparse_batch(self.stream)
-
-        if batch:
-            tensors = batch.contents.get_tensors(self.config.device)
-            lib.destroy_sparse_batch(batch)
+        if lib.next_sparse_batch_tensors(self.stream, self.managed_tensors):
+            begin = time.perf_counter()
+            tensors, host = get_tensors(self.managed_tensors, self.device, self.config.input_hsize)
+            # the batch memory of the previous copy goes back to the loader
+            # once it is done, the current copy runs meanwhile
+            if self.pending_copy:
+                self.pending_copy[0].synchronize()
+                self.pending_copy = None
+            if self.device.type == 'cuda':
+                event = torch.cuda.Event()
+                event.record()
+                self.pending_copy = (event, host)
+            self.copy_time += time.perf_counter() - begin
             return tensors
         
         else:
             raise StopIteration
+
+    # Position of the stream of this process, load_state continues from it.
+    def state(self):
+        if not self.stream:
+            self.create_stream()
+        size = lib.get_stream_state(self.stream, None, 0)
+        state = ctypes.create_string_buffer(size)
+        lib.get_stream_state(self.stream, state, size)
+        return state.raw
+
+    def load_state(self, state):
+        if not self.stream:
+            self.create_stream()
+        if not lib.set_stream_state(self.stream, state, len(state)):
+            raise Exception('The loader state belongs to another file, shard or shuffle setting')
+
+    # Stats and feature counts are those of the stream of this process, None
+    # if it did not iterate.
+    def stats(self):
+        if not self.stream:
+            return None
+        stats = StreamStats()
+        lib.get_stream_stats(self.stream, ctypes.byref(stats))
+        return dict(stats.as_dict(), copy_time=self.copy_time)
+
+    # How often every input feature was active, None unless config.count_features is set.
+    def feature_counts(self):
+        counts = np.zeros(self.config.input_hsize, dtype=np.uint64)
+        if not self.stream or not lib.get_feature_counts(self.stream, counts.ctypes.data):
+            return None
+        return counts
         
     def __del__(self):
-        lib.destroy_sparse_batch_stream(self.stream)
+        if self.stream:
+            lib.destroy_sparse_batch_stream(self.stream)
         print('Delete dataset')
\ No newline at end of file
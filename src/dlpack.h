@@ -0,0 +1,47 @@
+#pragma once
+
+#include<cstdint>
+
+// The subset of the DLPack ABI (https://github.com/dmlc/dlpack, dlpack.h)
+// used to hand batches to PyTorch without copying. Layouts must not change.
+extern "C" {
+
+    enum DLDeviceType : int32_t {
+        kDLCPU = 1
+    };
+
+    struct DLDevice {
+        DLDeviceType device_type;
+        int32_t device_id;
+    };
+
+    enum DLDataTypeCode : uint8_t {
+        kDLInt = 0,
+        kDLUInt = 1,
+        kDLFloat = 2
+    };
+
+    struct DLDataType {
+        uint8_t code;
+        uint8_t bits;
+        uint16_t lanes;
+    };
+
+    struct DLTensor {
+        void* data;
+        DLDevice device;
+        int32_t ndim;
+        DLDataType dtype;
+        int64_t* shape;
+        int64_t* strides;    // nullptr for compact row-major
+        uint64_t byte_offset;
+    };
+
+    // The consumer calls deleter once it no longer needs the tensor.
+    struct DLManagedTensor {
+        DLTensor dl_tensor;
+        void* manager_ctx;
+        void (*deleter)(DLManagedTensor* self);
+    };
+
+} // extern "C"
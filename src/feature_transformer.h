@@ -0,0 +1,380 @@
+#pragma once
+
+#include<algorithm> // std::sort
+#include<array>
+#include<cassert>
+
+#include"chess/packed_position.h"
+
+using namespace chess;
+
+using IndexType = uint64_t;
+
+namespace FeatureTransformer {
+
+    template<class T>
+    constexpr T ceilToMultiple(T n, T r) {
+        return (n + r - 1) / r * r;
+    }
+
+    constexpr int MAX_ACTIVE_FEATURES = 37;
+
+    constexpr int CASTLING_SIZE = 4;
+    constexpr int EN_PASSANT_SIZE = 8;
+    constexpr int MISC_SIZE = CASTLING_SIZE + EN_PASSANT_SIZE;
+    constexpr int PIECE_INPUT_SIZE = 41916;
+    constexpr int MISC_INPUT_SIZE = N_SQUARES * MISC_SIZE;  
+
+    constexpr int NUM_FEATURES = PIECE_INPUT_SIZE + MISC_INPUT_SIZE;
+    constexpr int PADDED_NUM_FEATURES = ceilToMultiple(NUM_FEATURES, 16);
+    constexpr int INPUT_HSIZE = PADDED_NUM_FEATURES;
+    constexpr int INPUT_SIZE = 2*INPUT_HSIZE;
+    constexpr int ACCUMULATOR_SIZE = 256;
+    constexpr int ACCUMULATOR_DSIZE = 2*ACCUMULATOR_SIZE;
+    constexpr int HIDDEN_1_SIZE = 32;
+    constexpr int HIDDEN_2_SIZE = 32;
+
+    inline uint16_t pieceIndices[N_COLORS][N_SQUARES][N_PIECES][N_SQUARES];
+
+    // Whether piece pc on psq has a feature from the perspective of c with the king on ksq.
+    inline bool isActive(Color c, Square ksq, Piece pc, Square psq) {
+        return !(pc == piece::make(c, KING) ||
+            psq == ksq ||
+            pc == piece::make(!c, KING) && square::distance(psq, ksq) == 1 ||
+            pieceType::make(pc) == PAWN && (RANK_1_BB | RANK_8_BB).isSet(psq));
+    }
+
+    inline void init() {
+        // initialize the index lookup table
+        size_t idx;
+        for (Color c : { WHITE, BLACK }) {
+            idx = 0;
+            for (Square ksq = A1; ksq < N_SQUARES; ++ksq) {
+                for (Color c_ : { WHITE, BLACK }) {
+                    for (PieceType pt = PAWN; pt < N_PIECE_TYPES; ++pt) {
+                        for (Square psq = A1; psq < N_SQUARES; ++psq) {
+
+                            Piece pc = piece::make(c_, pt);
+
+                            if (isActive(c, ksq, pc, psq))
+                                pieceIndices[c][ksq][pc][psq] = idx++;
+                        }
+                    }
+                }
+            }
+            assert(idx == PIECE_INPUT_SIZE);
+        }
+    }
+
+    // Writes the castling and en passant features, returns their number.
+    inline IndexType miscFeatures(uint8_t castlingRights, Square epSquare, Square ksq, IndexType* active) {
+        IndexType size = 0;
+        IndexType offset = PIECE_INPUT_SIZE + ksq * MISC_SIZE;
+
+        if (castlingRights) {
+            if (castlingRights & CastlingRights::WHITE_QUEEN_SIDE) active[size++] = offset;
+            if (castlingRights & CastlingRights::WHITE_KING_SIDE)  active[size++] = offset+1;
+            if (castlingRights & CastlingRights::BLACK_QUEEN_SIDE) active[size++] = offset+2;
+            if (castlingRights & CastlingRights::BLACK_KING_SIDE)  active[size++] = offset+3;
+        }
+
+        if (epSquare)
+            active[size++] = offset + CASTLING_SIZE + file::make(epSquare);
+
+        return size;
+    }
+
+    // Calls f(square, piece) for every piece of pos, in square order. Pos
+    // can be any position with a mailbox board or a PackedPosition.
+    template<class Pos, class F>
+    void forEachPiece(const Pos& pos, F&& f) {
+        Bitboard occupied = pos.occupied;
+        while (occupied) {
+            Square s = occupied.popLSB();
+            f(s, pos.piece(s));
+        }
+    }
+
+    template<class F>
+    void forEachPiece(const PackedPosition& pos, F&& f) {
+        pos.forEachPiece(f);
+    }
+
+    // Writes the unsorted active feature indices from the perspective of c,
+    // returns their number.
+    template<class Pos>
+    IndexType activeFeatures(const Pos& pos, Color c, IndexType* active) {
+        Square ksq = pos.kingSquare(c);
+        IndexType size = 0;
+
+        forEachPiece(pos, [&](Square s, Piece pc) {
+            if (s != ksq) active[size++] = pieceIndices[c][ksq][pc][s];
+        });
+
+        return size + miscFeatures(pos.castlingRights.data, pos.epSquare, ksq, active + size);
+    }
+
+    // Feature sets describe the sparse input of one perspective. Each provides
+    //   NAME        name used by the tools and train.py
+    //   INPUT_SIZE  number of features, padded to a multiple of 16
+    //   MAX_ACTIVE  upper bound of the features active in one position
+    //   active()    writes the unsorted active features, returns their number
+    // Feature sets a quantized network can use also provide, for incremental
+    // updates while the king of the perspective stays on its square,
+    //   piece()     feature of a piece other than the perspective's king
+    //   misc()      writes the castling and en passant features
+
+    // King-relative pieces plus castling and en passant, see pieceIndices.
+    struct KingPieces {
+        static constexpr const char* NAME = "king-pieces";
+        static constexpr int INPUT_SIZE = INPUT_HSIZE;
+        static constexpr int MAX_ACTIVE = MAX_ACTIVE_FEATURES;
+
+        template<class Pos>
+        static IndexType active(const Pos& pos, Color c, IndexType* active) {
+            return activeFeatures(pos, c, active);
+        }
+
+        static IndexType piece(Color c, Square ksq, Piece pc, Square s) {
+            return pieceIndices[c][ksq][pc][s];
+        }
+
+        static IndexType misc(uint8_t castlingRights, Square epSquare, Square ksq, Color, IndexType* active) {
+            return miscFeatures(castlingRights, epSquare, ksq, active);
+        }
+    };
+
+    // All pieces including both kings, relative to the king square of the
+    // perspective. The board is flipped for black and mirrored so that the
+    // king is on files A-D, leaving 32 king squares.
+    struct HalfKAMirrored {
+        static constexpr const char* NAME = "halfka-mirrored";
+        static constexpr int NUM_KING_SQUARES = 32;
+        static constexpr int INPUT_SIZE = NUM_KING_SQUARES * 2 * 6 * N_SQUARES;
+        static constexpr int MAX_ACTIVE = 32;
+
+        // index of pc from the perspective of c, own pieces first
+        static constexpr int pieceIndex(Piece pc, Color c) {
+            return (color::make(pc) != c) * 6 + pieceType::make(pc) - PAWN;
+        }
+
+        // flips the board for black and mirrors it if the king is on files E-H
+        static constexpr int orientation(Color c, Square ksq) {
+            return (c == WHITE ? 0 : 56) ^ (file::make(ksq) >= FILE_E ? 7 : 0);
+        }
+
+        template<class Pos>
+        static IndexType active(const Pos& pos, Color c, IndexType* active) {
+            int orient = orientation(c, pos.kingSquare(c));
+            IndexType offset = kingOffset(pos.kingSquare(c) ^ orient);
+
+            IndexType size = 0;
+            forEachPiece(pos, [&](Square s, Piece pc) {
+                active[size++] = offset + pieceIndex(pc, c) * N_SQUARES + (s ^ orient);
+            });
+            return size;
+        }
+
+        static IndexType piece(Color c, Square ksq, Piece pc, Square s) {
+            int orient = orientation(c, ksq);
+            return kingOffset(ksq ^ orient) + pieceIndex(pc, c) * N_SQUARES + (s ^ orient);
+        }
+
+        // first feature of the oriented king square ksq
+        static constexpr IndexType kingOffset(Square ksq) {
+            return (rank::make(ksq) * 4 + file::make(ksq)) * 2 * 6 * N_SQUARES;
+        }
+
+        static IndexType misc(uint8_t, Square, Square, Color, IndexType*) {
+            return 0;
+        }
+    };
+
+    // KingPieces with the board oriented like in HalfKAMirrored and the 32
+    // remaining king squares grouped into NUM_BUCKETS buckets, see bucket().
+    // Mirroring shares the weights of a position and its mirror image, and
+    // fewer buckets shrink the feature transformer. Pieces next to or on the
+    // king square are not pruned as that depends on the exact king square.
+    template<int NUM_BUCKETS>
+    struct KingBuckets {
+        static_assert(NUM_BUCKETS == 4 || NUM_BUCKETS == 8 || NUM_BUCKETS == 16 || NUM_BUCKETS == 32);
+
+        static constexpr const char* NAME =
+            NUM_BUCKETS == 4 ? "king-buckets-4" :
+            NUM_BUCKETS == 8 ? "king-buckets-8" :
+            NUM_BUCKETS == 16 ? "king-buckets-16" : "king-buckets-32";
+
+        // all pieces but the own king, no pawns on the first and last rank
+        static constexpr int PIECE_SIZE = 11 * N_SQUARES - 2 * 2 * 8;
+        static constexpr int BUCKET_SIZE = PIECE_SIZE + MISC_SIZE;
+        static constexpr int INPUT_SIZE = ceilToMultiple(NUM_BUCKETS * BUCKET_SIZE, 16);
+        static constexpr int MAX_ACTIVE = MAX_ACTIVE_FEATURES;
+
+        // One bucket per file on each of the first NUM_BUCKETS / 4 - 1 ranks,
+        // where the king spends most of the game, and one per file for the
+        // rest of the board. ksq is oriented, so on files A-D.
+        static constexpr int bucket(Square ksq) {
+            return std::min<int>(rank::make(ksq), NUM_BUCKETS / 4 - 1) * 4 + file::make(ksq);
+        }
+
+        // index within a bucket of HalfKAMirrored::pieceIndex on an oriented square, -1 if pruned
+        static constexpr std::array<int16_t, 12 * N_SQUARES> pieceTable() {
+            std::array<int16_t, 12 * N_SQUARES> table = {};
+            int16_t idx = 0;
+            for (int p = 0; p < 12; ++p)
+                for (int s = 0; s < N_SQUARES; ++s) {
+                    bool pawn = p % 6 == 0;
+                    bool backRank = s < 8 || s >= 56;
+                    table[p * N_SQUARES + s] = p == 5 || pawn && backRank ? -1 : idx++;
+                }
+            return table;
+        }
+
+        static constexpr std::array<int16_t, 12 * N_SQUARES> PIECE_TABLE = pieceTable();
+
+        template<class Pos>
+        static IndexType active(const Pos& pos, Color c, IndexType* active) {
+            Square ksq = pos.kingSquare(c);
+            int orient = HalfKAMirrored::orientation(c, ksq);
+            IndexType offset = bucket(ksq ^ orient) * BUCKET_SIZE;
+
+            IndexType size = 0;
+            forEachPiece(pos, [&](Square s, Piece pc) {
+                if (s != ksq) active[size++] = offset + PIECE_TABLE[HalfKAMirrored::pieceIndex(pc, c) * N_SQUARES + (s ^ orient)];
+            });
+            return size + misc(pos.castlingRights.data, pos.epSquare, ksq, c, active + size);
+        }
+
+        static IndexType piece(Color c, Square ksq, Piece pc, Square s) {
+            int orient = HalfKAMirrored::orientation(c, ksq);
+            return bucket(ksq ^ orient) * BUCKET_SIZE + PIECE_TABLE[HalfKAMirrored::pieceIndex(pc, c) * N_SQUARES + (s ^ orient)];
+        }
+
+        // The own castling rights come first, queen side first. On a mirrored
+        // board the sides and the en passant file are mirrored as well.
+        static IndexType misc(uint8_t castlingRights, Square epSquare, Square ksq, Color c, IndexType* active) {
+            int orient = HalfKAMirrored::orientation(c, ksq);
+            int mirror = orient & 7;
+            IndexType offset = bucket(ksq ^ orient) * BUCKET_SIZE + PIECE_SIZE;
+            uint8_t rights = c == WHITE ? castlingRights : (castlingRights >> 2 | castlingRights << 2) & 0xf;
+
+            IndexType size = 0;
+            for (int i = 0; i < CASTLING_SIZE; ++i)
+                if (rights & 1 << (i ^ (mirror & 1)))
+                    active[size++] = offset + i;
+
+            if (epSquare)
+                active[size++] = offset + CASTLING_SIZE + (file::make(epSquare) ^ mirror);
+
+            return size;
+        }
+    };
+
+    // KingPieces plus virtual piece-square features that do not depend on
+    // the king square. Their weights are learned in common for all king
+    // squares and are folded into the KingPieces weights before a net is
+    // quantized, see factor().
+    struct Factorized {
+        static constexpr const char* NAME = "factorized";
+        static constexpr int VIRTUAL_OFFSET = INPUT_HSIZE;
+        static constexpr int INPUT_SIZE = ceilToMultiple(INPUT_HSIZE + 2 * 6 * N_SQUARES, 16);
+        static constexpr int MAX_ACTIVE = MAX_ACTIVE_FEATURES + 31;
+
+        template<class Pos>
+        static IndexType active(const Pos& pos, Color c, IndexType* active) {
+            IndexType size = activeFeatures(pos, c, active);
+
+            Square ksq = pos.kingSquare(c);
+            forEachPiece(pos, [&](Square s, Piece pc) {
+                if (s != ksq) active[size++] = factor(pc, s, c);
+            });
+            return size;
+        }
+
+        // virtual feature of piece pc on square s from the perspective of c
+        static constexpr IndexType factor(Piece pc, Square s, Color c) {
+            return VIRTUAL_OFFSET + HalfKAMirrored::pieceIndex(pc, c) * N_SQUARES + (s ^ (c == WHITE ? 0 : 56));
+        }
+
+        // Writes the virtual feature of every KingPieces feature of
+        // perspective c, -1 for castling and en passant features.
+        static void factors(Color c, int64_t* map) {
+            std::fill(map, map + INPUT_HSIZE, -1);
+            for (Square ksq = A1; ksq < N_SQUARES; ++ksq)
+                for (Piece pc : { WHITE_PAWN, WHITE_KNIGHT, WHITE_BISHOP, WHITE_ROOK, WHITE_QUEEN, WHITE_KING,
+                        BLACK_PAWN, BLACK_KNIGHT, BLACK_BISHOP, BLACK_ROOK, BLACK_QUEEN, BLACK_KING })
+                    for (Square psq = A1; psq < N_SQUARES; ++psq)
+                        if (isActive(c, ksq, pc, psq))
+                            map[pieceIndices[c][ksq][pc][psq]] = factor(pc, psq, c);
+        }
+    };
+
+    // Feature sets selectable at stream creation, see withFeatureSet.
+    enum FeatureSetId : uint8_t {
+        KING_PIECES,
+        HALFKA_MIRRORED,
+        FACTORIZED,
+        KING_BUCKETS_4,
+        KING_BUCKETS_8,
+        KING_BUCKETS_16,
+        KING_BUCKETS_32,
+        N_FEATURE_SETS
+    };
+
+    // Calls f with a value of the feature set type id refers to.
+    template<class F>
+    decltype(auto) withFeatureSet(uint8_t id, F&& f) {
+        switch (id) {
+        case HALFKA_MIRRORED: return f(HalfKAMirrored{});
+        case FACTORIZED:      return f(Factorized{});
+        case KING_BUCKETS_4:  return f(KingBuckets<4>{});
+        case KING_BUCKETS_8:  return f(KingBuckets<8>{});
+        case KING_BUCKETS_16: return f(KingBuckets<16>{});
+        case KING_BUCKETS_32: return f(KingBuckets<32>{});
+        default:              return f(KingPieces{});
+        }
+    }
+
+    // Whether a quantized network can use the feature set, Factorized nets
+    // are folded into KingPieces before they are quantized.
+    constexpr bool isQuantizable(uint8_t id) {
+        return id < N_FEATURE_SETS && id != FACTORIZED;
+    }
+
+    // Same as withFeatureSet for the feature sets that provide piece() and misc().
+    template<class F>
+    decltype(auto) withQuantizableFeatureSet(uint8_t id, F&& f) {
+        switch (id) {
+        case HALFKA_MIRRORED: return f(HalfKAMirrored{});
+        case KING_BUCKETS_4:  return f(KingBuckets<4>{});
+        case KING_BUCKETS_8:  return f(KingBuckets<8>{});
+        case KING_BUCKETS_16: return f(KingBuckets<16>{});
+        case KING_BUCKETS_32: return f(KingBuckets<32>{});
+        default:              return f(KingPieces{});
+        }
+    }
+
+    template<class FeatureSet = KingPieces, class Pos>
+    void fillFeatures(
+        IndexType i,
+        const Pos& pos,
+        Color c, 
+        IndexType* featureIndices, 
+        float* featureValues, 
+        IndexType& numActiveFeatures) 
+    {
+        IndexType active[FeatureSet::MAX_ACTIVE];
+        IndexType size = FeatureSet::active(pos, c, active);
+
+        // sort the active feature indices
+        std::sort(active, active+size);
+
+        for (IndexType j = 0; j < size; ++j) {
+            IndexType idx = 2 * numActiveFeatures;
+            featureIndices[idx] = i;
+            featureIndices[idx+1] = active[j];
+            featureValues[numActiveFeatures++] = 1;
+        }
+    }
+
+} // namespace FeatureTransformer
@@ -0,0 +1,72 @@
+import ctypes
+import glob
+import numpy as np
+import os
+
+from constants import*
+
+# Default Visual Studio path
+libpath = os.path.abspath('build/Release/training_data_loader.dll')
+
+if not os.path.isfile(libpath):
+    local_libpath = [n for n in glob.glob('./*training_data_loader.*') if n.endswith('.so') or n.endswith('.dll') or n.endswith('.dylib')]
+    libpath = os.path.abspath(local_libpath[0]) if local_libpath else None
+
+class FeatureSetInfo(ctypes.Structure):
+    _fields_ = [
+        ('name', ctypes.c_char_p),
+        ('input_size', ctypes.c_int64),
+        ('max_active', ctypes.c_int64)
+    ]
+
+# The training_data_loader shared library, None if it cannot be found.
+lib = ctypes.cdll.LoadLibrary(libpath) if libpath else None
+
+if lib:
+    lib.init()
+
+    lib.nnue_num_parameters.restype = ctypes.c_size_t
+    lib.nnue_num_parameters.argtypes = [ctypes.c_uint8]
+
+    lib.nnue_feature_set.restype = ctypes.c_int
+    lib.nnue_feature_set.argtypes = [ctypes.c_char_p]
+
+    lib.nnue_read.restype = ctypes.c_bool
+    lib.nnue_read.argtypes = [ctypes.c_char_p, ctypes.c_void_p]
+
+    lib.nnue_error.restype = ctypes.c_char_p
+
+    lib.nnue_write.restype = ctypes.c_bool
+    lib.nnue_write.argtypes = [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_uint8]
+
+    lib.nnue_write_compact.restype = ctypes.c_bool
+    lib.nnue_write_compact.argtypes = [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_uint8, ctypes.c_void_p, ctypes.c_uint64]
+
+    lib.get_feature_set_info.restype = ctypes.c_bool
+    lib.get_feature_set_info.argtypes = [ctypes.c_uint8, ctypes.POINTER(FeatureSetInfo)]
+
+    lib.get_feature_factors.argtypes = [ctypes.c_uint8, ctypes.c_void_p]
+
+# Name and sizes of a feature set as implemented by the loader.
+def feature_set_info(feature_set):
+    info = FeatureSetInfo()
+    if not lib.get_feature_set_info(feature_set, ctypes.byref(info)):
+        raise Exception('Unknown feature set {}'.format(feature_set))
+    return info
+
+# Virtual feature of every king-pieces feature of the factorized set from
+# the perspective of color, -1 if there is none.
+def feature_factors(color):
+    factors = np.empty(INPUT_HSIZE, dtype=np.int64)
+    lib.get_feature_factors(color, factors.ctypes.data)
+    return factors
+
+# Id of the feature set called name, see FeatureTransformer::FeatureSetId.
+def feature_set_id(name):
+    info = FeatureSetInfo()
+    feature_set = 0
+    while lib.get_feature_set_info(feature_set, ctypes.byref(info)):
+        if info.name.decode('utf-8') == name:
+            return feature_set
+        feature_set += 1
+    raise Exception('Unknown feature set {}'.format(name))
@@ -0,0 +1,174 @@
+#include<chrono>
+#include<iomanip>
+#include<sstream>
+#include<string>
+#include<thread>
+#include<tuple>
+
+#include"training_data_loader.h"
+
+// Streams training data through SparseBatchStream and reports the throughput
+// of every stage for each combination of batch size and thread count.
+// Every thread runs its own stream over the whole file, the way several
+// data loader workers would.
+
+using Clock = std::chrono::steady_clock;
+
+struct StageTimes {
+    double io;
+    double parse;
+    double alloc;
+    double fill;
+    size_t positions;
+    size_t batches;
+    size_t bytes;
+
+    void operator+=(const StageTimes& other) {
+        io += other.io;
+        parse += other.parse;
+        alloc += other.alloc;
+        fill += other.fill;
+        positions += other.positions;
+        batches += other.batches;
+        bytes += other.bytes;
+    }
+};
+
+double seconds(Clock::time_point t0, Clock::time_point t1) {
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+StageTimes run(const char* file, size_t batchSize, float skipEntryProb, uint8_t augmentation, uint8_t featureSet,
+    size_t readAhead, bool direct) {
+    StageTimes times = {};
+
+    auto t0 = Clock::now();
+    SparseBatchStream stream(file, batchSize, skipEntryProb, augmentation, featureSet);
+    if (readAhead) stream.setAsyncRead(readAhead, direct);
+    times.io = seconds(t0, Clock::now());
+    // waiting for blocks read ahead counts as io, not parse
+    double setupIo = stream.stats.ioTime;
+
+    for (;;) {
+        auto t1 = Clock::now();
+        bool ok = stream.readBatch();
+        auto t2 = Clock::now();
+        times.parse += seconds(t1, t2);
+        if (!ok) break;
+
+        auto [batch, t3, t4] = FeatureTransformer::withFeatureSet(featureSet, [&](auto set) {
+            SparseBatch* batch = new SparseBatch(stream.entries.size(), decltype(set)::MAX_ACTIVE);
+            auto t3 = Clock::now();
+            batch->fill(stream.entries, set);
+            return std::make_tuple(batch, t3, Clock::now());
+        });
+        delete batch;
+        auto t5 = Clock::now();
+
+        times.alloc += seconds(t2, t3) + seconds(t4, t5);
+        times.fill += seconds(t3, t4);
+        times.positions += stream.entries.size();
+        ++times.batches;
+    }
+    times.io += stream.stats.ioTime - setupIo;
+    times.parse -= stream.stats.ioTime - setupIo;
+    times.bytes = stream.stats.bytesRead;
+    return times;
+}
+
+std::vector<size_t> parseList(const char* arg) {
+    std::vector<size_t> values;
+    std::stringstream ss(arg);
+    std::string value;
+    while (std::getline(ss, value, ','))
+        values.push_back(std::stoul(value));
+    return values;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: loader_bench <training data> [options]\n"
+            << "  --batch-sizes <n,...>  default 1024,4096,16384\n"
+            << "  --threads <n,...>      default 1\n"
+            << "  --skip <p>             skip entry probability, default 0\n"
+            << "  --augmentation <n>     augmentation flags, default 0\n"
+            << "  --features <n>         feature set id, default 0 (king-pieces)\n"
+            << "  --read-ahead <n>       blocks read asynchronously, default 0 (mapped)\n"
+            << "  --direct               read ahead with direct I/O" << std::endl;
+        return 1;
+    }
+
+    const char* file = argv[1];
+    std::vector<size_t> batchSizes = { 1024, 4096, 16384 };
+    std::vector<size_t> threadCounts = { 1 };
+    float skipEntryProb = 0;
+    uint8_t augmentation = NO_AUGMENTATION;
+    uint8_t featureSet = FeatureTransformer::KING_PIECES;
+    size_t readAhead = 0;
+    bool direct = false;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--batch-sizes" && i+1 < argc) batchSizes = parseList(argv[++i]);
+        else if (arg == "--threads" && i+1 < argc) threadCounts = parseList(argv[++i]);
+        else if (arg == "--skip" && i+1 < argc) skipEntryProb = std::stof(argv[++i]);
+        else if (arg == "--augmentation" && i+1 < argc) augmentation = std::stoi(argv[++i]);
+        else if (arg == "--features" && i+1 < argc) featureSet = std::stoi(argv[++i]);
+        else if (arg == "--read-ahead" && i+1 < argc) readAhead = std::stoul(argv[++i]);
+        else if (arg == "--direct") direct = true;
+        else {
+            std::cout << "Unknown option " << arg << "." << std::endl;
+            return 1;
+        }
+    }
+
+    FeatureTransformer::init();
+    Position::init();
+
+    if (featureSet >= FeatureTransformer::N_FEATURE_SETS) {
+        std::cout << "Unknown feature set " << (int)featureSet << "." << std::endl;
+        return 1;
+    }
+
+    std::cout << std::setw(8) << "batch"
+        << std::setw(8) << "threads"
+        << std::setw(12) << "pos/s"
+        << std::setw(12) << "batches/s"
+        << std::setw(10) << "MB/s"
+        << std::setw(10) << "io %"
+        << std::setw(10) << "parse %"
+        << std::setw(10) << "alloc %"
+        << std::setw(10) << "fill %" << std::endl;
+
+    for (size_t batchSize : batchSizes) {
+        for (size_t numThreads : threadCounts) {
+            std::vector<StageTimes> results(numThreads);
+            std::vector<std::thread> threads;
+
+            auto t0 = Clock::now();
+            for (size_t i = 0; i < numThreads; ++i)
+                threads.emplace_back([&, i]() {
+                    results[i] = run(file, batchSize, skipEntryProb, augmentation, featureSet, readAhead, direct);
+                });
+            for (auto& t : threads)
+                t.join();
+            double elapsed = seconds(t0, Clock::now());
+
+            StageTimes total = {};
+            for (const auto& r : results)
+                total += r;
+            double busy = total.io + total.parse + total.alloc + total.fill;
+
+            std::cout << std::fixed << std::setprecision(1)
+                << std::setw(8) << batchSize
+                << std::setw(8) << numThreads
+                << std::setw(12) << std::setprecision(0) << total.positions / elapsed
+                << std::setw(12) << std::setprecision(1) << total.batches / elapsed
+                << std::setw(10) << total.bytes / elapsed * 1e-6
+                << std::setw(10) << 100 * total.io / busy
+                << std::setw(10) << 100 * total.parse / busy
+                << std::setw(10) << 100 * total.alloc / busy
+                << std::setw(10) << 100 * total.fill / busy << std::endl;
+        }
+    }
+}
@@ -5,6 +5,73 @@ import pathlib
 import shutil
 import subprocess
 
+def generate_cutechess(args, training_repos_src, train):
+    engine_repos_src = os.path.join(args.engine_repos, 'src')
+
+    command = 'mingw32-make -C \"{}\" clean'.format(engine_repos_src)
+    subprocess.run(command, shell=True)
+    
+    command = 'mingw32-make -C \"{}\"'.format(engine_repos_src)
+    subprocess.run(command, shell=True)
+    
+    engine = glob.glob(
+        os.path.join(engine_repos_src, '*exe')
+    )[0]
+
+    engine0_name = 'engine0'
+    engine1_name = 'engine1'
+    engine0 = os.path.join(args.root_dir, engine0_name + '.exe')
+    engine1 = os.path.join(args.root_dir, engine1_name + '.exe')
+
+    shutil.copy2(engine, engine0)
+    shutil.copy2(engine, engine1)
+
+    pgn_out = os.path.join(args.root_dir, 'out.pgn')
+
+    command = ' '.join([
+        'cutechess-cli',
+        '-engine', f'name={engine0_name}', f'cmd={engine0}',
+        '-engine', f'name={engine1_name}', f'cmd={engine1}',
+        '-pgnout', f'{pgn_out}',
+        '-openings', f'file={args.book}', 'order=random',
+
+        '-concurrency', f'{args.concurrency}',
+        '-rounds', f'{args.rounds}',
+        '-srand', f'{args.seed}',
+
+        '-each', f'tc={args.time_per_game}+{args.increment_per_move}', 
+        'proto=uci', f'option.Hash={args.hash}', f'option.Threads={args.threads}'
+    ])
+    subprocess.run(command, shell=True)
+
+    pgn_converter_path = os.path.join(training_repos_src, 'PGN-converter')
+
+    command = ' '.join([
+        'mingw32-make -C {} clean &'.format(pgn_converter_path),
+        'mingw32-make -C {} &'.format(pgn_converter_path),
+        os.path.join(pgn_converter_path, 'pgn_converter.exe'),
+        pgn_out,
+        train
+    ])
+    subprocess.run(command, shell=True)
+
+def generate_selfplay(args, training_repos_src, train):
+    selfplay_path = os.path.join(training_repos_src, 'selfplay')
+
+    command = ' '.join([
+        'mingw32-make -C {} clean &'.format(selfplay_path),
+        'mingw32-make -C {} &'.format(selfplay_path),
+        os.path.join(selfplay_path, 'selfplay.exe'),
+        os.path.join(args.engine_repos, 'networks/default.nnue'),
+        train,
+        f'--games {args.games}',
+        f'--threads {args.concurrency}',
+        f'--depth {args.depth}',
+        f'--random-plies {args.random_plies}',
+        f'--seed {args.seed}'
+    ])
+    subprocess.run(command, shell=True)
+
 def main():
     parser = argparse.ArgumentParser(
         formatter_class = argparse.ArgumentDefaultsHelpFormatter
@@ -23,6 +90,11 @@ def main():
     parser.add_argument('--hash', type=int, default=64)
     parser.add_argument('--threads', type=int, default=1)
 
+    parser.add_argument('--selfplay', action='store_true', help='Generate the training data with the selfplay tool instead of cutechess-cli')
+    parser.add_argument('--games', type=int, default=100000, help='Number of selfplay games')
+    parser.add_argument('--depth', type=int, default=6, help='Selfplay search depth')
+    parser.add_argument('--random_plies', type=int, default=8, help='Random moves at the start of each selfplay game')
+
     parser.add_argument('--num_epochs', type=int, default=30)
     parser.add_argument('--batch_size', type=int, default=1024)
     parser.add_argument('--lambda_', type=float, default=0.75)
@@ -36,62 +108,19 @@ def main():
             shutil.rmtree(args.root_dir)
 
         assert os.path.isdir(args.engine_repos)
-        assert os.path.isfile(args.book)
+        assert args.selfplay or os.path.isfile(args.book)
         assert os.path.isdir(args.training_repos)
 
-        engine_repos_src = os.path.join(args.engine_repos, 'src')
-
-        command = 'mingw32-make -C \"{}\" clean'.format(engine_repos_src)
-        subprocess.run(command, shell=True)
-        
-        command = 'mingw32-make -C \"{}\"'.format(engine_repos_src)
-        subprocess.run(command, shell=True)
-        
-        engine = glob.glob(
-            os.path.join(engine_repos_src, '*exe')
-        )[0]
-
-        engine0_name = 'engine0'
-        engine1_name = 'engine1'
-        engine0 = os.path.join(args.root_dir, engine0_name + '.exe')
-        engine1 = os.path.join(args.root_dir, engine1_name + '.exe')
-
         pathlib.Path(args.root_dir).mkdir()
 
-        shutil.copy2(engine, engine0)
-        shutil.copy2(engine, engine1)
-
-        pgn_out = os.path.join(args.root_dir, 'out.pgn')
-
-        command = ' '.join([
-            'cutechess-cli',
-            '-engine', f'name={engine0_name}', f'cmd={engine0}',
-            '-engine', f'name={engine1_name}', f'cmd={engine1}',
-            '-pgnout', f'{pgn_out}',
-            '-openings', f'file={args.book}', 'order=random',
-
-            '-concurrency', f'{args.concurrency}',
-            '-rounds', f'{args.rounds}',
-            '-srand', f'{args.seed}',
-
-            '-each', f'tc={args.time_per_game}+{args.increment_per_move}', 
-            'proto=uci', f'option.Hash={args.hash}', f'option.Threads={args.threads}'
-        ])
-        subprocess.run(command, shell=True)
-
         training_repos_src = os.path.join(args.training_repos, 'src')
-        pgn_converter_path = os.path.join(training_repos_src, 'PGN-converter')
         train = os.path.join(args.root_dir, 'out.td')
         net = os.path.join(args.root_dir, 'temp.pt')
 
-        command = ' '.join([
-            'mingw32-make -C {} clean &'.format(pgn_converter_path),
-            'mingw32-make -C {} &'.format(pgn_converter_path),
-            os.path.join(pgn_converter_path, 'pgn_converter.exe'),
-            pgn_out,
-            train
-        ])
-        subprocess.run(command, shell=True)
+        if args.selfplay:
+            generate_selfplay(args, training_repos_src, train)
+        else:
+            generate_cutechess(args, training_repos_src, train)
 
         command = ' '.join([
             'python',
@@ -0,0 +1,71 @@
+#pragma once
+
+#include<filesystem>
+#include<fstream>
+#include<vector>
+
+#if !defined(_WIN32)
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<unistd.h>
+#endif
+
+// Read-only view of a whole file. On POSIX systems the file is memory mapped,
+// elsewhere it is read into a buffer.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+#if defined(_WIN32)
+    std::vector<char> buffer;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const std::filesystem::path& file) {
+        close();
+
+#if defined(_WIN32)
+        std::ifstream is(file, std::ios::binary);
+        if (!is.is_open()) return false;
+        buffer.resize(std::filesystem::file_size(file));
+        is.read(buffer.data(), buffer.size());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+#else
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        off_t end = ::lseek(fd, 0, SEEK_END);
+        if (end <= 0) {
+            ::close(fd);
+            return end == 0;
+        }
+
+        void* p = ::mmap(nullptr, end, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+
+        data = (const char*)p;
+        size = end;
+        return true;
+#endif
+    }
+
+    void close() {
+#if defined(_WIN32)
+        buffer = {};
+#else
+        if (data) ::munmap((void*)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
@@ -5,10 +5,11 @@ from constants import*
 
 class NN(torch.nn.Module):
 
-    def __init__(self):
+    # input_hsize is the input size of the feature set, see dataset.feature_set_info
+    def __init__(self, input_hsize=INPUT_HSIZE):
         super().__init__()
-        self.linear_white_accumulator = torch.nn.Linear(INPUT_HSIZE, ACCUMULATOR_HSIZE)
-        self.linear_black_accumulator = torch.nn.Linear(INPUT_HSIZE, ACCUMULATOR_HSIZE)
+        self.linear_white_accumulator = torch.nn.Linear(input_hsize, ACCUMULATOR_HSIZE)
+        self.linear_black_accumulator = torch.nn.Linear(input_hsize, ACCUMULATOR_HSIZE)
         self.linear_1 = torch.nn.Linear(ACCUMULATOR_SIZE, HIDDEN_1_SIZE)
         self.linear_2 = torch.nn.Linear(HIDDEN_1_SIZE, HIDDEN_2_SIZE)
         self.linear_out = torch.nn.Linear(HIDDEN_2_SIZE, OUTPUT_SIZE)
@@ -0,0 +1,104 @@
+#pragma once
+
+#include<algorithm>
+#include<string>
+#include<vector>
+
+#include"nnue_file.h"
+
+namespace nnue {
+
+	// Float forward pass of model.NN, the reference the quantized Network
+	// is compared against. The feature transformer weights are transposed
+	// like in Network so that each feature owns a contiguous row.
+	struct FloatNetwork {
+		struct Trace {
+			float acc[N_COLORS][ACCUMULATOR_SIZE];
+			float input[ACCUMULATOR_DSIZE];
+			float in2[HIDDEN_1_SIZE];
+			float in3[HIDDEN_2_SIZE];
+			float out;
+		};
+
+		Architecture arch;
+		std::vector<float> params;
+		std::vector<float> ftWeights[N_COLORS];
+		const float* tensors[NUM_TENSORS];
+
+		// Reads raw float tensors (.f32) or dequantizes a .nnue file.
+		bool load(const std::filesystem::path& file, std::string& error) {
+			if (file.extension() == ".f32") {
+				if (!readFloats(file, params, arch)) {
+					error = "the size matches no feature set";
+					return false;
+				}
+			}
+			else if (!readNetwork(file, params, arch, &error))
+				return false;
+
+			const float* p = params.data();
+			for (size_t i = 0; i < NUM_TENSORS; ++i) {
+				tensors[i] = p;
+				p += arch.tensor(i).size();
+			}
+
+			for (Color c : { WHITE, BLACK }) {
+				const float* weights = tensors[WHITE_WEIGHT + c];
+				ftWeights[c].resize(arch.inputSize * ACCUMULATOR_SIZE);
+				for (size_t j = 0; j < ACCUMULATOR_SIZE; ++j)
+					for (size_t f = 0; f < arch.inputSize; ++f)
+						ftWeights[c][f * ACCUMULATOR_SIZE + j] = weights[j * arch.inputSize + f];
+			}
+			return true;
+		}
+
+		template<class Pos>
+		void refresh(Trace& trace, const Pos& pos, Color c) const {
+			IndexType active[MAX_ACTIVE_FEATURES];
+			IndexType size = withQuantizableFeatureSet(arch.featureSet, [&](auto set) {
+				return decltype(set)::active(pos, c, active);
+			});
+
+			float* acc = trace.acc[c];
+			std::copy_n(tensors[WHITE_BIAS + c], ACCUMULATOR_SIZE, acc);
+			for (IndexType i = 0; i < size; ++i) {
+				const float* row = &ftWeights[c][active[i] * ACCUMULATOR_SIZE];
+				for (int j = 0; j < ACCUMULATOR_SIZE; ++j)
+					acc[j] += row[j];
+			}
+		}
+
+		static void linear(const float* input, float* output, const float* biases, const float* weights, int in, int out) {
+			for (int o = 0; o < out; ++o) {
+				float sum = biases[o];
+				for (int i = 0; i < in; ++i)
+					sum += weights[o * in + i] * input[i];
+				output[o] = sum;
+			}
+		}
+
+		static void clamp(float* values, int size) {
+			for (int i = 0; i < size; ++i)
+				values[i] = std::clamp(values[i], 0.f, 1.f);
+		}
+
+		// Returns the output in float-space, see OUTPUT_SCALE.
+		template<class Pos>
+		float evaluate(const Pos& pos, Color stm, Trace& trace) const {
+			refresh(trace, pos, WHITE);
+			refresh(trace, pos, BLACK);
+
+			std::copy_n(trace.acc[stm], ACCUMULATOR_SIZE, trace.input);
+			std::copy_n(trace.acc[!stm], ACCUMULATOR_SIZE, trace.input + ACCUMULATOR_SIZE);
+			clamp(trace.input, ACCUMULATOR_DSIZE);
+
+			linear(trace.input, trace.in2, tensors[HIDDEN_1_BIAS], tensors[HIDDEN_1_WEIGHT], ACCUMULATOR_DSIZE, HIDDEN_1_SIZE);
+			clamp(trace.in2, HIDDEN_1_SIZE);
+			linear(trace.in2, trace.in3, tensors[HIDDEN_2_BIAS], tensors[HIDDEN_2_WEIGHT], HIDDEN_1_SIZE, HIDDEN_2_SIZE);
+			clamp(trace.in3, HIDDEN_2_SIZE);
+			linear(trace.in3, &trace.out, tensors[OUT_BIAS], tensors[OUT_WEIGHT], HIDDEN_2_SIZE, OUTPUT_SIZE);
+			return trace.out;
+		}
+	};
+
+} // namespace nnue
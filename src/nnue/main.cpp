@@ -0,0 +1,481 @@
+#include<chrono>
+#include<cmath>
+#include<iomanip>
+#include<iostream>
+#include<memory>
+#include<string>
+#include<thread>
+
+#include"float_network.h"
+#include"nnue.h"
+#include"../PGN-converter/pgn_converter.h"
+#include"../training_data.h"
+
+// score-space to WDL-space conversion and loss, see model.py
+constexpr double WDL_SCALE = 360;
+constexpr double LOSS_EXPONENT = 2.5;
+
+double scoreToWdl(double score) {
+	return 1 / (1 + std::exp(-score / WDL_SCALE));
+}
+
+struct EvalStats {
+	size_t positions;
+	double loss;
+	double absError;
+
+	void operator+=(const EvalStats& other) {
+		positions += other.positions;
+		loss += other.loss;
+		absError += other.absError;
+	}
+};
+
+std::vector<char> readFile(const std::filesystem::path& file) {
+	std::ifstream is(file, std::ios::binary);
+	if (!is.is_open()) return {};
+	std::vector<char> buffer(std::filesystem::file_size(file));
+	is.read(buffer.data(), buffer.size());
+	return buffer;
+}
+
+// Splits the records of a .td buffer into contiguous ranges of about equal size.
+std::vector<const char*> splitRecords(const std::vector<char>& buffer, size_t numRanges) {
+	std::vector<const char*> records;
+	const char* curr = buffer.data();
+	const char* end = buffer.data() + buffer.size();
+	do records.push_back(curr);
+	while (TrainingData::skip(curr, end));
+
+	std::vector<const char*> bounds;
+	size_t numRecords = records.size() - 1;
+	for (size_t i = 0; i <= numRanges; ++i)
+		bounds.push_back(records[numRecords * i / numRanges]);
+	return bounds;
+}
+
+EvalStats evaluateRange(const nnue::Network& network, const char* curr, const char* end, double lambda) {
+	EvalStats stats = {};
+	TrainingDataEntry e;
+
+	while (TrainingData::read(curr, end, e)) {
+		double prediction = nnue::toScore(network.evaluate(e.pos, e.pos.sideToMove));
+		double target = lambda * scoreToWdl(e.score) + (1 - lambda) * (e.result + 1) / 2.;
+
+		stats.loss += std::pow(std::abs(scoreToWdl(prediction) - target), LOSS_EXPONENT);
+		stats.absError += std::abs(prediction - e.score);
+		++stats.positions;
+	}
+	return stats;
+}
+
+int eval(int argc, char* argv[]) {
+	if (argc < 4) {
+		std::cout << "Usage: nnue eval <net.nnue> <training data> [--threads <n>] [--lambda <l>]" << std::endl;
+		return 1;
+	}
+
+	size_t numThreads = 1;
+	double lambda = 1;
+	for (int i = 4; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (arg == "--threads" && i+1 < argc) numThreads = std::stoul(argv[++i]);
+		else if (arg == "--lambda" && i+1 < argc) lambda = std::stod(argv[++i]);
+		else {
+			std::cout << "Unknown option " << arg << "." << std::endl;
+			return 1;
+		}
+	}
+
+	auto network = std::make_unique<nnue::Network>();
+	if (!network->load(argv[2])) {
+		std::cout << "Cannot load network " << argv[2] << ": " << network->error << "." << std::endl;
+		return 1;
+	}
+
+	std::vector<char> buffer = readFile(argv[3]);
+	std::vector<const char*> bounds = splitRecords(buffer, numThreads);
+
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	std::vector<EvalStats> results(numThreads);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < numThreads; ++i)
+		threads.emplace_back([&, i]() {
+			results[i] = evaluateRange(*network, bounds[i], bounds[i+1], lambda);
+		});
+	for (auto& t : threads)
+		t.join();
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	double elapsed = (t1-t0).count() * 1e-9;
+
+	EvalStats total = {};
+	for (const auto& r : results)
+		total += r;
+
+	std::cout << "Positions: " << total.positions << std::endl;
+	std::cout << "Positions/s: " << (size_t)(total.positions / elapsed) << std::endl;
+	std::cout << "Loss: " << total.loss / total.positions << std::endl;
+	std::cout << "Mean absolute error: " << total.absError / total.positions << std::endl;
+	std::cout << "Elapsed time: " << elapsed << std::endl;
+	return 0;
+}
+
+// Divergence of the quantized network from the float network at the
+// input of a layer, both in float-space.
+struct LayerStats {
+	size_t values;
+	double absDiff;
+	double maxDiff;
+	size_t clippedFloat;
+	size_t clippedQuantized;
+
+	void add(const float* reference, const int16_t* quantized, int size) {
+		for (int i = 0; i < size; ++i) {
+			double diff = std::abs(reference[i] - (double)quantized[i] / nnue::INPUT_SCALE);
+			absDiff += diff;
+			maxDiff = std::max(maxDiff, diff);
+			clippedFloat += reference[i] >= 1;
+			clippedQuantized += quantized[i] >= nnue::INPUT_SCALE;
+		}
+		values += size;
+	}
+
+	void operator+=(const LayerStats& other) {
+		values += other.values;
+		absDiff += other.absDiff;
+		maxDiff = std::max(maxDiff, other.maxDiff);
+		clippedFloat += other.clippedFloat;
+		clippedQuantized += other.clippedQuantized;
+	}
+};
+
+struct ReportStats {
+	static constexpr const char* LAYERS[] = { "linear_1", "linear_2", "linear_out" };
+
+	size_t positions;
+	LayerStats layers[3];
+	size_t accumulatorOverflows;
+	double outputAbsDiff;
+	double outputMaxDiff;
+	double floatAbsError;
+	double quantizedAbsError;
+
+	void operator+=(const ReportStats& other) {
+		positions += other.positions;
+		for (int i = 0; i < 3; ++i)
+			layers[i] += other.layers[i];
+		accumulatorOverflows += other.accumulatorOverflows;
+		outputAbsDiff += other.outputAbsDiff;
+		outputMaxDiff = std::max(outputMaxDiff, other.outputMaxDiff);
+		floatAbsError += other.floatAbsError;
+		quantizedAbsError += other.quantizedAbsError;
+	}
+};
+
+// Counts the accumulator values that wrap around in int16 arithmetic.
+template<class Pos>
+size_t accumulatorOverflows(const nnue::Network& network, const Pos& pos, Color c) {
+	IndexType active[nnue::MAX_ACTIVE_FEATURES];
+	IndexType size = network.withFeatureSet([&](auto set) {
+		return decltype(set)::active(pos, c, active);
+	});
+
+	size_t overflows = 0;
+	for (int j = 0; j < nnue::ACCUMULATOR_SIZE; ++j) {
+		int32_t sum = network.ftBiases[c][j];
+		for (IndexType i = 0; i < size; ++i)
+			sum += network.weights(c, active[i])[j];
+		overflows += sum < std::numeric_limits<int16_t>::min() || sum > std::numeric_limits<int16_t>::max();
+	}
+	return overflows;
+}
+
+ReportStats reportRange(const nnue::FloatNetwork& reference, const nnue::Network& network, const char* curr, const char* end) {
+	ReportStats stats = {};
+	TrainingDataEntry e;
+	nnue::FloatNetwork::Trace floatTrace;
+	nnue::Trace trace;
+	nnue::Accumulator acc;
+
+	while (TrainingData::read(curr, end, e)) {
+		Color stm = e.pos.sideToMove;
+		double expected = reference.evaluate(e.pos, stm, floatTrace) * nnue::OUTPUT_SCALE;
+
+		network.refresh(acc, e.pos, WHITE);
+		network.refresh(acc, e.pos, BLACK);
+		double actual = nnue::toScore(network.propagate(acc, stm, trace));
+
+		stats.layers[0].add(floatTrace.input, trace.input, nnue::ACCUMULATOR_DSIZE);
+		stats.layers[1].add(floatTrace.in2, trace.in2, nnue::HIDDEN_1_SIZE);
+		stats.layers[2].add(floatTrace.in3, trace.in3, nnue::HIDDEN_2_SIZE);
+		stats.accumulatorOverflows += accumulatorOverflows(network, e.pos, WHITE) + accumulatorOverflows(network, e.pos, BLACK);
+
+		double diff = std::abs(expected - actual);
+		stats.outputAbsDiff += diff;
+		stats.outputMaxDiff = std::max(stats.outputMaxDiff, diff);
+		stats.floatAbsError += std::abs(expected - e.score);
+		stats.quantizedAbsError += std::abs(actual - e.score);
+		++stats.positions;
+	}
+	return stats;
+}
+
+// Quantizes float weights the way serialize.py does and runs a sample of
+// training data through both the float and the quantized network.
+int report(int argc, char* argv[]) {
+	if (argc < 4) {
+		std::cout << "Usage: nnue report <net.f32|net.nnue> <training data> [--threads <n>]" << std::endl;
+		return 1;
+	}
+
+	size_t numThreads = 1;
+	for (int i = 4; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (arg == "--threads" && i+1 < argc) numThreads = std::stoul(argv[++i]);
+		else {
+			std::cout << "Unknown option " << arg << "." << std::endl;
+			return 1;
+		}
+	}
+
+	std::string error;
+	auto reference = std::make_unique<nnue::FloatNetwork>();
+	if (!reference->load(argv[2], error)) {
+		std::cout << "Cannot load network " << argv[2] << ": " << error << "." << std::endl;
+		return 1;
+	}
+
+	std::vector<char> quantized;
+	size_t saturated[nnue::NUM_TENSORS];
+	nnue::quantize(reference->params.data(), quantized, reference->arch, saturated);
+
+	auto network = std::make_unique<nnue::Network>();
+	if (!network->read(quantized.data(), quantized.size())) {
+		std::cout << "Cannot read quantized network: " << network->error << "." << std::endl;
+		return 1;
+	}
+
+	std::cout << std::left << std::setw(34) << "Tensor" << std::right
+		<< std::setw(12) << "saturated" << std::setw(14) << "max error" << std::endl;
+	nnue::NetworkFile file;
+	file.read(quantized.data(), quantized.size());
+	for (size_t i = 0; i < nnue::NUM_TENSORS; ++i) {
+		const nnue::Tensor t = reference->arch.tensor(i);
+
+		// largest difference between a weight and its quantized value, saturated ones included
+		double maxError = 0;
+		for (size_t j = 0; j < t.size(); ++j) {
+			size_t k = nnue::storedIndex(t, t.transposed, j);
+			double q = t.type == nnue::INT16 ? ((const int16_t*)file.sections[i])[k] : ((const int32_t*)file.sections[i])[k];
+			maxError = std::max(maxError, std::abs(q / t.scale - reference->tensors[i][j]));
+		}
+		std::cout << std::left << std::setw(34) << t.name << std::right
+			<< std::setw(12) << saturated[i] << std::setw(14) << std::setprecision(6) << maxError << std::endl;
+	}
+
+	std::vector<char> buffer = readFile(argv[3]);
+	std::vector<const char*> bounds = splitRecords(buffer, numThreads);
+
+	std::vector<ReportStats> results(numThreads);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < numThreads; ++i)
+		threads.emplace_back([&, i]() {
+			results[i] = reportRange(*reference, *network, bounds[i], bounds[i+1]);
+		});
+	for (auto& t : threads)
+		t.join();
+
+	ReportStats total = {};
+	for (const auto& r : results)
+		total += r;
+	if (!total.positions) {
+		std::cout << "No positions in " << argv[3] << "." << std::endl;
+		return 1;
+	}
+
+	std::cout << "\n" << std::left << std::setw(34) << "Layer input" << std::right
+		<< std::setw(12) << "mean diff" << std::setw(14) << "max diff"
+		<< std::setw(14) << "clipped f32" << std::setw(14) << "clipped int" << std::endl;
+	for (int i = 0; i < 3; ++i) {
+		const LayerStats& l = total.layers[i];
+		std::cout << std::left << std::setw(34) << ReportStats::LAYERS[i] << std::right << std::setprecision(6)
+			<< std::setw(12) << l.absDiff / l.values << std::setw(14) << l.maxDiff << std::setprecision(3)
+			<< std::setw(13) << 100. * l.clippedFloat / l.values << "%"
+			<< std::setw(13) << 100. * l.clippedQuantized / l.values << "%" << std::endl;
+	}
+
+	std::cout << std::setprecision(6) << "\nPositions: " << total.positions << std::endl;
+	std::cout << "Accumulator int16 overflows: " << total.accumulatorOverflows << std::endl;
+	std::cout << "Output divergence: " << total.outputAbsDiff / total.positions
+		<< " cp mean, " << total.outputMaxDiff << " cp max" << std::endl;
+	std::cout << "Mean absolute error, float: " << total.floatAbsError / total.positions << " cp" << std::endl;
+	std::cout << "Mean absolute error, quantized: " << total.quantizedAbsError / total.positions << " cp" << std::endl;
+	return 0;
+}
+
+// Replays PGN games and evaluates every position with incremental
+// accumulator updates, checking them against full refreshes.
+int replay(int argc, char* argv[]) {
+	using Clock = std::chrono::steady_clock;
+
+	if (argc < 4) {
+		std::cout << "Usage: nnue replay <net.nnue> <games.pgn>" << std::endl;
+		return 1;
+	}
+
+	auto network = std::make_unique<nnue::Network>();
+	if (!network->load(argv[2])) {
+		std::cout << "Cannot load network " << argv[2] << ": " << network->error << "." << std::endl;
+		return 1;
+	}
+
+	nnue::AccumulatorStack stack(*network);
+	nnue::Accumulator acc;
+	size_t positions = 0;
+	size_t mismatches = 0;
+	double incrementalTime = 0;
+	double refreshTime = 0;
+
+	auto evaluate = [&](const pgn::Position& pos) {
+		auto t0 = Clock::now();
+		network->refresh(acc, pos, WHITE);
+		network->refresh(acc, pos, BLACK);
+		auto t1 = Clock::now();
+		refreshTime += std::chrono::duration<double>(t1 - t0).count();
+
+		if (std::memcmp(&acc, &stack.top(), sizeof(nnue::Accumulator)) ||
+			network->propagate(acc, pos.stm) != stack.evaluate(pos.stm))
+			++mismatches;
+		++positions;
+	};
+
+	pgn::Converter converter(argv[3], {});
+	converter.onGameStart = [&](const pgn::Position& pos) {
+		stack.reset(pos);
+		evaluate(pos);
+	};
+	converter.onMove = [&](const pgn::Position& pos) {
+		auto t0 = Clock::now();
+		stack.push(pos);
+		incrementalTime += std::chrono::duration<double>(Clock::now() - t0).count();
+		evaluate(pos);
+	};
+	converter.parse();
+
+	std::cout << "Positions: " << positions << std::endl;
+	std::cout << "Mismatches: " << mismatches << std::endl;
+	std::cout << "Incremental update: " << incrementalTime / positions * 1e9 << " ns/position" << std::endl;
+	std::cout << "Full refresh: " << refreshTime / positions * 1e9 << " ns/position" << std::endl;
+	return mismatches != 0;
+}
+
+// Converts between the quantized .nnue format and raw float32 tensors (.f32).
+int convert(int argc, char* argv[]) {
+	if (argc < 4) {
+		std::cout << "Usage: nnue convert <source> <target>, each .nnue or .f32" << std::endl;
+		return 1;
+	}
+
+	std::filesystem::path source = argv[2];
+	std::filesystem::path target = argv[3];
+	std::vector<float> params;
+	nnue::Architecture arch;
+	std::string error;
+
+	if (source.extension() == ".nnue") {
+		if (!nnue::readNetwork(source, params, arch, &error)) {
+			std::cout << "Cannot read " << source << ": " << error << "." << std::endl;
+			return 1;
+		}
+	}
+	else if (!(source.extension() == ".f32" && nnue::readFloats(source, params, arch))) {
+		std::cout << "Cannot read " << source << ", expected a .nnue file or a .f32 file of the size of a feature set, "
+			<< nnue::NUM_PARAMETERS * sizeof(float) << " bytes for king-pieces." << std::endl;
+		return 1;
+	}
+
+	bool ok = target.extension() == ".nnue" ? nnue::writeNetwork(target, params.data(), arch)
+		: target.extension() == ".f32" ? nnue::writeFloats(target, params)
+		: false;
+	if (!ok) {
+		std::cout << "Cannot write " << target << "." << std::endl;
+		return 1;
+	}
+
+	std::cout << "Converted " << source << " to " << target << "." << std::endl;
+	return 0;
+}
+
+// Prunes the feature transformer rows of features that are rarely active,
+// according to counters written by train.py --feature_counts.
+int compact(int argc, char* argv[]) {
+	if (argc < 5) {
+		std::cout << "Usage: nnue compact <net.nnue|net.f32> <feature counts> <target.nnue> [--min-count <n>]" << std::endl;
+		return 1;
+	}
+
+	uint64_t minCount = 1;
+	for (int i = 5; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (arg == "--min-count" && i+1 < argc) minCount = std::stoull(argv[++i]);
+		else {
+			std::cout << "Unknown option " << arg << "." << std::endl;
+			return 1;
+		}
+	}
+
+	std::string error;
+	auto network = std::make_unique<nnue::FloatNetwork>();
+	if (!network->load(argv[2], error)) {
+		std::cout << "Cannot load network " << argv[2] << ": " << error << "." << std::endl;
+		return 1;
+	}
+
+	const nnue::Architecture& arch = network->arch;
+	std::vector<char> counts = readFile(argv[3]);
+	if (counts.size() != arch.inputSize * sizeof(uint64_t)) {
+		std::cout << "Cannot read " << argv[3] << ", expected " << arch.inputSize << " uint64 counters." << std::endl;
+		return 1;
+	}
+
+	nnue::FeatureRemap remap = nnue::FeatureRemap::fromCounts((const uint64_t*)counts.data(),
+		std::max<uint64_t>(minCount, 1), arch.inputSize);
+	if (!nnue::writeNetwork(argv[4], network->params.data(), arch, &remap)) {
+		std::cout << "Cannot write " << argv[4] << "." << std::endl;
+		return 1;
+	}
+
+	std::cout << "Kept features: " << remap.numRows - 1 << " of " << arch.inputSize << std::endl;
+	std::cout << "File size: " << std::filesystem::file_size(argv[4]) << " bytes" << std::endl;
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	FeatureTransformer::init();
+	Position::init();
+	attacks::init();
+	pgn::init();
+
+	std::string_view command = argc > 1 ? argv[1] : "";
+
+	if (command == "eval")
+		return eval(argc, argv);
+	if (command == "replay")
+		return replay(argc, argv);
+	if (command == "convert")
+		return convert(argc, argv);
+	if (command == "report")
+		return report(argc, argv);
+	if (command == "compact")
+		return compact(argc, argv);
+
+	std::cout << "Usage: nnue <command> [arguments]\n"
+		<< "  eval     evaluate training data with a quantized network\n"
+		<< "  replay   evaluate PGN games with incremental updates\n"
+		<< "  convert  convert between .nnue and raw float tensors\n"
+		<< "  report   compare a float network with its quantized version\n"
+		<< "  compact  prune the rows of rarely active features" << std::endl;
+	return 1;
+}
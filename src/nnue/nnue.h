@@ -0,0 +1,503 @@
+#pragma once
+
+#include<cassert>
+#include<cstdlib>
+#include<cstring>
+#include<vector>
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+#define USE_AVX512
+#include<immintrin.h>
+#elif defined(__AVX2__)
+#define USE_AVX2
+#include<immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE2
+#include<emmintrin.h>
+#endif
+
+#include"nnue_file.h"
+
+namespace nnue {
+
+	constexpr int WEIGHT_SHIFT_HIDDEN_1 = 7;
+	constexpr int WEIGHT_SHIFT_HIDDEN_2 = 6;
+	static_assert(1 << WEIGHT_SHIFT_HIDDEN_1 == WEIGHT_SCALE_HIDDEN_1);
+	static_assert(1 << WEIGHT_SHIFT_HIDDEN_2 == WEIGHT_SCALE_HIDDEN_2);
+
+	// score-space to float-space
+	constexpr int OUTPUT_SCALE = 301;
+
+	constexpr size_t CACHE_LINE_SIZE = 64;
+
+	template<class T>
+	T* alignedAlloc(size_t n) {
+		size_t size = ceilToMultiple(n * sizeof(T), CACHE_LINE_SIZE);
+#if defined(_MSC_VER)
+		return (T*)_aligned_malloc(size, CACHE_LINE_SIZE);
+#else
+		return (T*)std::aligned_alloc(CACHE_LINE_SIZE, size);
+#endif
+	}
+
+	inline void alignedFree(void* p) {
+#if defined(_MSC_VER)
+		_aligned_free(p);
+#else
+		std::free(p);
+#endif
+	}
+
+	namespace simd {
+
+#if defined(USE_AVX512)
+		using vec_t = __m512i;
+		inline vec_t zero() { return _mm512_setzero_si512(); }
+		inline vec_t load(const void* p) { return _mm512_load_si512(p); }
+		inline void store(void* p, vec_t v) { _mm512_store_si512(p, v); }
+		inline vec_t add16(vec_t a, vec_t b) { return _mm512_add_epi16(a, b); }
+		inline vec_t sub16(vec_t a, vec_t b) { return _mm512_sub_epi16(a, b); }
+		inline vec_t add32(vec_t a, vec_t b) { return _mm512_add_epi32(a, b); }
+		inline vec_t madd16(vec_t a, vec_t b) { return _mm512_madd_epi16(a, b); }
+		inline vec_t clamp16(vec_t a, int hi) {
+			return _mm512_min_epi16(_mm512_max_epi16(a, zero()), _mm512_set1_epi16(hi));
+		}
+		inline int32_t sum32(vec_t a) { return _mm512_reduce_add_epi32(a); }
+
+#elif defined(USE_AVX2)
+		using vec_t = __m256i;
+		inline vec_t zero() { return _mm256_setzero_si256(); }
+		inline vec_t load(const void* p) { return _mm256_load_si256((const vec_t*)p); }
+		inline void store(void* p, vec_t v) { _mm256_store_si256((vec_t*)p, v); }
+		inline vec_t add16(vec_t a, vec_t b) { return _mm256_add_epi16(a, b); }
+		inline vec_t sub16(vec_t a, vec_t b) { return _mm256_sub_epi16(a, b); }
+		inline vec_t add32(vec_t a, vec_t b) { return _mm256_add_epi32(a, b); }
+		inline vec_t madd16(vec_t a, vec_t b) { return _mm256_madd_epi16(a, b); }
+		inline vec_t clamp16(vec_t a, int hi) {
+			return _mm256_min_epi16(_mm256_max_epi16(a, zero()), _mm256_set1_epi16(hi));
+		}
+		inline int32_t sum32(vec_t a) {
+			__m128i s = _mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+			s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+			s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+			return _mm_cvtsi128_si32(s);
+		}
+
+#elif defined(USE_SSE2)
+		using vec_t = __m128i;
+		inline vec_t zero() { return _mm_setzero_si128(); }
+		inline vec_t load(const void* p) { return _mm_load_si128((const vec_t*)p); }
+		inline void store(void* p, vec_t v) { _mm_store_si128((vec_t*)p, v); }
+		inline vec_t add16(vec_t a, vec_t b) { return _mm_add_epi16(a, b); }
+		inline vec_t sub16(vec_t a, vec_t b) { return _mm_sub_epi16(a, b); }
+		inline vec_t add32(vec_t a, vec_t b) { return _mm_add_epi32(a, b); }
+		inline vec_t madd16(vec_t a, vec_t b) { return _mm_madd_epi16(a, b); }
+		inline vec_t clamp16(vec_t a, int hi) {
+			return _mm_min_epi16(_mm_max_epi16(a, zero()), _mm_set1_epi16(hi));
+		}
+		inline int32_t sum32(vec_t a) {
+			a = _mm_add_epi32(a, _mm_shuffle_epi32(a, 0x4e));
+			a = _mm_add_epi32(a, _mm_shuffle_epi32(a, 0xb1));
+			return _mm_cvtsi128_si32(a);
+		}
+#endif
+
+#if defined(USE_AVX512) || defined(USE_AVX2) || defined(USE_SSE2)
+#define USE_SIMD
+		constexpr int LANES_16 = sizeof(vec_t) / sizeof(int16_t);
+
+		// number of registers used to hold a slice of the accumulator
+		constexpr int TILE_REGS = 8;
+		constexpr int TILE_SIZE = TILE_REGS * LANES_16;
+		static_assert(ACCUMULATOR_SIZE % TILE_SIZE == 0);
+#endif
+
+	} // namespace simd
+
+	struct alignas(CACHE_LINE_SIZE) Accumulator {
+		int16_t values[N_COLORS][ACCUMULATOR_SIZE];
+	};
+
+	template<int IN, int OUT>
+	struct Layer {
+		alignas(CACHE_LINE_SIZE) int32_t biases[OUT];
+		alignas(CACHE_LINE_SIZE) int16_t weights[OUT * IN];
+
+		void propagate(const int16_t* input, int32_t* output) const {
+			for (int o = 0; o < OUT; ++o) {
+				const int16_t* w = &weights[o * IN];
+#if defined(USE_SIMD)
+				static_assert(IN % simd::LANES_16 == 0);
+				simd::vec_t sum = simd::zero();
+				for (int i = 0; i < IN; i += simd::LANES_16)
+					sum = simd::add32(sum, simd::madd16(simd::load(&input[i]), simd::load(&w[i])));
+				output[o] = biases[o] + simd::sum32(sum);
+#else
+				int32_t sum = biases[o];
+				for (int i = 0; i < IN; ++i)
+					sum += input[i] * w[i];
+				output[o] = sum;
+#endif
+			}
+		}
+	};
+
+	inline void clippedRelu(const int32_t* input, int16_t* output, int size, int shift) {
+		for (int i = 0; i < size; ++i)
+			output[i] = std::clamp(input[i] >> shift, 0, INPUT_SCALE);
+	}
+
+	// Activations of every layer of a forward pass.
+	struct Trace {
+		alignas(CACHE_LINE_SIZE) int16_t input[ACCUMULATOR_DSIZE];
+		alignas(CACHE_LINE_SIZE) int32_t out1[HIDDEN_1_SIZE];
+		alignas(CACHE_LINE_SIZE) int16_t in2[HIDDEN_1_SIZE];
+		alignas(CACHE_LINE_SIZE) int32_t out2[HIDDEN_2_SIZE];
+		alignas(CACHE_LINE_SIZE) int16_t in3[HIDDEN_2_SIZE];
+		int32_t out;
+	};
+
+	// Quantized network as written by serialize.py. The feature transformer
+	// is used in place from the mapped file when its weights are stored
+	// transposed, so that each feature owns a contiguous row. Otherwise, as
+	// for legacy files, it is copied and transposed on load.
+	struct Network {
+		const int16_t* ftBiases[N_COLORS];
+		const int16_t* ftWeights[N_COLORS];
+		const int32_t* ftRemap = nullptr;	// feature to row of ftWeights, see FeatureRemap
+		Layer<ACCUMULATOR_DSIZE, HIDDEN_1_SIZE> hidden1;
+		Layer<HIDDEN_1_SIZE, HIDDEN_2_SIZE> hidden2;
+		Layer<HIDDEN_2_SIZE, OUTPUT_SIZE> output;
+
+		NetworkFile file;
+		std::string error;
+
+		Network() = default;
+
+		~Network() {
+			release();
+		}
+
+		Network(const Network&) = delete;
+		Network& operator=(const Network&) = delete;
+
+		bool load(const std::filesystem::path& path) {
+			release();
+			if (!file.open(path)) {
+				error = file.error;
+				return false;
+			}
+			init();
+			return true;
+		}
+
+		// Reads a .nnue file from memory, data must outlive the network.
+		bool read(const char* data, size_t size) {
+			release();
+			if (!file.read(data, size)) {
+				error = file.error;
+				return false;
+			}
+			init();
+			return true;
+		}
+
+		// Calls f with a value of the feature set type of the network.
+		template<class F>
+		decltype(auto) withFeatureSet(F&& f) const {
+			return withQuantizableFeatureSet(file.arch.featureSet, f);
+		}
+
+		// Feature transformer weights of feature f.
+		const int16_t* weights(Color c, IndexType f) const {
+			return &ftWeights[c][(size_t)(ftRemap ? ftRemap[f] : f) * ACCUMULATOR_SIZE];
+		}
+
+		// Computes the accumulator of perspective c from the active features.
+		void refresh(int16_t* acc, const IndexType* active, IndexType size, Color c) const {
+#if defined(USE_SIMD)
+			for (int t = 0; t < ACCUMULATOR_SIZE; t += simd::TILE_SIZE) {
+				simd::vec_t regs[simd::TILE_REGS];
+				for (int r = 0; r < simd::TILE_REGS; ++r)
+					regs[r] = simd::load(&ftBiases[c][t + r * simd::LANES_16]);
+
+				for (IndexType i = 0; i < size; ++i) {
+					const int16_t* row = weights(c, active[i]) + t;
+					for (int r = 0; r < simd::TILE_REGS; ++r)
+						regs[r] = simd::add16(regs[r], simd::load(&row[r * simd::LANES_16]));
+				}
+
+				for (int r = 0; r < simd::TILE_REGS; ++r)
+					simd::store(&acc[t + r * simd::LANES_16], regs[r]);
+			}
+#else
+			std::memcpy(acc, ftBiases[c], ACCUMULATOR_SIZE * sizeof(int16_t));
+			for (IndexType i = 0; i < size; ++i) {
+				const int16_t* row = weights(c, active[i]);
+				for (int j = 0; j < ACCUMULATOR_SIZE; ++j)
+					acc[j] += row[j];
+			}
+#endif
+		}
+
+		// Computes the accumulator of perspective c from the accumulator prev
+		// by adding and removing feature rows.
+		void update(
+			const int16_t* prev,
+			int16_t* acc,
+			const IndexType* added,
+			IndexType numAdded,
+			const IndexType* removed,
+			IndexType numRemoved,
+			Color c) const
+		{
+#if defined(USE_SIMD)
+			for (int t = 0; t < ACCUMULATOR_SIZE; t += simd::TILE_SIZE) {
+				simd::vec_t regs[simd::TILE_REGS];
+				for (int r = 0; r < simd::TILE_REGS; ++r)
+					regs[r] = simd::load(&prev[t + r * simd::LANES_16]);
+
+				for (IndexType i = 0; i < numRemoved; ++i) {
+					const int16_t* row = weights(c, removed[i]) + t;
+					for (int r = 0; r < simd::TILE_REGS; ++r)
+						regs[r] = simd::sub16(regs[r], simd::load(&row[r * simd::LANES_16]));
+				}
+
+				for (IndexType i = 0; i < numAdded; ++i) {
+					const int16_t* row = weights(c, added[i]) + t;
+					for (int r = 0; r < simd::TILE_REGS; ++r)
+						regs[r] = simd::add16(regs[r], simd::load(&row[r * simd::LANES_16]));
+				}
+
+				for (int r = 0; r < simd::TILE_REGS; ++r)
+					simd::store(&acc[t + r * simd::LANES_16], regs[r]);
+			}
+#else
+			std::memcpy(acc, prev, ACCUMULATOR_SIZE * sizeof(int16_t));
+			for (IndexType i = 0; i < numRemoved; ++i) {
+				const int16_t* row = weights(c, removed[i]);
+				for (int j = 0; j < ACCUMULATOR_SIZE; ++j)
+					acc[j] -= row[j];
+			}
+			for (IndexType i = 0; i < numAdded; ++i) {
+				const int16_t* row = weights(c, added[i]);
+				for (int j = 0; j < ACCUMULATOR_SIZE; ++j)
+					acc[j] += row[j];
+			}
+#endif
+		}
+
+		template<class Pos>
+		void refresh(Accumulator& acc, const Pos& pos, Color c) const {
+			IndexType active[MAX_ACTIVE_FEATURES];
+			IndexType size = withFeatureSet([&](auto set) {
+				return decltype(set)::active(pos, c, active);
+			});
+			refresh(acc.values[c], active, size, c);
+		}
+
+		// Returns the output in units of INPUT_SCALE * WEIGHT_SCALE_OUT.
+		int32_t propagate(const Accumulator& acc, Color stm) const {
+			Trace trace;
+			return propagate(acc, stm, trace);
+		}
+
+		// Same, keeping the activations of every layer in trace.
+		int32_t propagate(const Accumulator& acc, Color stm, Trace& trace) const {
+			// the side to move's accumulator comes first
+			const int16_t* perspectives[N_COLORS] = { acc.values[stm], acc.values[!stm] };
+			for (int p = 0; p < N_COLORS; ++p) {
+				int16_t* in = &trace.input[p * ACCUMULATOR_SIZE];
+#if defined(USE_SIMD)
+				for (int j = 0; j < ACCUMULATOR_SIZE; j += simd::LANES_16)
+					simd::store(&in[j], simd::clamp16(simd::load(&perspectives[p][j]), INPUT_SCALE));
+#else
+				for (int j = 0; j < ACCUMULATOR_SIZE; ++j)
+					in[j] = std::clamp<int16_t>(perspectives[p][j], 0, INPUT_SCALE);
+#endif
+			}
+
+			hidden1.propagate(trace.input, trace.out1);
+			clippedRelu(trace.out1, trace.in2, HIDDEN_1_SIZE, WEIGHT_SHIFT_HIDDEN_1);
+			hidden2.propagate(trace.in2, trace.out2);
+			clippedRelu(trace.out2, trace.in3, HIDDEN_2_SIZE, WEIGHT_SHIFT_HIDDEN_2);
+			output.propagate(trace.in3, &trace.out);
+			return trace.out;
+		}
+
+		template<class Pos>
+		int32_t evaluate(const Pos& pos, Color stm) const {
+			Accumulator acc;
+			refresh(acc, pos, WHITE);
+			refresh(acc, pos, BLACK);
+			return propagate(acc, stm);
+		}
+
+	private:
+		std::vector<int16_t*> owned;
+
+		void init() {
+			for (Color c : { WHITE, BLACK }) {
+				ftBiases[c] = readBiases(file.sections[WHITE_BIAS + c]);
+				ftWeights[c] = readWeights(file.sections[WHITE_WEIGHT + c], file.flags[WHITE_WEIGHT + c]);
+			}
+			ftRemap = file.remap;
+
+			auto readArray = [&](auto* dst, int tensor) {
+				std::memcpy(dst, file.sections[tensor], TENSORS[tensor].bytes());
+			};
+			readArray(hidden1.biases, HIDDEN_1_BIAS);
+			readArray(hidden1.weights, HIDDEN_1_WEIGHT);
+			readArray(hidden2.biases, HIDDEN_2_BIAS);
+			readArray(hidden2.weights, HIDDEN_2_WEIGHT);
+			readArray(output.biases, OUT_BIAS);
+			readArray(output.weights, OUT_WEIGHT);
+
+			// nothing refers to the file if the feature transformer was copied
+			if (owned.size() == 2 * N_COLORS && !ftRemap)
+				file.mapped.close();
+		}
+
+		static bool isAligned(const char* p) {
+			return (uintptr_t)p % CACHE_LINE_SIZE == 0;
+		}
+
+		const int16_t* readBiases(const char* data) {
+			if (isAligned(data)) return (const int16_t*)data;
+
+			int16_t* biases = alignedAlloc<int16_t>(ACCUMULATOR_SIZE);
+			std::memcpy(biases, data, ACCUMULATOR_SIZE * sizeof(int16_t));
+			owned.push_back(biases);
+			return biases;
+		}
+
+		const int16_t* readWeights(const char* data, uint8_t flags) {
+			if ((flags & SECTION_TRANSPOSED) && isAligned(data)) return (const int16_t*)data;
+
+			int16_t* copy = alignedAlloc<int16_t>(file.ftRows * ACCUMULATOR_SIZE);
+			if (flags & SECTION_TRANSPOSED)
+				std::memcpy(copy, data, file.ftRows * ACCUMULATOR_SIZE * sizeof(int16_t));
+			else {
+				// stored as [ACCUMULATOR_SIZE][inputSize]
+				const size_t inputSize = file.arch.inputSize;
+				const int16_t* stored = (const int16_t*)data;
+				for (size_t j = 0; j < ACCUMULATOR_SIZE; ++j)
+					for (size_t f = 0; f < inputSize; ++f)
+						std::memcpy(&copy[f * ACCUMULATOR_SIZE + j], &stored[j * inputSize + f], sizeof(int16_t));
+			}
+			owned.push_back(copy);
+			return copy;
+		}
+
+		void release() {
+			for (int16_t* p : owned)
+				alignedFree(p);
+			owned.clear();
+			ftRemap = nullptr;
+		}
+	};
+
+	// Accumulators of the positions along a line of play. A pushed position
+	// must report the board changes of its last move in pos.dirty, as
+	// pgn::Position does. Features are relative to the king square, so a
+	// perspective is refreshed from scratch when its own king has moved.
+	struct AccumulatorStack {
+		struct Entry {
+			Accumulator acc;
+			uint8_t castlingRights;
+			Square epSquare;
+		};
+
+		const Network& network;
+		std::vector<Entry> entries;
+		size_t size;
+
+		AccumulatorStack(const Network& network) : network(network), size(0) {}
+
+		template<class Pos>
+		void reset(const Pos& pos) {
+			size = 0;
+			Entry& e = allocate();
+			network.refresh(e.acc, pos, WHITE);
+			network.refresh(e.acc, pos, BLACK);
+			e.castlingRights = pos.castlingRights.data;
+			e.epSquare = pos.epSquare;
+		}
+
+		template<class Pos>
+		void push(const Pos& pos) {
+			network.withFeatureSet([&](auto set) {
+				push<decltype(set)>(pos);
+			});
+		}
+
+		template<class FeatureSet, class Pos>
+		void push(const Pos& pos) {
+			assert(size);
+			allocate();
+			const Entry& prev = entries[size-2];
+			Entry& e = entries[size-1];
+
+			for (Color c : { WHITE, BLACK }) {
+				Square ksq = pos.kingSquare(c);
+				Piece king = piece::make(c, KING);
+
+				bool kingMoved = false;
+				for (int i = 0; i < pos.dirty.size; ++i)
+					kingMoved |= pos.dirty.piece[i] == king;
+
+				if (kingMoved) {
+					network.refresh(e.acc, pos, c);
+					continue;
+				}
+
+				IndexType added[MAX_ACTIVE_FEATURES];
+				IndexType removed[MAX_ACTIVE_FEATURES];
+				IndexType numAdded = 0;
+				IndexType numRemoved = 0;
+
+				for (int i = 0; i < pos.dirty.size; ++i) {
+					IndexType idx = FeatureSet::piece(c, ksq, pos.dirty.piece[i], pos.dirty.square[i]);
+					if (pos.dirty.added[i]) added[numAdded++] = idx;
+					else                    removed[numRemoved++] = idx;
+				}
+
+				if (prev.castlingRights != pos.castlingRights.data || prev.epSquare != pos.epSquare) {
+					numRemoved += FeatureSet::misc(prev.castlingRights, prev.epSquare, ksq, c, removed + numRemoved);
+					numAdded += FeatureSet::misc(pos.castlingRights.data, pos.epSquare, ksq, c, added + numAdded);
+				}
+
+				network.update(prev.acc.values[c], e.acc.values[c], added, numAdded, removed, numRemoved, c);
+			}
+
+			e.castlingRights = pos.castlingRights.data;
+			e.epSquare = pos.epSquare;
+		}
+
+		void pop() {
+			assert(size > 1);
+			--size;
+		}
+
+		const Accumulator& top() const {
+			return entries[size-1].acc;
+		}
+
+		int32_t evaluate(Color stm) const {
+			return network.propagate(top(), stm);
+		}
+
+	private:
+		Entry& allocate() {
+			if (entries.size() == size)
+				entries.emplace_back();
+			return entries[size++];
+		}
+	};
+
+	// Converts the network output to a score relative to the side to move.
+	inline float toScore(int32_t out) {
+		return (float)out * OUTPUT_SCALE / (INPUT_SCALE * WEIGHT_SCALE_OUT);
+	}
+
+} // namespace nnue
@@ -0,0 +1,538 @@
+#pragma once
+
+#include<array>
+#include<cmath>
+#include<cstring>
+#include<filesystem>
+#include<fstream>
+#include<limits>
+#include<string>
+#include<vector>
+
+#include"../feature_transformer.h"
+#include"../mapped_file.h"
+
+namespace nnue {
+
+	using namespace FeatureTransformer;
+
+	constexpr int OUTPUT_SIZE = 1;
+
+	// quantization of the .nnue format, see constants.py
+	constexpr int INPUT_SCALE = 127;
+	constexpr int WEIGHT_SCALE_ACCUMULATOR = 127;
+	constexpr int WEIGHT_SCALE_HIDDEN_1 = 128;
+	constexpr int WEIGHT_SCALE_HIDDEN_2 = 64;
+	constexpr int WEIGHT_SCALE_OUT = 64;
+	constexpr int BIAS_SCALE_ACCUMULATOR = 127;
+	constexpr int BIAS_SCALE_HIDDEN_1 = INPUT_SCALE * WEIGHT_SCALE_HIDDEN_1;
+	constexpr int BIAS_SCALE_HIDDEN_2 = INPUT_SCALE * WEIGHT_SCALE_HIDDEN_2;
+	constexpr int BIAS_SCALE_OUT = INPUT_SCALE * WEIGHT_SCALE_OUT;
+
+	enum DataType : uint8_t {
+		INT16,
+		INT32
+	};
+
+	struct Tensor {
+		const char* name;
+		size_t rows;
+		size_t cols;
+		DataType type;
+		int scale;
+		// stored as [cols][rows] in versioned files, so that every input
+		// feature owns a contiguous row of the accumulator
+		bool transposed;
+
+		constexpr size_t size() const {
+			return rows * cols;
+		}
+
+		constexpr size_t bytes() const {
+			return size() * (type == INT16 ? sizeof(int16_t) : sizeof(int32_t));
+		}
+	};
+
+	// Tensors in file order. The float layout stores the same tensors as
+	// float32 in the same order and shapes as the parameters of model.NN.
+	constexpr Tensor TENSORS[] = {
+		{ "linear_white_accumulator.bias", ACCUMULATOR_SIZE, 1, INT16, BIAS_SCALE_ACCUMULATOR, false },
+		{ "linear_black_accumulator.bias", ACCUMULATOR_SIZE, 1, INT16, BIAS_SCALE_ACCUMULATOR, false },
+		{ "linear_white_accumulator.weight", ACCUMULATOR_SIZE, INPUT_HSIZE, INT16, WEIGHT_SCALE_ACCUMULATOR, true },
+		{ "linear_black_accumulator.weight", ACCUMULATOR_SIZE, INPUT_HSIZE, INT16, WEIGHT_SCALE_ACCUMULATOR, true },
+		{ "linear_1.bias", HIDDEN_1_SIZE, 1, INT32, BIAS_SCALE_HIDDEN_1, false },
+		{ "linear_1.weight", HIDDEN_1_SIZE, ACCUMULATOR_DSIZE, INT16, WEIGHT_SCALE_HIDDEN_1, false },
+		{ "linear_2.bias", HIDDEN_2_SIZE, 1, INT32, BIAS_SCALE_HIDDEN_2, false },
+		{ "linear_2.weight", HIDDEN_2_SIZE, HIDDEN_1_SIZE, INT16, WEIGHT_SCALE_HIDDEN_2, false },
+		{ "linear_out.bias", OUTPUT_SIZE, 1, INT32, BIAS_SCALE_OUT, false },
+		{ "linear_out.weight", OUTPUT_SIZE, HIDDEN_2_SIZE, INT16, WEIGHT_SCALE_OUT, false },
+	};
+
+	constexpr size_t NUM_TENSORS = std::size(TENSORS);
+
+	enum Tensors {
+		WHITE_BIAS, BLACK_BIAS, WHITE_WEIGHT, BLACK_WEIGHT,
+		HIDDEN_1_BIAS, HIDDEN_1_WEIGHT, HIDDEN_2_BIAS, HIDDEN_2_WEIGHT,
+		OUT_BIAS, OUT_WEIGHT
+	};
+
+	constexpr size_t numParameters() {
+		size_t size = 0;
+		for (const Tensor& t : TENSORS)
+			size += t.size();
+		return size;
+	}
+
+	constexpr size_t NUM_PARAMETERS = numParameters();
+
+	constexpr bool isFeatureTransformer(size_t tensor) {
+		return tensor == WHITE_WEIGHT || tensor == BLACK_WEIGHT;
+	}
+
+	// Versioned files start with a FileHeader followed by one SectionEntry per
+	// tensor. Every tensor starts at a multiple of SECTION_ALIGNMENT, so a
+	// mapped file can be used directly with aligned SIMD loads.
+	// All values are little endian.
+	constexpr char MAGIC[4] = { 'N', 'N', 'U', 'E' };
+	constexpr uint32_t VERSION = 1;
+	constexpr size_t SECTION_ALIGNMENT = 64;
+
+	enum SectionFlags : uint8_t {
+		SECTION_TRANSPOSED = 1,
+		SECTION_REMAP = 2		// feature remap table of a compacted file
+	};
+
+	struct FileHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t architecture;
+		uint32_t numSections;
+		uint32_t checksum;		// CRC-32 of the section data, padding excluded
+		uint32_t headerSize;	// header and section table, padded
+		uint64_t fileSize;
+	};
+
+	struct SectionEntry {
+		uint64_t offset;
+		uint64_t bytes;
+		uint8_t type;
+		uint8_t flags;
+		uint16_t reserved;
+		int32_t scale;
+	};
+
+	static_assert(sizeof(FileHeader) == 32);
+	static_assert(sizeof(SectionEntry) == 24);
+
+	// FNV-1a over the layer sizes and, unless it is KingPieces, the feature
+	// set, see architecture_hash in serialize.py.
+	constexpr uint32_t architectureHash(uint8_t featureSet = KING_PIECES, uint32_t inputSize = INPUT_HSIZE) {
+		uint32_t hash = 2166136261u;
+		auto add = [&](uint32_t value) {
+			for (int i = 0; i < 4; ++i) {
+				hash ^= (value >> (8 * i)) & 0xff;
+				hash *= 16777619u;
+			}
+		};
+		for (uint32_t value : { inputSize, (uint32_t)ACCUMULATOR_SIZE,
+				(uint32_t)HIDDEN_1_SIZE, (uint32_t)HIDDEN_2_SIZE, (uint32_t)OUTPUT_SIZE })
+			add(value);
+		if (featureSet != KING_PIECES)
+			add(featureSet);
+		return hash;
+	}
+
+	constexpr uint32_t ARCHITECTURE_HASH = architectureHash();
+
+	// Feature set of a network. Only the feature transformer weights depend
+	// on it, TENSORS describes the KingPieces network.
+	struct Architecture {
+		uint8_t featureSet = KING_PIECES;
+		size_t inputSize = INPUT_HSIZE;
+
+		Architecture() = default;
+
+		explicit Architecture(uint8_t featureSet) : featureSet(featureSet) {
+			inputSize = withFeatureSet(featureSet, [](auto set) {
+				return (size_t)decltype(set)::INPUT_SIZE;
+			});
+		}
+
+		Tensor tensor(size_t i) const {
+			Tensor t = TENSORS[i];
+			if (isFeatureTransformer(i)) t.cols = inputSize;
+			return t;
+		}
+
+		size_t numParameters() const {
+			return NUM_PARAMETERS + 2 * ACCUMULATOR_SIZE * (inputSize - INPUT_HSIZE);
+		}
+
+		uint32_t hash() const {
+			return architectureHash(featureSet, inputSize);
+		}
+
+		// Finds the quantizable feature set matching pred.
+		template<class Pred>
+		static bool find(Architecture& arch, Pred&& pred) {
+			for (uint8_t id = 0; id < N_FEATURE_SETS; ++id)
+				if (isQuantizable(id) && pred(Architecture(id))) {
+					arch = Architecture(id);
+					return true;
+				}
+			return false;
+		}
+	};
+
+	constexpr std::array<uint32_t, 256> crc32Table() {
+		std::array<uint32_t, 256> table = {};
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		return table;
+	}
+
+	constexpr std::array<uint32_t, 256> CRC32_TABLE = crc32Table();
+
+	// Same polynomial and chaining as zlib.crc32.
+	inline uint32_t crc32(const char* data, size_t size, uint32_t crc = 0) {
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+			crc = CRC32_TABLE[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	constexpr size_t legacyFileSize() {
+		size_t size = 0;
+		for (const Tensor& t : TENSORS)
+			size += t.bytes();
+		return size;
+	}
+
+	// headerless files written before the versioned format, tensors packed
+	// back to back and none of them transposed
+	constexpr size_t LEGACY_FILE_SIZE = legacyFileSize();
+
+	// Rounds half to even like torch.round and saturates to the range of T.
+	// Returns true if the value had to be saturated.
+	template<class T>
+	bool quantize(float x, float scale, T& q) {
+		float y = std::nearbyint(x * scale);
+		if (y < std::numeric_limits<T>::min()) {
+			q = std::numeric_limits<T>::min();
+			return true;
+		}
+		if (y > std::numeric_limits<T>::max()) {
+			q = std::numeric_limits<T>::max();
+			return true;
+		}
+		q = (T)y;
+		return false;
+	}
+
+	// Maps every input feature to a row of a compacted feature transformer.
+	// Features that are never or hardly ever active in the training data are
+	// pruned and share the last row, which is all zeros. Compacted files store
+	// the table as an extra SECTION_REMAP section after the tensors, and the
+	// feature transformer weights with numRows rows.
+	struct FeatureRemap {
+		std::vector<int32_t> rows;
+		size_t numRows;
+
+		// Keeps the features active at least minCount times.
+		static FeatureRemap fromCounts(const uint64_t* counts, uint64_t minCount, size_t inputSize = INPUT_HSIZE) {
+			FeatureRemap remap;
+			remap.rows.resize(inputSize);
+			int32_t kept = 0;
+			for (size_t f = 0; f < inputSize; ++f)
+				remap.rows[f] = counts[f] && counts[f] >= minCount ? kept++ : -1;
+			for (int32_t& row : remap.rows)
+				if (row < 0) row = kept;
+			remap.numRows = kept + 1;
+			return remap;
+		}
+
+		bool pruned(size_t f) const {
+			return rows[f] == (int32_t)numRows - 1;
+		}
+	};
+
+	// Index of parameter i of t in the stored tensor, remap only applies to
+	// the transposed feature transformer weights.
+	inline size_t storedIndex(const Tensor& t, bool transposed, size_t i, const int32_t* remap = nullptr) {
+		if (!transposed) return i;
+		size_t f = i % t.cols;
+		return (remap ? remap[f] : f) * t.rows + i / t.cols;
+	}
+
+	template<class T>
+	void dequantizeTensor(const char* data, float* params, const Tensor& t, bool transposed, const int32_t* remap) {
+		const float scale = (float)t.scale;
+		for (size_t i = 0; i < t.size(); ++i) {
+			T q;
+			std::memcpy(&q, data + storedIndex(t, transposed, i, remap) * sizeof(T), sizeof(T));
+			params[i] = (float)q / scale;
+		}
+	}
+
+	template<class T>
+	size_t quantizeTensor(const float* params, char* data, const Tensor& t, bool transposed, const FeatureRemap* remap) {
+		const float scale = (float)t.scale;
+		size_t saturated = 0;
+		for (size_t i = 0; i < t.size(); ++i) {
+			if (remap && remap->pruned(i % t.cols)) continue;
+			T q;
+			saturated += quantize(params[i], scale, q);
+			std::memcpy(data + storedIndex(t, transposed, i, remap ? remap->rows.data() : nullptr) * sizeof(T), &q, sizeof(T));
+		}
+		return saturated;
+	}
+
+	// A .nnue file opened for reading. Versioned files are checked against the
+	// architectures of this build, headerless legacy files only by their size.
+	struct NetworkFile {
+		MappedFile mapped;
+		uint32_t version = 0;	// 0 for legacy files
+		Architecture arch;
+		const char* sections[NUM_TENSORS];
+		uint8_t flags[NUM_TENSORS];
+		const int32_t* remap = nullptr;	// only in compacted files
+		size_t ftRows = INPUT_HSIZE;
+		std::string error;
+
+		bool open(const std::filesystem::path& file) {
+			if (!mapped.open(file))
+				return fail("cannot open file");
+			return read(mapped.data, mapped.size);
+		}
+
+		// Reads a file from memory, data must outlive the NetworkFile.
+		bool read(const char* data, size_t size) {
+			remap = nullptr;
+			arch = Architecture();
+			ftRows = arch.inputSize;
+
+			FileHeader header;
+			if (size >= sizeof(header)) {
+				std::memcpy(&header, data, sizeof(header));
+				if (!std::memcmp(header.magic, MAGIC, sizeof(MAGIC)))
+					return parse(header, data, size);
+			}
+
+			if (size != LEGACY_FILE_SIZE)
+				return fail("no .nnue header and unexpected size " + std::to_string(size)
+					+ ", headerless files must have " + std::to_string(LEGACY_FILE_SIZE) + " bytes");
+
+			for (size_t i = 0; i < NUM_TENSORS; ++i) {
+				sections[i] = data;
+				flags[i] = 0;
+				data += TENSORS[i].bytes();
+			}
+			return true;
+		}
+
+		// Converts the tensors to arch.numParameters() floats, pruned features get zero weights.
+		void dequantize(float* params) const {
+			for (size_t i = 0; i < NUM_TENSORS; ++i) {
+				const Tensor t = arch.tensor(i);
+				bool transposed = flags[i] & SECTION_TRANSPOSED;
+				const int32_t* r = isFeatureTransformer(i) ? remap : nullptr;
+				if (t.type == INT16) dequantizeTensor<int16_t>(sections[i], params, t, transposed, r);
+				else                 dequantizeTensor<int32_t>(sections[i], params, t, transposed, r);
+				params += t.size();
+			}
+		}
+
+	private:
+		bool fail(const std::string& message) {
+			error = message;
+			mapped.close();
+			return false;
+		}
+
+		static SectionEntry sectionEntry(const char* data, size_t i) {
+			SectionEntry entry;
+			std::memcpy(&entry, data + sizeof(FileHeader) + i * sizeof(SectionEntry), sizeof(entry));
+			return entry;
+		}
+
+		bool parse(const FileHeader& header, const char* data, size_t size) {
+			version = header.version;
+			if (header.version != VERSION)
+				return fail("unsupported version " + std::to_string(header.version));
+			if (!Architecture::find(arch, [&](const Architecture& a) { return a.hash() == header.architecture; }))
+				return fail("architecture hash " + std::to_string(header.architecture)
+					+ " matches no feature set of this build");
+			ftRows = arch.inputSize;
+
+			bool compact = header.numSections == NUM_TENSORS + 1;
+			if (header.numSections != NUM_TENSORS && !compact)
+				return fail("expected " + std::to_string(NUM_TENSORS) + " sections, found "
+					+ std::to_string(header.numSections));
+			if (header.fileSize != size || header.headerSize > size
+					|| sizeof(FileHeader) + header.numSections * sizeof(SectionEntry) > header.headerSize)
+				return fail("file is truncated");
+
+			auto validOffset = [&](const SectionEntry& entry) {
+				return entry.offset % SECTION_ALIGNMENT == 0 && entry.offset >= header.headerSize
+					&& entry.offset + entry.bytes <= size;
+			};
+
+			if (compact) {
+				SectionEntry entry = sectionEntry(data, NUM_TENSORS);
+				if (entry.flags != SECTION_REMAP || entry.type != INT32
+						|| entry.bytes != arch.inputSize * sizeof(int32_t) || !validOffset(entry))
+					return fail("invalid feature remap section");
+				remap = (const int32_t*)(data + entry.offset);
+
+				SectionEntry weights = sectionEntry(data, WHITE_WEIGHT);
+				ftRows = weights.bytes / (ACCUMULATOR_SIZE * sizeof(int16_t));
+				if (!(weights.flags & SECTION_TRANSPOSED) || ftRows == 0 || ftRows > arch.inputSize + 1)
+					return fail("invalid compacted feature transformer");
+				for (size_t f = 0; f < arch.inputSize; ++f)
+					if (remap[f] < 0 || (size_t)remap[f] >= ftRows)
+						return fail("feature remap table out of range");
+			}
+
+			uint32_t crc = 0;
+			for (size_t i = 0; i < header.numSections; ++i) {
+				SectionEntry entry = sectionEntry(data, i);
+				if (i == NUM_TENSORS) {
+					crc = crc32(data + entry.offset, entry.bytes, crc);
+					continue;
+				}
+
+				const Tensor t = arch.tensor(i);
+				size_t bytes = compact && isFeatureTransformer(i) ? ftRows * t.rows * sizeof(int16_t) : t.bytes();
+				if (entry.bytes != bytes || entry.type != t.type)
+					return fail(std::string("unexpected shape or type of ") + t.name);
+				if (entry.scale != t.scale)
+					return fail(std::string("unexpected scale of ") + t.name + ", found "
+						+ std::to_string(entry.scale) + ", expected " + std::to_string(t.scale));
+				if (entry.flags & ~SECTION_TRANSPOSED)
+					return fail(std::string("unknown flags of ") + t.name);
+				if (!validOffset(entry))
+					return fail(std::string("invalid offset of ") + t.name);
+
+				sections[i] = data + entry.offset;
+				flags[i] = entry.flags;
+				crc = crc32(sections[i], entry.bytes, crc);
+			}
+
+			if (crc != header.checksum)
+				return fail("checksum mismatch, the file is corrupted");
+			return true;
+		}
+	};
+
+	// Converts arch.numParameters() floats to a versioned .nnue file, compacted
+	// if remap is given. Returns the number of saturated values and optionally
+	// the count of every tensor.
+	inline size_t quantize(const float* params, std::vector<char>& data, const Architecture& arch = {},
+		size_t* saturatedPerTensor = nullptr, const FeatureRemap* remap = nullptr)
+	{
+		size_t numSections = NUM_TENSORS + (remap != nullptr);
+		auto sectionBytes = [&](size_t i) {
+			if (i == NUM_TENSORS) return arch.inputSize * sizeof(int32_t);
+			if (remap && isFeatureTransformer(i)) return remap->numRows * TENSORS[i].rows * sizeof(int16_t);
+			return arch.tensor(i).bytes();
+		};
+
+		size_t headerSize = ceilToMultiple(sizeof(FileHeader) + numSections * sizeof(SectionEntry), SECTION_ALIGNMENT);
+		size_t fileSize = headerSize;
+		for (size_t i = 0; i < numSections; ++i)
+			fileSize = ceilToMultiple(fileSize + sectionBytes(i), SECTION_ALIGNMENT);
+		data.assign(fileSize, 0);
+
+		FileHeader header = {};
+		std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.version = VERSION;
+		header.architecture = arch.hash();
+		header.numSections = numSections;
+		header.headerSize = headerSize;
+		header.fileSize = fileSize;
+
+		size_t saturated = 0;
+		size_t offset = headerSize;
+		for (size_t i = 0; i < numSections; ++i) {
+			char* section = data.data() + offset;
+			SectionEntry entry = {};
+			entry.offset = offset;
+			entry.bytes = sectionBytes(i);
+
+			if (i == NUM_TENSORS) {
+				std::memcpy(section, remap->rows.data(), entry.bytes);
+				entry.type = INT32;
+				entry.flags = SECTION_REMAP;
+				entry.scale = 1;
+			}
+			else {
+				const Tensor t = arch.tensor(i);
+				const FeatureRemap* r = isFeatureTransformer(i) ? remap : nullptr;
+				size_t n = t.type == INT16 ? quantizeTensor<int16_t>(params, section, t, t.transposed, r)
+					: quantizeTensor<int32_t>(params, section, t, t.transposed, r);
+				if (saturatedPerTensor) saturatedPerTensor[i] = n;
+				saturated += n;
+				params += t.size();
+
+				entry.type = t.type;
+				entry.flags = t.transposed ? SECTION_TRANSPOSED : 0;
+				entry.scale = t.scale;
+			}
+
+			std::memcpy(data.data() + sizeof(FileHeader) + i * sizeof(SectionEntry), &entry, sizeof(entry));
+			header.checksum = crc32(section, entry.bytes, header.checksum);
+			offset = ceilToMultiple(offset + entry.bytes, SECTION_ALIGNMENT);
+		}
+
+		std::memcpy(data.data(), &header, sizeof(header));
+		return saturated;
+	}
+
+	// Reads a .nnue file into the float layout of its architecture.
+	inline bool readNetwork(const std::filesystem::path& file, std::vector<float>& params, Architecture& arch,
+		std::string* error = nullptr)
+	{
+		NetworkFile network;
+		if (!network.open(file)) {
+			if (error) *error = network.error;
+			return false;
+		}
+		arch = network.arch;
+		params.resize(arch.numParameters());
+		network.dequantize(params.data());
+		return true;
+	}
+
+	inline bool writeNetwork(const std::filesystem::path& file, const float* params, const Architecture& arch = {},
+		const FeatureRemap* remap = nullptr)
+	{
+		std::vector<char> buffer;
+		quantize(params, buffer, arch, nullptr, remap);
+
+		std::ofstream os(file, std::ios::binary);
+		os.write(buffer.data(), buffer.size());
+		return (bool)os;
+	}
+
+	// Raw float tensors have no header, the architecture is told by the size.
+	inline bool readFloats(const std::filesystem::path& file, std::vector<float>& params, Architecture& arch) {
+		MappedFile mapped;
+		if (!mapped.open(file) || !Architecture::find(arch, [&](const Architecture& a) {
+				return a.numParameters() * sizeof(float) == mapped.size; }))
+			return false;
+		params.resize(arch.numParameters());
+		std::memcpy(params.data(), mapped.data, mapped.size);
+		return true;
+	}
+
+	inline bool writeFloats(const std::filesystem::path& file, const std::vector<float>& params) {
+		std::ofstream os(file, std::ios::binary);
+		os.write((const char*)params.data(), params.size() * sizeof(float));
+		return (bool)os;
+	}
+
+} // namespace nnue
@@ -0,0 +1,80 @@
+#pragma once
+
+#include<atomic>
+#include<filesystem>
+#include<fstream>
+#include<mutex>
+#include<vector>
+
+#if !defined(_WIN32)
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
+// Write-only file shared by threads. On POSIX systems blocks are written with
+// pwrite, so threads never lock: append only reserves its range with an atomic
+// add. Elsewhere the writes are serialized by a mutex.
+struct OutputFile {
+    std::atomic<uint64_t> size = 0;
+
+#if defined(_WIN32)
+    std::ofstream os;
+    std::mutex mutex;
+#else
+    int fd = -1;
+#endif
+
+    OutputFile() = default;
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    ~OutputFile() {
+        close();
+    }
+
+    // Creates or truncates file.
+    bool open(const std::filesystem::path& file) {
+        close();
+        size = 0;
+
+#if defined(_WIN32)
+        os.open(file, std::ios::binary | std::ios::trunc);
+        return os.is_open();
+#else
+        fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return fd >= 0;
+#endif
+    }
+
+    // Writes data at offset, which may lie beyond the current end.
+    bool write(const char* data, size_t n, uint64_t offset) {
+#if defined(_WIN32)
+        std::lock_guard<std::mutex> lock(mutex);
+        os.seekp(offset);
+        os.write(data, n);
+        return (bool)os;
+#else
+        while (n) {
+            ssize_t written = ::pwrite(fd, data, n, (off_t)offset);
+            if (written <= 0) return false;
+            data += written;
+            offset += written;
+            n -= written;
+        }
+        return true;
+#endif
+    }
+
+    bool append(const std::vector<char>& block) {
+        return write(block.data(), block.size(), size.fetch_add(block.size()));
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (os.is_open()) os.close();
+#else
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+    }
+};
@@ -0,0 +1,156 @@
+#include<atomic>
+#include<chrono>
+#include<cstring>
+#include<iostream>
+#include<memory>
+#include<string>
+#include<vector>
+
+#include"../mapped_file.h"
+#include"../output_file.h"
+#include"../search/search.h"
+#include"../thread_pool.h"
+#include"../training_data.h"
+
+struct Options {
+	size_t numThreads = 1;
+	bool pin = false;
+	search::Limits limits;
+	size_t hashMb = 16;	// per thread
+};
+
+struct RescoreStats {
+	size_t positions = 0;
+	uint64_t nodes = 0;
+	double scoreChange = 0;	// sum of |new - old|
+};
+
+// Records are rescored in chunks of this many records, the tasks of the
+// thread pool.
+constexpr size_t CHUNK_RECORDS = 4096;
+
+// Splits the records of a .td file into chunks, an incomplete last record is dropped.
+std::vector<const char*> splitChunks(const char* curr, const char* end) {
+	std::vector<const char*> bounds = { curr };
+	size_t count = 0;
+	while (TrainingData::skip(curr, end))
+		if (++count % CHUNK_RECORDS == 0) bounds.push_back(curr);
+	if (bounds.back() != curr) bounds.push_back(curr);
+	return bounds;
+}
+
+// Replaces the scores of the records in chunk with the result of a search.
+// The transposition table is cleared first, so that the new scores do not
+// depend on which thread rescored which chunk.
+void rescoreChunk(search::Searcher& searcher, const Options& options, std::vector<char>& chunk, RescoreStats& stats) {
+	searcher.tt.clear();
+
+	char* curr = chunk.data();
+	char* end = chunk.data() + chunk.size();
+	while (curr < end) {
+		uint8_t fenSize = *(const uint8_t*)curr;
+		search::Position pos(std::string_view(curr + 1, fenSize));
+		char* scorePtr = curr + 1 + fenSize;
+
+		search::Result r = searcher.search(pos, {}, options.limits);
+		Score oldScore;
+		std::memcpy(&oldScore, scorePtr, sizeof(Score));
+		Score newScore = (Score)r.score;
+		std::memcpy(scorePtr, &newScore, sizeof(Score));
+
+		++stats.positions;
+		stats.nodes += r.nodes;
+		stats.scoreChange += std::abs(newScore - oldScore);
+		curr += 1 + fenSize + TrainingData::RECORD_TAIL_SIZE;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	FeatureTransformer::init();
+	attacks::init();
+	pgn::init();
+
+	if (argc < 4) {
+		std::cout << "Usage: rescore <net.nnue> <training data> <output> [options]\n"
+			<< "  --threads <n>   number of worker threads\n"
+			<< "  --pin           pin the threads to CPUs, spread over NUMA nodes\n"
+			<< "  --depth <n>     search depth per position, default 6\n"
+			<< "  --nodes <n>     node limit per position\n"
+			<< "  --hash <mb>     transposition table size per thread, default 16" << std::endl;
+		return 1;
+	}
+
+	Options options;
+	for (int i = 4; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (arg == "--threads" && i+1 < argc) options.numThreads = std::stoul(argv[++i]);
+		else if (arg == "--pin") options.pin = true;
+		else if (arg == "--depth" && i+1 < argc) options.limits.depth = std::stoi(argv[++i]);
+		else if (arg == "--nodes" && i+1 < argc) options.limits.nodes = std::stoull(argv[++i]);
+		else if (arg == "--hash" && i+1 < argc) options.hashMb = std::stoul(argv[++i]);
+		else {
+			std::cout << "Unknown option " << arg << "." << std::endl;
+			return 1;
+		}
+	}
+	options.numThreads = std::max<size_t>(options.numThreads, 1);
+	options.limits.depth = std::clamp(options.limits.depth, 1, search::MAX_PLY - 1);
+
+	auto network = std::make_unique<nnue::Network>();
+	if (!network->load(argv[1])) {
+		std::cout << "Cannot load network " << argv[1] << ": " << network->error << "." << std::endl;
+		return 1;
+	}
+
+	MappedFile input;
+	if (!input.open(argv[2])) {
+		std::cout << "Cannot open " << argv[2] << "." << std::endl;
+		return 1;
+	}
+	OutputFile output;
+	if (!output.open(argv[3])) {
+		std::cout << "Cannot open " << argv[3] << "." << std::endl;
+		return 1;
+	}
+
+	// records keep their size, so every chunk is written at its input offset
+	std::vector<const char*> bounds = splitChunks(input.data, input.data + input.size);
+	size_t numChunks = bounds.size() - 1;
+	std::cout << "Rescoring " << argv[2] << " to " << argv[3] << " at depth " << options.limits.depth
+		<< " with " << options.numThreads << " threads." << std::endl;
+
+	ThreadPool pool(options.numThreads, options.pin);
+	std::atomic<bool> failed = false;
+	std::vector<RescoreStats> stats(options.numThreads);
+	std::vector<std::unique_ptr<search::Searcher>> searchers(options.numThreads);
+	for (auto& searcher : searchers)
+		searcher = std::make_unique<search::Searcher>(*network, options.hashMb);
+	pool.run(numChunks, [&](size_t c, size_t thread) {
+		std::vector<char> chunk(bounds[c], bounds[c+1]);
+		rescoreChunk(*searchers[thread], options, chunk, stats[thread]);
+		if (!output.write(chunk.data(), chunk.size(), bounds[c] - input.data))
+			failed = true;
+	});
+
+	if (failed) {
+		std::cout << "Cannot write " << argv[3] << "." << std::endl;
+		return 1;
+	}
+
+	RescoreStats total;
+	for (const RescoreStats& s : stats) {
+		total.positions += s.positions;
+		total.nodes += s.nodes;
+		total.scoreChange += s.scoreChange;
+	}
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	double seconds = (t1-t0).count() * 1e-9;
+	std::cout << "Positions: " << total.positions << " (" << (size_t)(total.positions / seconds) << "/s)" << std::endl;
+	std::cout << "Mean absolute score change: " << total.scoreChange / std::max<size_t>(total.positions, 1) << std::endl;
+	std::cout << "Nodes: " << total.nodes << " (" << (size_t)(total.nodes / seconds) << "/s)" << std::endl;
+	if (options.numThreads > 1) pool.printStats(std::cout);
+	std::cout << "Elapsed time: " << seconds << std::endl;
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include<array>
+
+#include"../PGN-converter/pgn_position.h"
+
+namespace chess {
+
+	namespace search {
+
+		using Position = pgn::Position;
+		using CastlingRights = pgn::CastlingRights;
+
+		enum MoveFlags : uint8_t {
+			QUIET,
+			DOUBLE_PUSH,
+			CASTLING,
+			EN_PASSANT,
+			PROMOTION
+		};
+
+		struct Move {
+			Square from;
+			Square to;
+			uint8_t flags;
+			PieceType promotion;	// only set for PROMOTION
+
+			bool operator==(const Move& other) const {
+				return from == other.from && to == other.to && promotion == other.promotion;
+			}
+
+			bool operator!=(const Move& other) const {
+				return !(*this == other);
+			}
+
+			bool isNull() const {
+				return from == to;
+			}
+
+			// long algebraic notation as used by UCI, e.g. e7e8q
+			std::string toString() const {
+				std::string s = square::toString(from) + square::toString(to);
+				if (flags == PROMOTION) s += piece::PIECE_TO_CHAR[piece::make(BLACK, promotion)];
+				return s;
+			}
+		};
+
+		constexpr Move NULL_MOVE = {};
+
+		struct MoveList {
+			static constexpr int MAX_SIZE = 256;
+
+			Move moves[MAX_SIZE];
+			int size = 0;
+
+			void push(Square from, Square to, uint8_t flags = QUIET, PieceType promotion = NO_PIECE_TYPE) {
+				moves[size++] = { from, to, flags, promotion };
+			}
+
+			Move* begin() { return moves; }
+			Move* end() { return moves + size; }
+			const Move* begin() const { return moves; }
+			const Move* end() const { return moves + size; }
+		};
+
+		// Zobrist keys, generated at compile time with splitmix64.
+		struct ZobristKeys {
+			uint64_t pieces[N_PIECES][N_SQUARES];
+			uint64_t castling[16];
+			uint64_t epFile[N_FILES];
+			uint64_t blackToMove;
+		};
+
+		constexpr ZobristKeys zobristKeys() {
+			ZobristKeys keys = {};
+			uint64_t state = 0x9e3779b97f4a7c15ull;
+			auto next = [&]() {
+				uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+				return z ^ (z >> 31);
+			};
+			for (auto& squares : keys.pieces)
+				for (uint64_t& key : squares)
+					key = next();
+			for (uint64_t& key : keys.castling) key = next();
+			for (uint64_t& key : keys.epFile) key = next();
+			keys.blackToMove = next();
+			return keys;
+		}
+
+		inline constexpr ZobristKeys ZOBRIST = zobristKeys();
+
+		inline uint64_t hashKey(const Position& pos) {
+			uint64_t key = 0;
+			Bitboard occupied = pos.occupied;
+			while (occupied) {
+				Square s = occupied.popLSB();
+				key ^= ZOBRIST.pieces[pos.piece(s)][s];
+			}
+			key ^= ZOBRIST.castling[pos.castlingRights.data];
+			if (pos.epSquare) key ^= ZOBRIST.epFile[file::make(pos.epSquare)];
+			if (pos.stm) key ^= ZOBRIST.blackToMove;
+			return key;
+		}
+
+		// castling rights kept when a piece moves from or to a square
+		constexpr std::array<uint8_t, N_SQUARES> castlingMasks() {
+			std::array<uint8_t, N_SQUARES> masks = {};
+			for (uint8_t& m : masks) m = CastlingRights::ANY_CASTLING;
+			masks[A1] &= ~CastlingRights::WHITE_QUEEN_SIDE;
+			masks[H1] &= ~CastlingRights::WHITE_KING_SIDE;
+			masks[E1] &= ~CastlingRights::WHITE_CASTLING;
+			masks[A8] &= ~CastlingRights::BLACK_QUEEN_SIDE;
+			masks[H8] &= ~CastlingRights::BLACK_KING_SIDE;
+			masks[E8] &= ~CastlingRights::BLACK_CASTLING;
+			return masks;
+		}
+
+		inline constexpr std::array<uint8_t, N_SQUARES> CASTLING_MASKS = castlingMasks();
+
+		inline bool isAttacked(const Position& pos, Square s, Color by) {
+			return (bool)pos.attackersTo(s, by);
+		}
+
+		// Whether the side that just moved left its king in check.
+		inline bool isLegal(const Position& pos) {
+			return !isAttacked(pos, pos.kingSquare(!pos.stm), pos.stm);
+		}
+
+		inline bool isCapture(const Position& pos, Move m) {
+			return pos.piece(m.to) || m.flags == EN_PASSANT;
+		}
+
+		// Returns the position after m. pos.dirty of the result holds the
+		// board changes for AccumulatorStack::push.
+		inline Position makeMove(const Position& pos, Move m) {
+			Position next = pos;
+			next.dirty.size = 0;
+
+			Color us = pos.stm;
+			Piece pc = pos.piece(m.from);
+			Direction pawnPush = direction::pawnPush(us);
+
+			++next.rule50Cnt;
+			if (pieceType::make(pc) == PAWN || pos.piece(m.to)) next.rule50Cnt = 0;
+
+			if (m.flags == EN_PASSANT) next.removePiece(m.to - pawnPush);
+			else if (pos.piece(m.to)) next.removePiece(m.to);
+
+			if (m.flags == PROMOTION) {
+				next.removePiece(m.from);
+				next.setPiece(m.to, piece::make(us, m.promotion));
+			}
+			else next.movePiece(m.from, m.to);
+
+			if (m.flags == CASTLING) {
+				bool kingSide = m.to > m.from;
+				next.movePiece(square::relative(us, kingSide ? H1 : A1), square::relative(us, kingSide ? F1 : D1));
+			}
+
+			next.castlingRights.data &= CASTLING_MASKS[m.from] & CASTLING_MASKS[m.to];
+			next.epSquare = m.flags == DOUBLE_PUSH ? m.from + pawnPush : NO_SQUARE;
+			next.stm = !us;
+			++next.ply;
+			return next;
+		}
+
+		namespace detail {
+
+			inline void pushTargets(MoveList& list, Square from, Bitboard targets) {
+				while (targets) list.push(from, targets.popLSB());
+			}
+
+			inline void pushPromotions(MoveList& list, Square from, Square to) {
+				for (PieceType pt : { QUEEN, KNIGHT, ROOK, BISHOP })
+					list.push(from, to, PROMOTION, pt);
+			}
+
+			inline void generatePawnMoves(const Position& pos, MoveList& list, bool capturesOnly) {
+				Color us = pos.stm;
+				Direction push = direction::pawnPush(us);
+				Bitboard theirs = pos.piecesByColor(!us);
+				Bitboard pawns = pos.pieces(us, PAWN);
+				Rank promotionRank = us == WHITE ? RANK_8 : RANK_1;
+				Rank startRank = us == WHITE ? RANK_2 : RANK_7;
+
+				while (pawns) {
+					Square from = pawns.popLSB();
+					Square to = from + push;
+					bool promotes = rank::make(to) == promotionRank;
+
+					Bitboard captures = attacks::pawnAttacks[us][from] & theirs;
+					while (captures) {
+						Square target = captures.popLSB();
+						if (promotes) pushPromotions(list, from, target);
+						else list.push(from, target);
+					}
+
+					if (pos.epSquare && attacks::pawnAttacks[us][from].isSet(pos.epSquare))
+						list.push(from, pos.epSquare, EN_PASSANT);
+
+					if (pos.piece(to)) continue;
+					if (promotes) {
+						pushPromotions(list, from, to);
+						continue;
+					}
+					if (capturesOnly) continue;
+
+					list.push(from, to);
+					if (rank::make(from) == startRank && !pos.piece(to + push))
+						list.push(from, to + push, DOUBLE_PUSH);
+				}
+			}
+
+			inline void generateCastling(const Position& pos, MoveList& list) {
+				Color us = pos.stm;
+				Square ksq = pos.kingSquare(us);
+				if (ksq != square::relative(us, E1) || isAttacked(pos, ksq, !us)) return;
+
+				uint8_t kingSide = us == WHITE ? CastlingRights::WHITE_KING_SIDE : CastlingRights::BLACK_KING_SIDE;
+				uint8_t queenSide = us == WHITE ? CastlingRights::WHITE_QUEEN_SIDE : CastlingRights::BLACK_QUEEN_SIDE;
+				Piece rook = piece::make(us, ROOK);
+
+				if (pos.canCastle(kingSide) && pos.piece(square::relative(us, H1)) == rook
+						&& !pos.piece(square::relative(us, F1)) && !pos.piece(square::relative(us, G1))
+						&& !isAttacked(pos, square::relative(us, F1), !us))
+					list.push(ksq, square::relative(us, G1), CASTLING);
+
+				if (pos.canCastle(queenSide) && pos.piece(square::relative(us, A1)) == rook
+						&& !pos.piece(square::relative(us, B1)) && !pos.piece(square::relative(us, C1))
+						&& !pos.piece(square::relative(us, D1)) && !isAttacked(pos, square::relative(us, D1), !us))
+					list.push(ksq, square::relative(us, C1), CASTLING);
+			}
+
+		} // namespace detail
+
+		// Pseudo-legal moves of the side to move, the king may be left in check
+		// (see isLegal) except for castling. With capturesOnly, only captures
+		// and promotions.
+		inline void generateMoves(const Position& pos, MoveList& list, bool capturesOnly = false) {
+			Color us = pos.stm;
+			Bitboard ours = pos.piecesByColor(us);
+			Bitboard targets = capturesOnly ? pos.piecesByColor(!us) : ~ours;
+
+			detail::generatePawnMoves(pos, list, capturesOnly);
+
+			Bitboard knights = pos.pieces(us, KNIGHT);
+			while (knights) {
+				Square from = knights.popLSB();
+				detail::pushTargets(list, from, attacks::knightAttacks[from] & targets);
+			}
+
+			Bitboard bishops = pos.pieces(us, BISHOP) | pos.pieces(us, QUEEN);
+			while (bishops) {
+				Square from = bishops.popLSB();
+				detail::pushTargets(list, from, attacks::attacks<BISHOP>(from, pos.occupied) & targets);
+			}
+
+			Bitboard rooks = pos.pieces(us, ROOK) | pos.pieces(us, QUEEN);
+			while (rooks) {
+				Square from = rooks.popLSB();
+				detail::pushTargets(list, from, attacks::attacks<ROOK>(from, pos.occupied) & targets);
+			}
+
+			Square ksq = pos.kingSquare(us);
+			detail::pushTargets(list, ksq, attacks::kingAttacks[ksq] & targets);
+
+			if (!capturesOnly && pos.canCastle())
+				detail::generateCastling(pos, list);
+		}
+
+		inline void generateLegalMoves(const Position& pos, MoveList& list) {
+			MoveList pseudo;
+			generateMoves(pos, pseudo);
+			for (Move m : pseudo)
+				if (isLegal(makeMove(pos, m)))
+					list.moves[list.size++] = m;
+		}
+
+		// Counts the leaf nodes of the legal move tree, to check the move generator.
+		inline uint64_t perft(const Position& pos, int depth) {
+			if (depth == 0) return 1;
+			MoveList list;
+			generateLegalMoves(pos, list);
+			if (depth == 1) return list.size;
+
+			uint64_t nodes = 0;
+			for (Move m : list)
+				nodes += perft(makeMove(pos, m), depth - 1);
+			return nodes;
+		}
+
+	} // namespace search
+
+} // namespace chess
@@ -0,0 +1,324 @@
+#pragma once
+
+#include<algorithm>
+#include<cstring>
+#include<vector>
+
+#include"movegen.h"
+#include"../nnue/nnue.h"
+
+namespace chess {
+
+	namespace search {
+
+		constexpr int MAX_PLY = 128;
+		constexpr int INFINITE_SCORE = MATE_SCORE + 1;
+		// scores beyond are mate scores
+		constexpr int MATE_BOUND = MATE_SCORE - MAX_PLY;
+
+		constexpr bool isMate(int score) {
+			return std::abs(score) > MATE_BOUND;
+		}
+
+		enum Bound : uint8_t {
+			NO_BOUND,
+			UPPER_BOUND,
+			LOWER_BOUND,
+			EXACT_BOUND = UPPER_BOUND | LOWER_BOUND
+		};
+
+		struct TTEntry {
+			uint64_t key;
+			Move move;
+			int16_t score;	// mate scores relative to the entry, see TranspositionTable::store
+			int8_t depth;
+			uint8_t bound;
+		};
+
+		static_assert(sizeof(TTEntry) == 16);
+
+		// Always-replace hash table of search results. Not thread safe, every
+		// Searcher owns its own table.
+		struct TranspositionTable {
+			std::vector<TTEntry> entries;
+			uint64_t mask = 0;
+
+			// Rounds the size down to a power of two entries, 0 disables the table.
+			void resize(size_t sizeMb) {
+				size_t count = sizeMb * 1024 * 1024 / sizeof(TTEntry);
+				size_t size = 1;
+				while (size * 2 <= count) size *= 2;
+				entries.assign(count ? size : 0, TTEntry{});
+				mask = size - 1;
+			}
+
+			void clear() {
+				std::fill(entries.begin(), entries.end(), TTEntry{});
+			}
+
+			// Returns the entry of key or nullptr, sets score relative to the root.
+			const TTEntry* probe(uint64_t key, int ply, int& score) const {
+				if (entries.empty()) return nullptr;
+				const TTEntry& e = entries[key & mask];
+				if (e.key != key || e.bound == NO_BOUND) return nullptr;
+				score = e.score;
+				if (score > MATE_BOUND) score -= ply;
+				else if (score < -MATE_BOUND) score += ply;
+				return &e;
+			}
+
+			// Mate scores are stored as distance from the entry instead of the
+			// root, so that they stay valid when reached at another ply.
+			void store(uint64_t key, Move move, int score, int depth, Bound bound, int ply) {
+				if (entries.empty()) return;
+				if (score > MATE_BOUND) score += ply;
+				else if (score < -MATE_BOUND) score -= ply;
+				entries[key & mask] = { key, move, (int16_t)score, (int8_t)depth, bound };
+			}
+		};
+
+		struct Limits {
+			int depth = 6;
+			uint64_t nodes = 0;	// 0 for no limit
+		};
+
+		struct Result {
+			Move best;
+			int score;		// relative to the side to move
+			int depth;		// of the last completed iteration
+			uint64_t nodes;
+		};
+
+		// Iterative deepening alpha-beta search with quiescence search,
+		// evaluating with a quantized network. Not thread safe, every thread
+		// uses its own Searcher.
+		struct Searcher {
+			const nnue::Network& network;
+			nnue::AccumulatorStack stack;
+			TranspositionTable tt;	// kept between searches, see TranspositionTable::clear
+			Limits limits;
+			uint64_t nodes;
+			bool stopped;
+			// keys of the game and the current line, to detect repetitions
+			std::vector<uint64_t> keys;
+			Move killers[MAX_PLY][2];
+			int history[N_PIECES][N_SQUARES];
+
+			Searcher(const nnue::Network& network, size_t ttSizeMb = 16) : network(network), stack(network) {
+				tt.resize(ttSizeMb);
+			}
+
+			// history holds the keys of the positions before root, oldest first
+			Result search(const Position& root, const std::vector<uint64_t>& history, Limits limits) {
+				this->limits = limits;
+				nodes = 0;
+				stopped = false;
+				keys = history;
+				keys.push_back(hashKey(root));
+				std::memset(killers, 0, sizeof(killers));
+				std::memset(this->history, 0, sizeof(this->history));
+				stack.reset(root);
+
+				Result result = {};
+				MoveList moves;
+				generateLegalMoves(root, moves);
+				if (!moves.size) {
+					result.score = root.inCheck() ? -MATE_SCORE : 0;
+					return result;
+				}
+				result.best = moves.moves[0];
+
+				for (int depth = 1; depth <= limits.depth; ++depth) {
+					Move best = result.best;
+					int score = searchRoot(root, moves, depth, best);
+					if (stopped && depth > 1) break;
+
+					result.best = best;
+					result.score = score;
+					result.depth = depth;
+					if (stopped || isMate(score)) break;
+				}
+				result.nodes = nodes;
+				return result;
+			}
+
+		private:
+			int evaluate(const Position& pos) {
+				int score = (int)nnue::toScore(stack.evaluate(pos.stm));
+				return std::clamp(score, -MATE_BOUND + 1, MATE_BOUND - 1);
+			}
+
+			bool isRepetition(const Position& pos) const {
+				size_t size = keys.size();
+				size_t limit = std::min<size_t>(pos.rule50Cnt, size - 1);
+				for (size_t i = 2; i <= limit; i += 2)
+					if (keys[size - 1 - i] == keys[size - 1]) return true;
+				return false;
+			}
+
+			bool checkLimits() {
+				if (limits.nodes && nodes >= limits.nodes) stopped = true;
+				return stopped;
+			}
+
+			// Scores moves for ordering: hint first, then captures by MVV-LVA,
+			// killers and quiet moves by history.
+			void scoreMoves(const Position& pos, const MoveList& list, int* scores, Move hint, int ply) const {
+				for (int i = 0; i < list.size; ++i) {
+					const Move& m = list.moves[i];
+					if (m == hint) scores[i] = 1 << 30;
+					else if (isCapture(pos, m) || m.flags == PROMOTION) {
+						PieceType victim = m.flags == EN_PASSANT ? PAWN : pieceType::make(pos.piece(m.to));
+						scores[i] = (1 << 20) + 8 * (victim + (m.flags == PROMOTION ? m.promotion : 0))
+							- pieceType::make(pos.piece(m.from));
+					}
+					else if (ply < MAX_PLY && m == killers[ply][0]) scores[i] = (1 << 19) + 1;
+					else if (ply < MAX_PLY && m == killers[ply][1]) scores[i] = 1 << 19;
+					else scores[i] = history[pos.piece(m.from)][m.to];
+				}
+			}
+
+			// Moves the best scored remaining move to index i.
+			static void pickMove(MoveList& list, int* scores, int i) {
+				int best = i;
+				for (int j = i + 1; j < list.size; ++j)
+					if (scores[j] > scores[best]) best = j;
+				std::swap(list.moves[i], list.moves[best]);
+				std::swap(scores[i], scores[best]);
+			}
+
+			// Makes a pseudo-legal move, returns false and leaves nothing to
+			// undo if it leaves the king in check.
+			bool makeMove(const Position& pos, Move m, Position& next) {
+				next = search::makeMove(pos, m);
+				if (!isLegal(next)) return false;
+				stack.push(next);
+				keys.push_back(hashKey(next));
+				++nodes;
+				return true;
+			}
+
+			void unmakeMove() {
+				stack.pop();
+				keys.pop_back();
+			}
+
+			int searchRoot(const Position& root, MoveList& moves, int depth, Move& best) {
+				int scores[MoveList::MAX_SIZE];
+				scoreMoves(root, moves, scores, best, 0);
+
+				int alpha = -INFINITE_SCORE;
+				for (int i = 0; i < moves.size; ++i) {
+					pickMove(moves, scores, i);
+					Position next;
+					makeMove(root, moves.moves[i], next);
+					int score = -alphaBeta(next, depth - 1, -INFINITE_SCORE, -alpha, 1);
+					unmakeMove();
+					if (stopped) break;
+
+					if (score > alpha) {
+						alpha = score;
+						best = moves.moves[i];
+					}
+				}
+				return alpha;
+			}
+
+			int alphaBeta(const Position& pos, int depth, int alpha, int beta, int ply) {
+				if (ply > 0 && (pos.rule50Cnt >= 100 || isRepetition(pos))) return 0;
+
+				bool inCheck = pos.inCheck();
+				if (inCheck) ++depth;
+				if (depth <= 0) return quiescence(pos, alpha, beta, ply);
+				if (ply >= MAX_PLY) return evaluate(pos);
+				if (checkLimits()) return 0;
+
+				uint64_t key = keys.back();
+				Move hint = NULL_MOVE;
+				int ttScore;
+				if (const TTEntry* e = tt.probe(key, ply, ttScore)) {
+					if (e->depth >= depth && (((e->bound & LOWER_BOUND) && ttScore >= beta)
+							|| ((e->bound & UPPER_BOUND) && ttScore <= alpha)))
+						return ttScore;
+					hint = e->move;
+				}
+
+				MoveList moves;
+				generateMoves(pos, moves);
+				int scores[MoveList::MAX_SIZE];
+				scoreMoves(pos, moves, scores, hint, ply);
+
+				int oldAlpha = alpha;
+				int bestScore = -INFINITE_SCORE;
+				Move bestMove = NULL_MOVE;
+				int legalMoves = 0;
+				for (int i = 0; i < moves.size; ++i) {
+					pickMove(moves, scores, i);
+					const Move m = moves.moves[i];
+					Position next;
+					if (!makeMove(pos, m, next)) continue;
+					++legalMoves;
+
+					int score = -alphaBeta(next, depth - 1, -beta, -alpha, ply + 1);
+					unmakeMove();
+					if (stopped) return 0;
+
+					if (score > bestScore) {
+						bestScore = score;
+						bestMove = m;
+						if (score > alpha) alpha = score;
+					}
+					if (score >= beta) {
+						if (!isCapture(pos, m) && m.flags != PROMOTION) {
+							if (killers[ply][0] != m) {
+								killers[ply][1] = killers[ply][0];
+								killers[ply][0] = m;
+							}
+							history[pos.piece(m.from)][m.to] += depth * depth;
+						}
+						break;
+					}
+				}
+
+				if (!legalMoves) return inCheck ? -MATE_SCORE + ply : 0;
+
+				Bound bound = bestScore >= beta ? LOWER_BOUND : bestScore > oldAlpha ? EXACT_BOUND : UPPER_BOUND;
+				tt.store(key, bestMove, bestScore, depth, bound, ply);
+				return bestScore;
+			}
+
+			int quiescence(const Position& pos, int alpha, int beta, int ply) {
+				if (checkLimits()) return 0;
+
+				int standPat = evaluate(pos);
+				if (standPat >= beta || ply >= MAX_PLY) return standPat;
+				if (standPat > alpha) alpha = standPat;
+
+				MoveList moves;
+				generateMoves(pos, moves, true);
+				int scores[MoveList::MAX_SIZE];
+				scoreMoves(pos, moves, scores, NULL_MOVE, MAX_PLY);
+
+				int bestScore = standPat;
+				for (int i = 0; i < moves.size; ++i) {
+					pickMove(moves, scores, i);
+					Position next;
+					if (!makeMove(pos, moves.moves[i], next)) continue;
+
+					int score = -quiescence(next, -beta, -alpha, ply + 1);
+					unmakeMove();
+					if (stopped) return 0;
+
+					if (score > bestScore) {
+						bestScore = score;
+						if (score > alpha) alpha = score;
+					}
+					if (score >= beta) break;
+				}
+				return bestScore;
+			}
+		};
+
+	} // namespace search
+
+} // namespace chess
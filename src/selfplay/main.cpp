@@ -0,0 +1,258 @@
+#include<chrono>
+#include<iostream>
+#include<memory>
+#include<random>
+#include<string>
+#include<vector>
+
+#include"../PGN-converter/pgn_converter.h"
+#include"../output_file.h"
+#include"../search/search.h"
+#include"../thread_pool.h"
+#include"../training_data.h"
+
+struct Options {
+	size_t games = 1000;
+	size_t numThreads = 1;
+	bool pin = false;
+	search::Limits limits;
+	size_t hashMb = 16;	// per thread
+	int randomPlies = 8;
+	int maxGamePly = 400;
+	int adjudicateScore = 0;	// 0 to play every game to its end
+	int adjudicatePlies = 6;
+	uint64_t seed = 0;
+	pgn::Filter filter;
+};
+
+struct Record {
+	std::string fen;
+	Score score;
+	Color stm;
+	uint16_t ply;
+	bool inCheck;
+	bool isCapture;
+};
+
+struct WorkerStats {
+	size_t games = 0;
+	size_t results[3] = {};	// black wins, draws, white wins
+	uint64_t nodes = 0;
+	pgn::FilterStats filter = {};
+};
+
+bool isInsufficientMaterial(const search::Position& pos) {
+	Bitboard occupied = pos.occupied;
+	int pieces = occupied.popcount();
+	if (pieces == 2) return true;
+	return pieces == 3 && (pos.byPieceType[KNIGHT] | pos.byPieceType[BISHOP]);
+}
+
+// Whether the position occured twice before, keys ends with its own key.
+bool isThreefold(const search::Position& pos, const std::vector<uint64_t>& keys) {
+	size_t size = keys.size();
+	size_t limit = std::min<size_t>(pos.rule50Cnt, size - 1);
+	int count = 0;
+	for (size_t i = 2; i <= limit; i += 2)
+		if (keys[size - 1 - i] == keys[size - 1] && ++count == 2) return true;
+	return false;
+}
+
+// Plays a game from a random opening and sets result from white's point
+// of view. Returns false if the random opening already ended the game.
+bool playGame(search::Searcher& searcher, std::mt19937_64& rng, const Options& options,
+		std::vector<Record>& records, int8_t& result, uint64_t& nodes) {
+	records.clear();
+	search::Position pos = search::Position::startPosition();
+	std::vector<uint64_t> keys;
+
+	for (int i = 0; i < options.randomPlies; ++i) {
+		search::MoveList moves;
+		search::generateLegalMoves(pos, moves);
+		if (!moves.size) return false;
+		keys.push_back(search::hashKey(pos));
+		pos = search::makeMove(pos, moves.moves[rng() % moves.size]);
+	}
+
+	int adjudicateCount = 0;
+	int adjudicateWinner = 0;
+	for (;;) {
+		search::MoveList moves;
+		search::generateLegalMoves(pos, moves);
+		if (!moves.size) {
+			result = !pos.inCheck() ? 0 : pos.stm == WHITE ? -1 : 1;
+			return true;
+		}
+		keys.push_back(search::hashKey(pos));
+		if (pos.rule50Cnt >= 100 || isThreefold(pos, keys) || isInsufficientMaterial(pos)
+				|| pos.ply >= options.maxGamePly) {
+			result = 0;
+			return true;
+		}
+		keys.pop_back();
+
+		search::Result r = searcher.search(pos, keys, options.limits);
+		nodes += r.nodes;
+		records.push_back({ pos.fen(), (Score)r.score, pos.stm, pos.ply, pos.inCheck(), search::isCapture(pos, r.best) });
+
+		if (options.adjudicateScore) {
+			// both sides have to agree on the winner
+			int whiteScore = pos.stm == WHITE ? r.score : -r.score;
+			int winner = std::abs(r.score) < options.adjudicateScore ? 0 : whiteScore > 0 ? 1 : -1;
+			adjudicateCount = winner && winner == adjudicateWinner ? adjudicateCount + 1 : winner != 0;
+			adjudicateWinner = winner;
+			if (adjudicateCount >= options.adjudicatePlies) {
+				result = winner;
+				return true;
+			}
+		}
+
+		keys.push_back(search::hashKey(pos));
+		pos = search::makeMove(pos, r.best);
+	}
+}
+
+// Per-thread state, the games are handed out by the thread pool.
+struct Worker {
+	static constexpr size_t FLUSH_SIZE = 1 << 20;
+
+	std::unique_ptr<search::Searcher> searcher;
+	std::vector<Record> records;
+	std::vector<char> buffer;
+	WorkerStats stats;
+	bool failed = false;
+
+	// A game only depends on the seed and its index, the transposition
+	// table is cleared first.
+	void play(size_t game, const Options& options, OutputFile& output) {
+		std::seed_seq seq{ options.seed, (uint64_t)game };
+		std::mt19937_64 rng(seq);
+		int8_t result;
+		do searcher->tt.clear();
+		while (!playGame(*searcher, rng, options, records, result, stats.nodes));
+
+		++stats.games;
+		++stats.results[result + 1];
+		for (const Record& r : records)
+			if (pgn::accept(options.filter, r.ply, r.score, r.inCheck, r.isCapture, false, stats.filter))
+				TrainingData::write(buffer, r.fen, r.score, r.stm == WHITE ? result : -result);
+
+		if (buffer.size() >= FLUSH_SIZE) flush(output);
+	}
+
+	void flush(OutputFile& output) {
+		if (!buffer.empty() && !output.append(buffer)) failed = true;
+		buffer.clear();
+	}
+};
+
+int main(int argc, char* argv[]) {
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	FeatureTransformer::init();
+	attacks::init();
+	pgn::init();
+
+	if (argc < 3) {
+		std::cout << "Usage: selfplay <net.nnue> <training data> [options]\n"
+			<< "  --games <n>             number of games, default 1000\n"
+			<< "  --threads <n>           number of worker threads\n"
+			<< "  --pin                   pin the threads to CPUs, spread over NUMA nodes\n"
+			<< "  --depth <n>             search depth per move, default 6\n"
+			<< "  --nodes <n>             node limit per move\n"
+			<< "  --hash <mb>             transposition table size per thread, default 16\n"
+			<< "  --random-plies <n>      random moves at the start of each game, default 8\n"
+			<< "  --max-game-ply <n>      adjudicate a draw at ply n, default 400\n"
+			<< "  --adjudicate <cp> <n>   adjudicate a win after n plies with |score| >= cp\n"
+			<< "  --seed <n>              random seed\n"
+			<< "  --min-ply <n>           skip positions before ply n\n"
+			<< "  --max-ply <n>           skip positions after ply n\n"
+			<< "  --max-score <n>         skip positions with |score| > n\n"
+			<< "  --skip-in-check         skip positions where the side to move is in check\n"
+			<< "  --skip-captures         skip positions where the best move is a capture" << std::endl;
+		return 1;
+	}
+
+	Options options;
+	for (int i = 3; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (arg == "--games" && i+1 < argc) options.games = std::stoul(argv[++i]);
+		else if (arg == "--threads" && i+1 < argc) options.numThreads = std::stoul(argv[++i]);
+		else if (arg == "--pin") options.pin = true;
+		else if (arg == "--depth" && i+1 < argc) options.limits.depth = std::stoi(argv[++i]);
+		else if (arg == "--nodes" && i+1 < argc) options.limits.nodes = std::stoull(argv[++i]);
+		else if (arg == "--hash" && i+1 < argc) options.hashMb = std::stoul(argv[++i]);
+		else if (arg == "--random-plies" && i+1 < argc) options.randomPlies = std::stoi(argv[++i]);
+		else if (arg == "--max-game-ply" && i+1 < argc) options.maxGamePly = std::stoi(argv[++i]);
+		else if (arg == "--adjudicate" && i+2 < argc) {
+			options.adjudicateScore = std::stoi(argv[++i]);
+			options.adjudicatePlies = std::stoi(argv[++i]);
+		}
+		else if (arg == "--seed" && i+1 < argc) options.seed = std::stoull(argv[++i]);
+		else if (arg == "--min-ply" && i+1 < argc) options.filter.minPly = std::stoi(argv[++i]);
+		else if (arg == "--max-ply" && i+1 < argc) options.filter.maxPly = std::stoi(argv[++i]);
+		else if (arg == "--max-score" && i+1 < argc) options.filter.maxScore = std::stoi(argv[++i]);
+		else if (arg == "--skip-in-check") options.filter.skipInCheck = true;
+		else if (arg == "--skip-captures") options.filter.skipCaptures = true;
+		else {
+			std::cout << "Unknown option " << arg << "." << std::endl;
+			return 1;
+		}
+	}
+	options.numThreads = std::max<size_t>(options.numThreads, 1);
+	options.limits.depth = std::clamp(options.limits.depth, 1, search::MAX_PLY - 1);
+
+	auto network = std::make_unique<nnue::Network>();
+	if (!network->load(argv[1])) {
+		std::cout << "Cannot load network " << argv[1] << ": " << network->error << "." << std::endl;
+		return 1;
+	}
+
+	OutputFile output;
+	if (!output.open(argv[2])) {
+		std::cout << "Cannot open " << argv[2] << "." << std::endl;
+		return 1;
+	}
+
+	std::cout << "Playing " << options.games << " games with " << options.numThreads << " threads." << std::endl;
+
+	ThreadPool pool(options.numThreads, options.pin);
+	std::vector<Worker> workers(options.numThreads);
+	for (Worker& w : workers)
+		w.searcher = std::make_unique<search::Searcher>(*network, options.hashMb);
+	pool.run(options.games, [&](size_t game, size_t thread) {
+		workers[thread].play(game, options, output);
+	});
+
+	WorkerStats total;
+	bool failed = false;
+	for (Worker& w : workers) {
+		w.flush(output);
+		failed |= w.failed;
+		const WorkerStats& s = w.stats;
+		total.games += s.games;
+		for (int i = 0; i < 3; ++i) total.results[i] += s.results[i];
+		total.nodes += s.nodes;
+		total.filter += s.filter;
+	}
+	if (failed) {
+		std::cout << "Cannot write " << argv[2] << "." << std::endl;
+		return 1;
+	}
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	double seconds = (t1-t0).count() * 1e-9;
+	std::cout << "Games: " << total.games << " ("
+		<< total.results[2] << " white wins, "
+		<< total.results[1] << " draws, "
+		<< total.results[0] << " black wins)" << std::endl;
+	std::cout << "Positions written: " << total.filter.written << " (" << (size_t)(total.filter.written / seconds) << "/s)" << std::endl;
+	std::cout << "Positions skipped: "
+		<< total.filter.ply << " (ply), "
+		<< total.filter.score << " (score), "
+		<< total.filter.inCheck << " (in check), "
+		<< total.filter.capture << " (capture)" << std::endl;
+	std::cout << "Nodes: " << total.nodes << " (" << (size_t)(total.nodes / seconds) << "/s)" << std::endl;
+	if (options.numThreads > 1) pool.printStats(std::cout);
+	std::cout << "Elapsed time: " << seconds << std::endl;
+}
@@ -1,91 +1,290 @@
 import argparse
-import functools
+import ctypes
 import numpy as np
-import operator
+import struct
 import torch
+import zlib
 
 from constants import*
+from library import lib, feature_factors, feature_set_info, FeatureSetInfo
 import model
 
+# Versioned .nnue files start with a header and a section table, followed
+# by the tensors at 64-byte aligned offsets, see nnue/nnue_file.h.
+NNUE_MAGIC = b'NNUE'
+NNUE_VERSION = 1
+SECTION_ALIGNMENT = 64
+SECTION_TRANSPOSED = 1
+SECTION_REMAP = 2
+
+HEADER_FORMAT = '<4sIIIIIQ'
+SECTION_FORMAT = '<QQBBHi'
+
+INT16 = 0
+INT32 = 1
+
+# The feature set is only hashed if it is not king-pieces, see nnue::architectureHash.
+def architecture_hash(feature_set=FEATURE_SET_KING_PIECES, input_hsize=INPUT_HSIZE):
+    values = [input_hsize, ACCUMULATOR_HSIZE, HIDDEN_1_SIZE, HIDDEN_2_SIZE, OUTPUT_SIZE]
+    if feature_set != FEATURE_SET_KING_PIECES:
+        values.append(feature_set)
+    hash = 2166136261
+    for value in values:
+        for byte in struct.pack('<I', value):
+            hash = ((hash ^ byte) * 16777619) & 0xffffffff
+    return hash
+
+# Feature sets a quantized net can use as (id, input size), factorized nets
+# are folded into king-pieces first. Only king-pieces without the library.
+def quantizable_feature_sets():
+    if not lib:
+        return [(FEATURE_SET_KING_PIECES, INPUT_HSIZE)]
+    feature_sets = []
+    for feature_set in range(FEATURE_SET_KING_PIECES, 256):
+        info = FeatureSetInfo()
+        if not lib.get_feature_set_info(feature_set, ctypes.byref(info)):
+            break
+        if feature_set != FEATURE_SET_FACTORIZED:
+            feature_sets.append((feature_set, info.input_size))
+    return feature_sets
+
+def align(n):
+    return (n + SECTION_ALIGNMENT - 1) // SECTION_ALIGNMENT * SECTION_ALIGNMENT
+
+# (parameter, dtype, scale, transposed) in file order
+def tensors(model_):
+    return [
+        (model_.linear_white_accumulator.bias, INT16, BIAS_SCALE_ACCUMULATOR, False),
+        (model_.linear_black_accumulator.bias, INT16, BIAS_SCALE_ACCUMULATOR, False),
+        (model_.linear_white_accumulator.weight, INT16, WEIGHT_SCALE_ACCUMULATOR, True),
+        (model_.linear_black_accumulator.weight, INT16, WEIGHT_SCALE_ACCUMULATOR, True),
+        (model_.linear_1.bias, INT32, BIAS_SCALE_HIDDEN_1, False),
+        (model_.linear_1.weight, INT16, WEIGHT_SCALE_HIDDEN_1, False),
+        (model_.linear_2.bias, INT32, BIAS_SCALE_HIDDEN_2, False),
+        (model_.linear_2.weight, INT16, WEIGHT_SCALE_HIDDEN_2, False),
+        (model_.linear_out.bias, INT32, BIAS_SCALE_OUT, False),
+        (model_.linear_out.weight, INT16, WEIGHT_SCALE_OUT, False),
+    ]
+
+# Features active at least min_count times keep their row of the compacted
+# feature transformer, all others share the last row, which is all zeros.
+def feature_remap(feature_counts, min_count):
+    keep = feature_counts >= max(min_count, 1)
+    remap = np.full(len(feature_counts), keep.sum(), dtype=np.int32)
+    remap[keep] = np.arange(keep.sum(), dtype=np.int32)
+    return keep, remap
+
 class NNUE_Writer:
-    def __init__(self, model_):
-        self.buffer = bytearray()
-
-        self.write_accumulator(model_)
-        self.write_layer(model_.linear_1, BIAS_SCALE_HIDDEN_1, WEIGHT_SCALE_HIDDEN_1)
-        self.write_layer(model_.linear_2, BIAS_SCALE_HIDDEN_2, WEIGHT_SCALE_HIDDEN_2)
-        self.write_layer(model_.linear_out, BIAS_SCALE_OUT, WEIGHT_SCALE_OUT)
-
-    # The accumulator is stored as int16 weights, int16 biases.
-    def write_accumulator(self, model_):
-        white_bias = model_.linear_white_accumulator.bias
-        black_bias = model_.linear_black_accumulator.bias
-        white_weight = model_.linear_white_accumulator.weight
-        black_weight = model_.linear_black_accumulator.weight
-
-        white_bias = white_bias.mul(BIAS_SCALE_ACCUMULATOR).round().to(torch.int16)
-        black_bias = black_bias.mul(BIAS_SCALE_ACCUMULATOR).round().to(torch.int16)
-        white_weight = white_weight.mul(WEIGHT_SCALE_ACCUMULATOR).round().to(torch.int16)
-        black_weight = black_weight.mul(WEIGHT_SCALE_ACCUMULATOR).round().to(torch.int16)
-
-        self.buffer.extend(white_bias.flatten().numpy().tobytes())
-        self.buffer.extend(black_bias.flatten().numpy().tobytes())
-        self.buffer.extend(white_weight.flatten().numpy().tobytes())
-        self.buffer.extend(black_weight.flatten().numpy().tobytes())
-
-    # Layers are stored as int16 weights, int32 biases.
-    def write_layer(self, layer, bias_scale, weight_scale):
-        bias = layer.bias
-        weight = layer.weight
-
-        bias = bias.mul(bias_scale).round().to(torch.int32)
-        weight = weight.mul(weight_scale).round().to(torch.int16)
-
-        self.buffer.extend(bias.flatten().numpy().tobytes())
-        self.buffer.extend(weight.flatten().numpy().tobytes())    
+    def __init__(self, model_, feature_set=FEATURE_SET_KING_PIECES, feature_counts=None, min_count=1):
+        if feature_counts is not None:
+            keep, remap = feature_remap(feature_counts, min_count)
+
+        sections = []
+        for param, dtype, scale, transposed in tensors(model_):
+            tensor = param.detach().cpu().mul(scale).round()
+            if transposed:
+                tensor = tensor.t()
+                if feature_counts is not None:
+                    tensor = torch.cat([tensor[torch.from_numpy(keep)], torch.zeros(1, tensor.shape[1])])
+            # saturate like nnue::quantize, in double where int32 is exact
+            int_type = torch.int16 if dtype == INT16 else torch.int32
+            info = torch.iinfo(int_type)
+            tensor = tensor.double().clamp(info.min, info.max).to(int_type)
+            sections.append((tensor.contiguous().numpy().tobytes(), dtype, scale,
+                SECTION_TRANSPOSED if transposed else 0))
+
+        if feature_counts is not None:
+            sections.append((remap.tobytes(), INT32, 1, SECTION_REMAP))
+
+        header_size = align(struct.calcsize(HEADER_FORMAT) + len(sections) * struct.calcsize(SECTION_FORMAT))
+        table = bytearray()
+        data = bytearray()
+        checksum = 0
+        offset = header_size
+        for bytes_, dtype, scale, flags in sections:
+            table.extend(struct.pack(SECTION_FORMAT, offset, len(bytes_), dtype, flags, 0, scale))
+            padding = align(offset + len(bytes_)) - offset - len(bytes_)
+            data.extend(bytes_)
+            data.extend(bytes(padding))
+            checksum = zlib.crc32(bytes_, checksum)
+            offset += len(bytes_) + padding
+
+        self.buffer = bytearray(struct.pack(HEADER_FORMAT, NNUE_MAGIC, NNUE_VERSION,
+            architecture_hash(feature_set, model_.linear_white_accumulator.in_features),
+            len(sections), checksum, header_size, offset))
+        self.buffer.extend(table)
+        self.buffer.extend(bytes(header_size - len(self.buffer)))
+        self.buffer.extend(data)
 
 class NNUE_Reader:
     def __init__(self, f):
-        self.f = f
-        self.model_ = model.NN()
-        self.read_accumulator()
-        self.read_layer(self.model_.linear_1, BIAS_SCALE_HIDDEN_1, WEIGHT_SCALE_HIDDEN_1)
-        self.read_layer(self.model_.linear_2, BIAS_SCALE_HIDDEN_2, WEIGHT_SCALE_HIDDEN_2)
-        self.read_layer(self.model_.linear_out, BIAS_SCALE_OUT, WEIGHT_SCALE_OUT)
-
-    def tensor(self, shape, dtype):
-        tensor = np.fromfile(self.f, dtype, functools.reduce(operator.mul, shape, 1))
-        tensor = torch.from_numpy(tensor.astype(np.float32))
-        tensor = tensor.reshape(shape)
-        return tensor
-
-    def read_accumulator(self):
-        white_bias = self.tensor(self.model_.linear_white_accumulator.bias.shape, np.int16)
-        black_bias = self.tensor(self.model_.linear_black_accumulator.bias.shape, np.int16) 
-        white_weight = self.tensor(self.model_.linear_white_accumulator.weight.shape, np.int16)
-        black_weight = self.tensor(self.model_.linear_black_accumulator.weight.shape, np.int16)
-
-        self.model_.linear_white_accumulator.bias.data = white_bias.div(BIAS_SCALE_ACCUMULATOR)
-        self.model_.linear_black_accumulator.bias.data = black_bias.div(BIAS_SCALE_ACCUMULATOR)
-        self.model_.linear_white_accumulator.weight.data = white_weight.div(WEIGHT_SCALE_ACCUMULATOR)
-        self.model_.linear_black_accumulator.weight.data = black_weight.div(WEIGHT_SCALE_ACCUMULATOR)
-
-    def read_layer(self, layer, bias_scaling, weight_scaling):
-        layer.bias.data = self.tensor(layer.bias.shape, np.int32).div(bias_scaling)
-        layer.weight.data = self.tensor(layer.weight.shape, np.int16).div(weight_scaling)
+        data = f.read()
+        remap = None
+
+        if data[:4] == NNUE_MAGIC:
+            self.model_ = model.NN(self.input_hsize(data))
+            params = tensors(self.model_)
+            sections, remap = self.read_sections(data, params)
+        else:
+            self.model_ = model.NN()
+            params = tensors(self.model_)
+            # headerless legacy file, tensors back to back and not transposed
+            sections = []
+            offset = 0
+            for param, dtype, _, _ in params:
+                size = param.numel() * (2 if dtype == INT16 else 4)
+                sections.append((offset, 0, param.numel()))
+                offset += size
+            if offset != len(data):
+                raise Exception('No .nnue header and unexpected size {}, headerless files must have {} bytes'.format(len(data), offset))
+
+        for (param, dtype, scale, _), (offset, flags, count) in zip(params, sections):
+            np_type = np.int16 if dtype == INT16 else np.int32
+            tensor = np.frombuffer(data, np_type, count, offset)
+            if flags & SECTION_TRANSPOSED:
+                tensor = tensor.reshape(-1, param.shape[0])
+                if remap is not None:
+                    tensor = tensor[remap]
+                tensor = tensor.T
+            tensor = torch.from_numpy(tensor.astype(np.float32))
+            param.data = tensor.reshape(param.shape).div(scale)
+
+    # Input size of the feature set the architecture hash belongs to.
+    def input_hsize(self, data):
+        magic, version, architecture, *_ = struct.unpack_from(HEADER_FORMAT, data)
+        if version != NNUE_VERSION:
+            raise Exception('Unsupported .nnue version {}'.format(version))
+        for feature_set, input_hsize in quantizable_feature_sets():
+            if architecture == architecture_hash(feature_set, input_hsize):
+                return input_hsize
+        raise Exception('Architecture hash {} matches no known feature set'.format(architecture))
+
+    def read_sections(self, data, params):
+        magic, version, architecture, num_sections, checksum, header_size, file_size = \
+            struct.unpack_from(HEADER_FORMAT, data)
+        input_hsize = params[2][0].shape[1]
+        if num_sections not in [len(params), len(params) + 1] or file_size != len(data):
+            raise Exception('Unexpected number of sections or file size')
+
+        entries = [struct.unpack_from(SECTION_FORMAT, data,
+            struct.calcsize(HEADER_FORMAT) + i * struct.calcsize(SECTION_FORMAT)) for i in range(num_sections)]
+
+        remap = None
+        if num_sections > len(params):
+            offset, size, type_, flags, _, _ = entries[-1]
+            if flags != SECTION_REMAP or type_ != INT32 or size != input_hsize * 4:
+                raise Exception('Invalid feature remap section')
+            remap = np.frombuffer(data, np.int32, input_hsize, offset)
+
+        sections = []
+        crc = 0
+        for i, (offset, size, type_, flags, _, scale_) in enumerate(entries):
+            if offset + size > len(data):
+                raise Exception('File is truncated')
+            crc = zlib.crc32(data[offset:offset + size], crc)
+            if i == len(params):
+                continue
+
+            param, dtype, scale, _ = params[i]
+            count = param.numel()
+            if remap is not None and flags & SECTION_TRANSPOSED:
+                rows = size // (2 * param.shape[0])
+                if remap.min() < 0 or remap.max() >= rows:
+                    raise Exception('Feature remap table out of range')
+                count = rows * param.shape[0]
+            if size != count * (2 if dtype == INT16 else 4) or type_ != dtype or scale_ != scale:
+                raise Exception('Unexpected shape, type or scale of section {}'.format(i))
+            sections.append((offset, flags, count))
+
+        if crc != checksum:
+            raise Exception('Checksum mismatch, the file is corrupted')
+        return sections, remap
+
+# Folds the virtual features of a net trained with the factorized feature
+# set into the king-pieces weights they belong to.
+def fold_factorized(model_):
+    folded = model.NN()
+    accumulators = [
+        (folded.linear_white_accumulator, model_.linear_white_accumulator, WHITE),
+        (folded.linear_black_accumulator, model_.linear_black_accumulator, BLACK),
+    ]
+    for dst, src, color in accumulators:
+        factors = torch.from_numpy(feature_factors(color))
+        valid = factors >= 0
+        weight = src.weight.detach().cpu()
+        folded_weight = weight[:, :INPUT_HSIZE].clone()
+        folded_weight[:, valid] += weight[:, factors[valid]]
+        dst.weight.data = folded_weight
+        dst.bias.data = src.bias.detach().cpu().clone()
+
+    for name in ['linear_1', 'linear_2', 'linear_out']:
+        getattr(folded, name).load_state_dict(getattr(model_, name).state_dict())
+    return folded
+
+# Quantized and float files store nets of the quantizable feature sets, the
+# feature set is told by the input size. Returns the model and the feature set.
+def quantizable_model(model_):
+    input_hsize = model_.linear_white_accumulator.in_features
+    for feature_set, size in quantizable_feature_sets():
+        if input_hsize == size:
+            return model_, feature_set
+    if lib and input_hsize == feature_set_info(FEATURE_SET_FACTORIZED).input_size:
+        return fold_factorized(model_), FEATURE_SET_KING_PIECES
+    raise Exception('Cannot serialize a net with {} inputs'.format(input_hsize))
+
+# Reads a .nnue file, natively if the training_data_loader library is available.
+def read_nnue(path):
+    if not lib:
+        with open(path, 'rb') as f:
+            return NNUE_Reader(f).model_
+
+    feature_set = lib.nnue_feature_set(path.encode('utf-8'))
+    if feature_set < 0:
+        raise Exception('Cannot read network {}: {}'.format(path, lib.nnue_error().decode('utf-8')))
+
+    model_ = model.NN(feature_set_info(feature_set).input_size)
+    flat = torch.empty(lib.nnue_num_parameters(feature_set), dtype=torch.float32)
+    if not lib.nnue_read(path.encode('utf-8'), flat.data_ptr()):
+        raise Exception('Cannot read network {}: {}'.format(path, lib.nnue_error().decode('utf-8')))
+
+    offset = 0
+    for param, _, _, _ in tensors(model_):
+        param.data = flat[offset:offset + param.numel()].reshape(param.shape).clone()
+        offset += param.numel()
+    return model_
+
+# Writes a .nnue file, natively if the training_data_loader library is available.
+# With feature counts, see train.py --feature_counts, the feature transformer
+# is compacted to the features active at least min_count times.
+def write_nnue(model_, path, feature_set=FEATURE_SET_KING_PIECES, feature_counts=None, min_count=1):
+    if not lib:
+        writer = NNUE_Writer(model_, feature_set, feature_counts, min_count)
+        with open(path, 'wb') as f:
+            f.write(writer.buffer)
+        return
+
+    flat = torch.cat([param.detach().float().cpu().flatten() for param, _, _, _ in tensors(model_)]).contiguous()
+    if feature_counts is None:
+        ok = lib.nnue_write(path.encode('utf-8'), flat.data_ptr(), feature_set)
+    else:
+        feature_counts = np.ascontiguousarray(feature_counts, dtype=np.uint64)
+        ok = lib.nnue_write_compact(path.encode('utf-8'), flat.data_ptr(), feature_set,
+            feature_counts.ctypes.data, max(min_count, 1))
+    if not ok:
+        raise Exception('Cannot write network {}'.format(path))
 
 def main():
     parser = argparse.ArgumentParser(description='Converts files between pt and nnue format')
     parser.add_argument('source', help='Source file (can be .pt or .nnue)')
-    parser.add_argument('target', help='Target file (can be .pt or .nnue)')
+    parser.add_argument('target', help='Target file (can be .pt, .nnue or .f32)')
+    parser.add_argument('--feature_counts', help='Compact the .nnue feature transformer using counts written by train.py')
+    parser.add_argument('--min_count', type=int, default=1, help='Keep features active at least this many times')
     args =  parser.parse_args()
     
     print('Converting {} to {}'.format(args.source, args.target))
 
     if args.source.endswith('.nnue'):
-        with open(args.source, 'rb') as f:
-            reader = NNUE_Reader(f)
-        model_ = reader.model_
+        model_ = read_nnue(args.source)
 
     elif args.source.endswith('.pt'):
         model_ = torch.load(args.source)
@@ -93,14 +292,24 @@ def main():
     else:
         raise Exception('Invalid network input format')
 
+    feature_set = FEATURE_SET_KING_PIECES
+    if args.target.endswith('.nnue') or args.target.endswith('.f32'):
+        model_, feature_set = quantizable_model(model_)
+
     if args.target.endswith('.nnue'):
-        writer = NNUE_Writer(model_)
-        with open(args.target, 'wb') as f:
-            f.write(writer.buffer)
+        feature_counts = None
+        if args.feature_counts:
+            feature_counts = np.fromfile(args.feature_counts, dtype=np.uint64)
+        write_nnue(model_, args.target, feature_set, feature_counts, args.min_count)
 
     elif args.target.endswith('.pt'):
         torch.save(model_, args.target)
 
+    # raw float32 tensors, e.g. for nnue report
+    elif args.target.endswith('.f32'):
+        flat = torch.cat([param.detach().float().cpu().flatten() for param, _, _, _ in tensors(model_)])
+        flat.numpy().tofile(args.target)
+
     else:
         raise Exception('Invalid network output format')
 
@@ -0,0 +1,116 @@
+#include<atomic>
+#include<chrono>
+#include<iostream>
+#include<string>
+#include<vector>
+
+#include"../mapped_file.h"
+#include"../output_file.h"
+#include"../thread_pool.h"
+#include"../training_data_formats.h"
+
+// The input is converted in windows of this many bytes, split into chunks of
+// CHUNK_SIZE bytes that are converted in parallel and written in order, so
+// that memory stays bounded by the window and its output.
+constexpr size_t WINDOW_SIZE = 64 << 20;
+constexpr size_t CHUNK_SIZE = 1 << 20;
+
+// Returns false if the chunk holds a malformed record.
+bool convertChunk(TrainingData::Format from, TrainingData::Format to, const char* curr, const char* end,
+		std::vector<char>& output, size_t& records) {
+	TrainingData::Reader reader(from, curr, end);
+	TrainingData::Writer writer(to);
+	TrainingDataEntry e;
+	output.clear();
+	while (reader.read(e)) {
+		writer.write(output, e);
+		++records;
+	}
+	writer.finish(output);
+	return reader.complete();
+}
+
+int main(int argc, char* argv[]) {
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	Position::init();
+
+	if (argc < 3) {
+		std::cout << "Usage: td_convert <input> <output> [options]\n"
+			<< "  --from <td|packed|text|chained>  input format, by default by its extension\n"
+			<< "  --to <td|packed|text|chained>    output format, by default by its extension\n"
+			<< "  --threads <n>                    number of worker threads\n"
+			<< "  --pin                            pin the threads to CPUs, spread over NUMA nodes\n"
+			<< "Extensions: .td, .tdp (packed), .txt (text) and .tdc (chained), other files are td." << std::endl;
+		return 1;
+	}
+
+	TrainingData::Format from = TrainingData::formatOf(argv[1]);
+	TrainingData::Format to = TrainingData::formatOf(argv[2]);
+	size_t numThreads = 1;
+	bool pin = false;
+	for (int i = 3; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if ((arg == "--from" || arg == "--to") && i+1 < argc) {
+			if (!TrainingData::formatFromName(argv[++i], arg == "--from" ? from : to)) {
+				std::cout << "Unknown format " << argv[i] << "." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--threads" && i+1 < argc) numThreads = std::stoul(argv[++i]);
+		else if (arg == "--pin") pin = true;
+		else {
+			std::cout << "Unknown option " << arg << "." << std::endl;
+			return 1;
+		}
+	}
+
+	MappedFile input;
+	if (!input.open(argv[1])) {
+		std::cout << "Cannot open " << argv[1] << "." << std::endl;
+		return 1;
+	}
+	OutputFile output;
+	if (!output.open(argv[2])) {
+		std::cout << "Cannot open " << argv[2] << "." << std::endl;
+		return 1;
+	}
+
+	std::cout << "Converting " << argv[1] << " (" << TrainingData::FORMAT_NAMES[from] << ") to "
+		<< argv[2] << " (" << TrainingData::FORMAT_NAMES[to] << ")." << std::endl;
+
+	ThreadPool pool(numThreads, pin);
+	std::vector<size_t> records(pool.numThreads);
+	std::vector<std::vector<char>> outputs;
+	std::atomic<bool> malformed = false;
+	bool failed = false;
+	bool complete = TrainingData::forEachWindow(from, input.data, input.size, WINDOW_SIZE, CHUNK_SIZE, [&](const auto& bounds) {
+		size_t numChunks = bounds.size() - 1;
+		outputs.resize(std::max(outputs.size(), numChunks));
+		pool.run(numChunks, [&](size_t c, size_t thread) {
+			if (!convertChunk(from, to, bounds[c], bounds[c + 1], outputs[c], records[thread]))
+				malformed = true;
+		});
+		for (size_t c = 0; c < numChunks && !failed; ++c)
+			failed = !output.append(outputs[c]);
+	});
+
+	if (!complete || malformed) {
+		std::cout << "Cannot read " << argv[1] << ", it holds an incomplete or malformed record." << std::endl;
+		return 1;
+	}
+	if (failed) {
+		std::cout << "Cannot write " << argv[2] << "." << std::endl;
+		return 1;
+	}
+
+	size_t total = 0;
+	for (size_t n : records) total += n;
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	double seconds = (t1-t0).count() * 1e-9;
+	std::cout << "Positions: " << total << " (" << (size_t)(total / seconds) << "/s)" << std::endl;
+	std::cout << "Size: " << input.size << " -> " << output.size << " bytes" << std::endl;
+	if (numThreads > 1) pool.printStats(std::cout);
+	std::cout << "Elapsed time: " << seconds << std::endl;
+}
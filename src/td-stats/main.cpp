@@ -0,0 +1,311 @@
+#include<algorithm>
+#include<atomic>
+#include<chrono>
+#include<cmath>
+#include<fstream>
+#include<iomanip>
+#include<iostream>
+#include<string>
+#include<vector>
+
+#include"../feature_transformer.h"
+#include"../mapped_file.h"
+#include"../thread_pool.h"
+#include"../training_data_formats.h"
+
+// Distinct position estimate with a HyperLogLog sketch, so that the
+// duplicate rate of any amount of data takes 64 KB per thread.
+struct DistinctCounter {
+	static constexpr int INDEX_BITS = 16;
+	static constexpr size_t N_REGISTERS = (size_t)1 << INDEX_BITS;
+
+	std::vector<uint8_t> registers = std::vector<uint8_t>(N_REGISTERS);
+
+	void add(uint64_t hash) {
+		size_t i = hash >> (64 - INDEX_BITS);
+		uint64_t rest = hash << INDEX_BITS | (uint64_t)1 << (INDEX_BITS - 1);
+		registers[i] = std::max<uint8_t>(registers[i], __builtin_clzll(rest) + 1);
+	}
+
+	void merge(const DistinctCounter& other) {
+		for (size_t i = 0; i < N_REGISTERS; ++i)
+			registers[i] = std::max(registers[i], other.registers[i]);
+	}
+
+	double estimate() const {
+		double sum = 0;
+		size_t zeros = 0;
+		for (uint8_t r : registers) {
+			sum += std::ldexp(1.0, -r);
+			zeros += r == 0;
+		}
+		double m = N_REGISTERS;
+		double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+		// linear counting is more precise for small counts
+		return e <= 2.5 * m && zeros ? m * std::log(m / zeros) : e;
+	}
+};
+
+// Hash of the position without the move counters, so that transpositions
+// count as duplicates.
+uint64_t positionHash(const PackedPosition& pos) {
+	uint64_t words[4];
+	std::memcpy(&words[0], &pos.occupied, 8);
+	std::memcpy(&words[1], pos.pieces, 16);
+	words[3] = pos.sideToMove | pos.castlingRights.data << 1 | (uint64_t)pos.epSquare << 8;
+
+	uint64_t h = 0;
+	for (uint64_t w : words) {
+		// splitmix64 finalizer
+		h ^= w + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+		h = (h ^ h >> 30) * 0xbf58476d1ce4e5b9;
+		h = (h ^ h >> 27) * 0x94d049bb133111eb;
+		h ^= h >> 31;
+	}
+	return h;
+}
+
+struct Stats {
+	static constexpr int N_SCORE_BINS = 64;
+	static constexpr int SCORE_BIN_WIDTH = 100;	// the outer bins hold every larger |score|
+	static constexpr int N_PIECE_COUNTS = 33;
+
+	size_t records = 0;
+	size_t bytes = 0;
+	double scoreSum = 0;
+	double scoreSquareSum = 0;
+	size_t scoreBins[N_SCORE_BINS] = {};
+	size_t results[3] = {};			// loss, draw, win of the side to move
+	size_t whiteResults[3] = {};	// black wins, draws, white wins
+	size_t pieceCounts[N_PIECE_COUNTS] = {};
+	DistinctCounter distinct;
+	std::vector<uint64_t> featureCounts;	// empty without a feature set
+	uint64_t activeFeatures = 0;
+
+	void add(const TrainingDataEntry& e, size_t size) {
+		++records;
+		bytes += size;
+		scoreSum += e.score;
+		scoreSquareSum += (double)e.score * e.score;
+		int bin = (int)std::floor((double)e.score / SCORE_BIN_WIDTH) + N_SCORE_BINS / 2;
+		++scoreBins[std::clamp(bin, 0, N_SCORE_BINS - 1)];
+		int result = std::clamp<int>(e.result, -1, 1);
+		++results[result + 1];
+		++whiteResults[(e.pos.sideToMove == WHITE ? result : -result) + 1];
+		Bitboard occupied = e.pos.occupied;
+		++pieceCounts[occupied.popcount()];
+		distinct.add(positionHash(e.pos));
+	}
+
+	void merge(const Stats& other) {
+		records += other.records;
+		bytes += other.bytes;
+		scoreSum += other.scoreSum;
+		scoreSquareSum += other.scoreSquareSum;
+		for (int i = 0; i < N_SCORE_BINS; ++i) scoreBins[i] += other.scoreBins[i];
+		for (int i = 0; i < 3; ++i) results[i] += other.results[i];
+		for (int i = 0; i < 3; ++i) whiteResults[i] += other.whiteResults[i];
+		for (int i = 0; i < N_PIECE_COUNTS; ++i) pieceCounts[i] += other.pieceCounts[i];
+		distinct.merge(other.distinct);
+		for (size_t i = 0; i < featureCounts.size(); ++i) featureCounts[i] += other.featureCounts[i];
+		activeFeatures += other.activeFeatures;
+	}
+};
+
+// Counts the features of both perspectives of every position.
+template<class FeatureSet>
+void countFeatures(const TrainingDataEntry& e, Stats& stats) {
+	IndexType active[FeatureSet::MAX_ACTIVE];
+	for (Color c : { WHITE, BLACK }) {
+		IndexType size = FeatureSet::active(e.pos, c, active);
+		for (IndexType i = 0; i < size; ++i)
+			++stats.featureCounts[active[i]];
+		stats.activeFeatures += size;
+	}
+}
+
+// Returns false if the chunk holds a malformed record.
+template<class FeatureSet>
+bool scanChunk(TrainingData::Format format, const char* curr, const char* end, Stats& stats, bool features) {
+	TrainingData::Reader reader(format, curr, end);
+	TrainingDataEntry e;
+	const char* record = curr;
+	while (reader.read(e)) {
+		// a chained block counts for its first entry
+		stats.add(e, reader.curr - record);
+		if (features) countFeatures<FeatureSet>(e, stats);
+		record = reader.curr;
+	}
+	return reader.complete();
+}
+
+// The file is mapped and read in windows of this many bytes: one thread
+// finds the record boundaries of a window, which pulls it into the page
+// cache, then all threads scan its chunks of CHUNK_SIZE bytes.
+constexpr size_t WINDOW_SIZE = 256 << 20;
+constexpr size_t CHUNK_SIZE = 1 << 20;
+
+// Returns false if the file cannot be read or holds an incomplete or malformed record.
+bool scanFile(const std::filesystem::path& file, TrainingData::Format format, uint8_t featureSet, bool features,
+		ThreadPool& pool, std::vector<Stats>& stats) {
+	MappedFile input;
+	if (!input.open(file)) return false;
+
+	std::atomic<bool> malformed = false;
+	bool complete = TrainingData::forEachWindow(format, input.data, input.size, WINDOW_SIZE, CHUNK_SIZE, [&](const auto& bounds) {
+		pool.run(bounds.size() - 1, [&](size_t c, size_t thread) {
+			FeatureTransformer::withFeatureSet(featureSet, [&](auto set) {
+				if (!scanChunk<decltype(set)>(format, bounds[c], bounds[c + 1], stats[thread], features))
+					malformed = true;
+			});
+		});
+	});
+	return complete && !malformed;
+}
+
+void printBar(std::ostream& os, const std::string& label, size_t count, size_t total, size_t max) {
+	os << "  " << std::setw(14) << label << std::setw(12) << count << std::setw(8) << std::fixed << std::setprecision(2)
+		<< 100.0 * count / std::max<size_t>(total, 1) << "% " << std::string(40 * count / std::max<size_t>(max, 1), '#')
+		<< std::defaultfloat << std::setprecision(6) << '\n';
+}
+
+void printStats(const Stats& s, IndexType inputSize, const char* featureSetName) {
+	std::cout << "Records: " << s.records << std::endl;
+	std::cout << "Mean record size: " << (double)s.bytes / std::max<size_t>(s.records, 1) << " bytes" << std::endl;
+
+	double mean = s.scoreSum / std::max<size_t>(s.records, 1);
+	std::cout << "Score mean: " << mean << ", standard deviation: "
+		<< std::sqrt(std::max(0.0, s.scoreSquareSum / std::max<size_t>(s.records, 1) - mean * mean)) << std::endl;
+	std::cout << "Score histogram:\n";
+	size_t max = *std::max_element(std::begin(s.scoreBins), std::end(s.scoreBins));
+	for (int i = 0; i < Stats::N_SCORE_BINS; ++i) {
+		if (!s.scoreBins[i]) continue;
+		int low = (i - Stats::N_SCORE_BINS / 2) * Stats::SCORE_BIN_WIDTH;
+		std::string label = i == 0 ? "< " + std::to_string(low + Stats::SCORE_BIN_WIDTH)
+			: i == Stats::N_SCORE_BINS - 1 ? ">= " + std::to_string(low)
+			: "[" + std::to_string(low) + ", " + std::to_string(low + Stats::SCORE_BIN_WIDTH) + ")";
+		printBar(std::cout, label, s.scoreBins[i], s.records, max);
+	}
+
+	std::cout << "Results of the side to move:\n";
+	max = *std::max_element(std::begin(s.results), std::end(s.results));
+	const char* names[3] = { "loss", "draw", "win" };
+	for (int i = 0; i < 3; ++i) printBar(std::cout, names[i], s.results[i], s.records, max);
+	std::cout << "Results:\n";
+	max = *std::max_element(std::begin(s.whiteResults), std::end(s.whiteResults));
+	const char* whiteNames[3] = { "black wins", "draw", "white wins" };
+	for (int i = 0; i < 3; ++i) printBar(std::cout, whiteNames[i], s.whiteResults[i], s.records, max);
+
+	std::cout << "Piece counts:\n";
+	max = *std::max_element(std::begin(s.pieceCounts), std::end(s.pieceCounts));
+	for (int i = 0; i < Stats::N_PIECE_COUNTS; ++i)
+		if (s.pieceCounts[i]) printBar(std::cout, std::to_string(i), s.pieceCounts[i], s.records, max);
+
+	double distinct = std::min<double>(s.distinct.estimate(), s.records);
+	std::cout << "Distinct positions: ~" << (size_t)distinct << ", duplicate rate ~" << std::fixed << std::setprecision(2)
+		<< 100 * (1 - distinct / std::max<size_t>(s.records, 1)) << "%" << std::defaultfloat << std::setprecision(6) << std::endl;
+
+	if (s.featureCounts.empty()) return;
+	size_t active = std::count_if(s.featureCounts.begin(), s.featureCounts.end(), [](uint64_t n) { return n > 0; });
+	std::vector<uint64_t> sorted(s.featureCounts);
+	std::sort(sorted.begin(), sorted.end());
+	std::cout << "Features (" << featureSetName << "): " << active << " of " << inputSize << " active, "
+		<< (double)s.activeFeatures / std::max<size_t>(2 * s.records, 1) << " per perspective" << std::endl;
+	std::cout << "Feature counts: median " << sorted[sorted.size() / 2]
+		<< ", 99th percentile " << sorted[sorted.size() * 99 / 100]
+		<< ", max " << sorted.back() << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	FeatureTransformer::init();
+	Position::init();
+
+	std::vector<std::filesystem::path> files;
+	size_t numThreads = 1;
+	bool pin = false;
+	std::string featureSetName = "king-pieces";
+	std::string countsFile;
+	std::string formatName;
+	for (int i = 1; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (arg == "--threads" && i+1 < argc) numThreads = std::stoul(argv[++i]);
+		else if (arg == "--pin") pin = true;
+		else if (arg == "--features" && i+1 < argc) featureSetName = argv[++i];
+		else if (arg == "--feature-counts" && i+1 < argc) countsFile = argv[++i];
+		else if (arg == "--format" && i+1 < argc) formatName = argv[++i];
+		else if (arg.substr(0, 2) == "--") {
+			std::cout << "Unknown option " << arg << "." << std::endl;
+			return 1;
+		}
+		else files.emplace_back(arg);
+	}
+
+	if (files.empty()) {
+		std::cout << "Usage: td_stats <training data>... [options]\n"
+			<< "  --format <td|packed|text|chained>  format of the files, by default by their extension\n"
+			<< "  --threads <n>                      number of worker threads\n"
+			<< "  --pin                              pin the threads to CPUs, spread over NUMA nodes\n"
+			<< "  --features <name|none>             feature set to count, default king-pieces\n"
+			<< "  --feature-counts <file>            write the counter of every feature, see nnue compact" << std::endl;
+		return 1;
+	}
+
+	TrainingData::Format format = TrainingData::TD;
+	if (!formatName.empty() && !TrainingData::formatFromName(formatName, format)) {
+		std::cout << "Unknown format " << formatName << "." << std::endl;
+		return 1;
+	}
+
+	bool features = featureSetName != "none";
+	uint8_t featureSet = FeatureTransformer::N_FEATURE_SETS;
+	for (uint8_t id = 0; id < FeatureTransformer::N_FEATURE_SETS; ++id)
+		if (FeatureTransformer::withFeatureSet(id, [](auto set) { return std::string(decltype(set)::NAME); }) == featureSetName)
+			featureSet = id;
+	if (features && featureSet == FeatureTransformer::N_FEATURE_SETS) {
+		std::cout << "Unknown feature set " << featureSetName << "." << std::endl;
+		return 1;
+	}
+	if (!features && !countsFile.empty()) {
+		std::cout << "--feature-counts needs a feature set." << std::endl;
+		return 1;
+	}
+	IndexType inputSize = FeatureTransformer::withFeatureSet(featureSet, [](auto set) {
+		return (IndexType)decltype(set)::INPUT_SIZE;
+	});
+
+	ThreadPool pool(numThreads, pin);
+	std::vector<Stats> stats(pool.numThreads);
+	if (features)
+		for (Stats& s : stats) s.featureCounts.assign(inputSize, 0);
+
+	for (const auto& file : files) {
+		if (!scanFile(file, formatName.empty() ? TrainingData::formatOf(file) : format, featureSet, features, pool, stats)) {
+			std::cout << "Cannot read " << file << "." << std::endl;
+			return 1;
+		}
+	}
+
+	Stats& total = stats[0];
+	for (size_t i = 1; i < stats.size(); ++i)
+		total.merge(stats[i]);
+
+	printStats(total, inputSize, featureSetName.c_str());
+
+	if (!countsFile.empty()) {
+		std::ofstream os(countsFile, std::ios::binary);
+		os.write((const char*)total.featureCounts.data(), total.featureCounts.size() * sizeof(uint64_t));
+		if (!os) {
+			std::cout << "Cannot write " << countsFile << "." << std::endl;
+			return 1;
+		}
+	}
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	double seconds = (t1-t0).count() * 1e-9;
+	std::cout << "Throughput: " << (size_t)(total.records / seconds) << " records/s, "
+		<< total.bytes / seconds / (1 << 20) << " MB/s" << std::endl;
+	if (numThreads > 1) pool.printStats(std::cout);
+	std::cout << "Elapsed time: " << seconds << std::endl;
+}
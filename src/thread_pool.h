@@ -0,0 +1,202 @@
+#pragma once
+
+#include<algorithm>
+#include<chrono>
+#include<fstream>
+#include<iomanip>
+#include<memory>
+#include<mutex>
+#include<ostream>
+#include<sstream>
+#include<string>
+#include<thread>
+#include<vector>
+
+#if defined(__linux__)
+#include<pthread.h>
+#include<sched.h>
+#endif
+
+// Runs jobs made of independent tasks of uneven cost, like games or chunks of
+// records. Every thread starts with a contiguous range of the task indices and
+// works through it from the front; a thread that runs out steals the back half
+// of the largest remaining range. Threads can be pinned to CPUs, spread over
+// the NUMA nodes (Linux only).
+struct ThreadPool {
+    struct ThreadStats {
+        int cpu = -1;           // -1 if not pinned
+        size_t tasks = 0;
+        size_t steals = 0;
+        double busySeconds = 0;
+    };
+
+    size_t numThreads;
+    bool pin;
+    // summed over the runs since the last resetStats()
+    std::vector<ThreadStats> stats;
+    double wallSeconds = 0;
+
+    ThreadPool(size_t numThreads, bool pin = false) :
+        numThreads(std::max<size_t>(numThreads, 1)), pin(pin), stats(this->numThreads) {}
+
+    // Calls f(task, thread) for every task in [0, numTasks) and waits for all of
+    // them, thread is the index of the calling thread in [0, numThreads).
+    template<class F>
+    void run(size_t numTasks, F&& f) {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<int> cpus = pin ? cpuOrder() : std::vector<int>{};
+        queues = std::make_unique<Queue[]>(numThreads);
+        for (size_t i = 0; i < numThreads; ++i) {
+            queues[i].begin = numTasks * i / numThreads;
+            queues[i].end = numTasks * (i + 1) / numThreads;
+            stats[i].cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        }
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < numThreads; ++i)
+            threads.emplace_back([&, i]() {
+                if (stats[i].cpu >= 0) pinTo(stats[i].cpu);
+                for (size_t task; pop(i, task) || steal(i, task);) {
+                    auto start = std::chrono::steady_clock::now();
+                    f(task, i);
+                    stats[i].busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    ++stats[i].tasks;
+                }
+            });
+        for (auto& t : threads)
+            t.join();
+
+        queues.reset();
+        wallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    void resetStats() {
+        for (ThreadStats& s : stats)
+            s = {};
+        wallSeconds = 0;
+    }
+
+    // Prints tasks, steals and the busy share of the wall time per thread,
+    // over the runs since the last resetStats().
+    void printStats(std::ostream& os) const {
+        for (size_t i = 0; i < numThreads; ++i) {
+            const ThreadStats& s = stats[i];
+            os << "Thread " << i;
+            if (s.cpu >= 0) os << " (cpu " << s.cpu << ")";
+            os << ": " << s.tasks << " tasks, " << s.steals << " steals, utilization "
+                << std::fixed << std::setprecision(1) << 100 * s.busySeconds / std::max(wallSeconds, 1e-9) << "%"
+                << std::defaultfloat << std::setprecision(6) << std::endl;
+        }
+    }
+
+    // CPUs the process may run on, ordered so that consecutive threads
+    // alternate between NUMA nodes.
+    static std::vector<int> cpuOrder() {
+        std::vector<std::vector<int>> nodes;
+#if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool hasMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        for (int node = 0;; ++node) {
+            std::ifstream is("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!is.is_open()) break;
+            std::string list;
+            std::getline(is, list);
+            std::vector<int> cpus;
+            for (int cpu : parseCpuList(list))
+                if (!hasMask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) cpus.push_back(cpu);
+            if (!cpus.empty()) nodes.push_back(cpus);
+        }
+        if (nodes.empty() && hasMask) {
+            nodes.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET(cpu, &allowed)) nodes[0].push_back(cpu);
+        }
+#endif
+        std::vector<int> order;
+        for (size_t i = 0;; ++i) {
+            size_t added = 0;
+            for (const auto& cpus : nodes)
+                if (i < cpus.size()) {
+                    order.push_back(cpus[i]);
+                    ++added;
+                }
+            if (!added) break;
+        }
+        return order;
+    }
+
+    // Parses a list like "0-3,8,10-11".
+    static std::vector<int> parseCpuList(const std::string& list) {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty()) continue;
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+private:
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    std::unique_ptr<Queue[]> queues;
+
+    bool pop(size_t i, size_t& task) {
+        std::lock_guard<std::mutex> lock(queues[i].mutex);
+        if (queues[i].begin == queues[i].end) return false;
+        task = queues[i].begin++;
+        return true;
+    }
+
+    // Moves the back half of the largest range to queue i and pops its first task.
+    bool steal(size_t i, size_t& task) {
+        for (;;) {
+            size_t victim = i;
+            size_t largest = 0;
+            for (size_t j = 0; j < numThreads; ++j) {
+                std::lock_guard<std::mutex> lock(queues[j].mutex);
+                if (queues[j].end - queues[j].begin > largest) {
+                    largest = queues[j].end - queues[j].begin;
+                    victim = j;
+                }
+            }
+            if (!largest) return false;
+
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> lock(queues[victim].mutex);
+                size_t remaining = queues[victim].end - queues[victim].begin;
+                if (!remaining) continue;
+                end = queues[victim].end;
+                begin = end - (remaining + 1) / 2;
+                queues[victim].end = begin;
+            }
+            ++stats[i].steals;
+            std::lock_guard<std::mutex> lock(queues[i].mutex);
+            queues[i].begin = begin + 1;
+            queues[i].end = end;
+            task = begin;
+            return true;
+        }
+    }
+
+    static void pinTo(int cpu) {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)cpu;
+#endif
+    }
+};
@@ -1,14 +1,17 @@
 import argparse
+import json
+import os
 import time
 import torch
 
 from constants import*
 import dataset
+from library import feature_set_id
 import model
 
 def main():
     parser = argparse.ArgumentParser()
-    parser.add_argument('--train', type=str, help='Training data (.td)')
+    parser.add_argument('--train', type=str, help='Training data (.td, .tdp, .txt or .tdc)')
     parser.add_argument('--net', type=str)
     parser.add_argument('--num_epochs', type=int, default=30)
     parser.add_argument('--batch_size', type=int, default=1024)
@@ -16,6 +19,18 @@ def main():
     parser.add_argument('--lr', type=float, default=1e-2)
     parser.add_argument('--gamma', type=float, default=0.1**(1/180))
     parser.add_argument('--skip_entry_prob', type=float, default=0.75)
+    parser.add_argument('--flip', action='store_true', help='Randomly mirror vertically and swap colors')
+    parser.add_argument('--mirror', action='store_true', help='Randomly mirror horizontally without castling rights')
+    parser.add_argument('--features', type=str, default='king-pieces', help='Feature set: king-pieces, halfka-mirrored, factorized or king-buckets-<4|8|16|32>')
+    parser.add_argument('--feature_counts', type=str, help='Write how often every input feature was active, see nnue compact')
+    parser.add_argument('--sampling_weights', type=str, help='JSON file with keep weights per piece_count, score_band, result and ply_band, see dataset.SAMPLING_WEIGHT_TABLES')
+    parser.add_argument('--shuffle_buffer', type=int, default=0, help='Positions held back to draw batches from at random')
+    parser.add_argument('--shuffle_block_size', type=int, default=0, help='Read the training data in blocks of this many bytes in random order')
+    parser.add_argument('--read_ahead', type=int, default=0, help='Blocks of training data read asynchronously while batches are built, 0 reads the mapped file')
+    parser.add_argument('--direct_io', action='store_true', help='Read ahead with direct I/O, bypassing the page cache')
+    parser.add_argument('--seed', type=int, default=0, help='Seed of the data loader')
+    parser.add_argument('--checkpoint', type=str, help='Save the training state here and resume from it if it exists')
+    parser.add_argument('--checkpoint_interval', type=int, default=1000, help='Batches between checkpoints')
     args = parser.parse_args()
 
     config = dataset.Config(
@@ -26,21 +41,51 @@ def main():
         lambda_ = args.lambda_,
         lr = args.lr,
         lr_lambda = lambda epoch : args.gamma,
-        skip_entry_prob = args.skip_entry_prob
+        skip_entry_prob = args.skip_entry_prob,
+        augmentation = (AUGMENT_FLIP if args.flip else 0) | (AUGMENT_MIRROR if args.mirror else 0),
+        count_features = args.feature_counts is not None,
+        feature_set = feature_set_id(args.features),
+        seed = args.seed,
+        sampling_weights = json.load(open(args.sampling_weights)) if args.sampling_weights else None,
+        shuffle_buffer = args.shuffle_buffer,
+        shuffle_block_size = args.shuffle_block_size,
+        read_ahead = args.read_ahead,
+        direct_io = args.direct_io
     )
     model_ = torch.load(args.net).to(config.device)
+    if model_.linear_white_accumulator.in_features != config.input_hsize:
+        raise Exception('The net has {} inputs, the {} feature set {}'.format(
+            model_.linear_white_accumulator.in_features, args.features, config.input_hsize))
     optimizer = torch.optim.Adagrad(model_.parameters(), config.lr)
     scheduler = torch.optim.lr_scheduler.MultiplicativeLR(optimizer, lr_lambda=config.lr_lambda, verbose=True)
 
-    for epoch in range(config.num_epochs):
+    feature_counts = 0
+    start_epoch = 0
+    checkpoint = None
+
+    if args.checkpoint and os.path.isfile(args.checkpoint):
+        checkpoint = torch.load(args.checkpoint)
+        model_.load_state_dict(checkpoint['model'])
+        optimizer.load_state_dict(checkpoint['optimizer'])
+        scheduler.load_state_dict(checkpoint['scheduler'])
+        feature_counts = checkpoint.get('feature_counts', 0)
+        start_epoch = checkpoint['epoch']
+        print('Resuming epoch', start_epoch, 'at batch', checkpoint['batch'])
+
+    for epoch in range(start_epoch, config.num_epochs):
         begin = time.time()
     
-        dataset_ = dataset.SparseBatchDataset(config)
+        dataset_ = dataset.SparseBatchDataset(config, epoch)
         loader = torch.utils.data.DataLoader(dataset_, batch_size=None)
         
         config.lambda_ = 1 + epoch / args.num_epochs * (args.lambda_ - 1)
 
         i = 0
+        if checkpoint:
+            dataset_.load_state(checkpoint['loader'])
+            i = checkpoint['batch']
+            checkpoint = None
+
         for batch in loader:
             white_features, black_features, stm, score, game_result = batch
             out = model_.forward(white_features, black_features, stm)
@@ -57,6 +102,21 @@ def main():
 
             i += 1
 
+            if args.checkpoint and i % args.checkpoint_interval == 0:
+                # the counts of this epoch so far, the stream of a resumed
+                # epoch only counts from the checkpoint on
+                counts = feature_counts + dataset_.feature_counts() if args.feature_counts else 0
+                torch.save({
+                    'epoch': epoch,
+                    'batch': i,
+                    'model': model_.state_dict(),
+                    'optimizer': optimizer.state_dict(),
+                    'scheduler': scheduler.state_dict(),
+                    'loader': dataset_.state(),
+                    'feature_counts': counts
+                }, args.checkpoint + '.tmp')
+                os.replace(args.checkpoint + '.tmp', args.checkpoint)
+
         scheduler.step()
 
         if (epoch+1) % 1 == 0:
@@ -68,6 +128,11 @@ def main():
         end = time.time()
         
         print('Elapsed time:', end-begin)
+        print('Loader stats:', dataset_.stats())
+
+        if args.feature_counts:
+            feature_counts = feature_counts + dataset_.feature_counts()
+            feature_counts.tofile(args.feature_counts)
 
 if __name__ == '__main__':
     main()
\ No newline at end of file
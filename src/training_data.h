@@ -0,0 +1,107 @@
+#pragma once
+
+#include<algorithm>
+#include<cstring> // std::memcpy
+#include<string_view>
+#include<vector>
+
+#include"chess/packed_position.h"
+
+using namespace chess;
+
+struct TrainingDataEntry {
+    PackedPosition pos;
+    int16_t score;
+    int8_t result; // -1, 0, 1
+};
+
+// A .td record is the FEN size (uint8), the FEN, the score (int16)
+// and the game result (int8), both relative to the side to move.
+namespace TrainingData {
+
+    constexpr size_t RECORD_TAIL_SIZE = sizeof(int16_t) + sizeof(int8_t);
+
+    // Reads the record at curr and advances curr past it,
+    // returns false if no complete record is left.
+    inline bool read(const char*& curr, const char* end, TrainingDataEntry& e) {
+        if (curr >= end) return false;
+
+        uint8_t fenSize = *(const uint8_t*)curr;
+        if ((size_t)(end - curr) < 1 + fenSize + RECORD_TAIL_SIZE) return false;
+        curr += 1;
+
+        e.pos = PackedPosition(std::string_view(curr, fenSize));
+        curr += fenSize;
+        std::memcpy(&e.score, curr, sizeof(int16_t));
+        curr += 2;
+        e.result = *(const int8_t*)curr;
+        curr += 1;
+        return true;
+    }
+
+    // Appends a record to buffer, the FEN must not be longer than 255 characters.
+    inline void write(std::vector<char>& buffer, std::string_view fen, int16_t score, int8_t result) {
+        size_t offset = buffer.size();
+        buffer.resize(offset + 1 + fen.size() + RECORD_TAIL_SIZE);
+        char* curr = buffer.data() + offset;
+
+        *curr++ = (char)(uint8_t)fen.size();
+        std::memcpy(curr, fen.data(), fen.size());
+        curr += fen.size();
+        std::memcpy(curr, &score, sizeof(int16_t));
+        curr += 2;
+        *curr = (char)result;
+    }
+
+    // Properties of a record that can be read without parsing its FEN.
+    struct RecordInfo {
+        int pieceCount;
+        int16_t score;
+        int8_t result;
+        int ply;
+    };
+
+    inline RecordInfo info(const TrainingDataEntry& e) {
+        return { Bitboard(e.pos.occupied).popcount(), e.score, e.result, e.pos.ply };
+    }
+
+    // Reads the properties of the record at curr without advancing,
+    // returns false if no complete record is left.
+    inline bool peek(const char* curr, const char* end, RecordInfo& info) {
+        if (curr >= end) return false;
+
+        uint8_t fenSize = *(const uint8_t*)curr;
+        if ((size_t)(end - curr) < 1 + fenSize + RECORD_TAIL_SIZE) return false;
+        std::string_view fen(curr + 1, fenSize);
+
+        size_t placementEnd = std::min(fen.find(' '), fen.size());
+        info.pieceCount = 0;
+        for (size_t i = 0; i < placementEnd; ++i)
+            info.pieceCount += (fen[i] | 0x20) >= 'a' && (fen[i] | 0x20) <= 'z';
+
+        // fullmove number, the last field
+        int fullmove = 0;
+        size_t i = fen.size();
+        int scale = 1;
+        while (i > placementEnd && fen[i - 1] >= '0' && fen[i - 1] <= '9') {
+            fullmove += (fen[--i] - '0') * scale;
+            scale *= 10;
+        }
+        bool black = placementEnd + 1 < fen.size() && fen[placementEnd + 1] == 'b';
+        info.ply = std::max(2 * (fullmove - 1), 0) + black;
+
+        std::memcpy(&info.score, curr + 1 + fenSize, sizeof(int16_t));
+        info.result = *(const int8_t*)(curr + 1 + fenSize + 2);
+        return true;
+    }
+
+    inline bool skip(const char*& curr, const char* end) {
+        if (curr >= end) return false;
+
+        uint8_t fenSize = *(const uint8_t*)curr;
+        if ((size_t)(end - curr) < 1 + fenSize + RECORD_TAIL_SIZE) return false;
+        curr += 1 + fenSize + RECORD_TAIL_SIZE;
+        return true;
+    }
+
+} // namespace TrainingData
@@ -0,0 +1,634 @@
+#pragma once
+
+#include<charconv>
+#include<cstddef> // offsetof
+#include<cstring> // std::memcpy
+#include<filesystem>
+#include<string>
+#include<string_view>
+#include<vector>
+
+#include"training_data.h"
+
+// Readers and writers of every training data format, each converting from
+// and to a TrainingDataEntry:
+//   td      the FEN records of training_data.h
+//   packed  fixed size records: the PackedPosition as it is in memory, the
+//           score (int16) and the result (int8), relative to the side to move
+//   text    one line per position, "<fen> | <score> | <result>" with the score
+//           in centipawns and the result (1.0, 0.5, 0.0) from white's point of
+//           view, as used by other trainers
+//   chained the positions of a game as the moves between them, a few bytes
+//           per position, see ChainWriter
+namespace TrainingData {
+
+    enum Format : uint8_t {
+        TD,
+        PACKED,
+        TEXT,
+        CHAINED,
+        N_FORMATS
+    };
+
+    constexpr const char* FORMAT_NAMES[N_FORMATS] = { "td", "packed", "text", "chained" };
+    constexpr const char* FORMAT_EXTENSIONS[N_FORMATS] = { ".td", ".tdp", ".txt", ".tdc" };
+
+    inline bool formatFromName(std::string_view name, Format& format) {
+        for (int f = 0; f < N_FORMATS; ++f)
+            if (name == FORMAT_NAMES[f]) {
+                format = Format(f);
+                return true;
+            }
+        return false;
+    }
+
+    // Format of file by its extension, td if it is unknown.
+    inline Format formatOf(const std::filesystem::path& file) {
+        std::string extension = file.extension().string();
+        for (int f = 0; f < N_FORMATS; ++f)
+            if (extension == FORMAT_EXTENSIONS[f]) return Format(f);
+        return TD;
+    }
+
+    constexpr size_t PACKED_RECORD_SIZE = sizeof(PackedPosition) + RECORD_TAIL_SIZE;
+
+    inline bool readPacked(const char*& curr, const char* end, TrainingDataEntry& e) {
+        if ((size_t)(end - curr) < PACKED_RECORD_SIZE) return false;
+        std::memcpy(&e.pos, curr, sizeof(PackedPosition));
+        std::memcpy(&e.score, curr + sizeof(PackedPosition), sizeof(int16_t));
+        e.result = *(const int8_t*)(curr + sizeof(PackedPosition) + 2);
+        curr += PACKED_RECORD_SIZE;
+        return true;
+    }
+
+    inline void writePacked(std::vector<char>& buffer, const TrainingDataEntry& e) {
+        size_t offset = buffer.size();
+        buffer.resize(offset + PACKED_RECORD_SIZE);
+        char* curr = buffer.data() + offset;
+        std::memcpy(curr, &e.pos, sizeof(PackedPosition));
+        std::memcpy(curr + sizeof(PackedPosition), &e.score, sizeof(int16_t));
+        curr[sizeof(PackedPosition) + 2] = (char)e.result;
+    }
+
+    // Reads the line at curr, returns false at the end or if it is malformed,
+    // leaving curr at the malformed line. Empty lines are skipped, the last
+    // line needs no line break.
+    inline bool readText(const char*& curr, const char* end, TrainingDataEntry& e) {
+        std::string_view line;
+        const char* next = curr;
+        do {
+            curr = next;
+            if (curr >= end) return false;
+            const char* eol = (const char*)std::memchr(curr, '\n', end - curr);
+            if (!eol) eol = end;
+            line = std::string_view(curr, eol - curr);
+            next = eol < end ? eol + 1 : end;
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        } while (line.empty());
+
+        size_t bar1 = line.find('|');
+        size_t bar2 = bar1 == std::string_view::npos ? bar1 : line.find('|', bar1 + 1);
+        if (bar2 == std::string_view::npos) return false;
+
+        auto trim = [](std::string_view s) {
+            while (!s.empty() && s.front() == ' ') s.remove_prefix(1);
+            while (!s.empty() && s.back() == ' ') s.remove_suffix(1);
+            return s;
+        };
+        std::string_view fen = trim(line.substr(0, bar1));
+        std::string_view score = trim(line.substr(bar1 + 1, bar2 - bar1 - 1));
+        std::string_view result = trim(line.substr(bar2 + 1));
+
+        int whiteScore;
+        if (std::from_chars(score.data(), score.data() + score.size(), whiteScore).ec != std::errc())
+            return false;
+        int whiteResult;
+        if (result == "1" || result == "1.0") whiteResult = 1;
+        else if (result == "0.5") whiteResult = 0;
+        else if (result == "0" || result == "0.0") whiteResult = -1;
+        else return false;
+
+        e.pos = PackedPosition(fen);
+        bool white = e.pos.sideToMove == WHITE;
+        e.score = (int16_t)std::clamp(white ? whiteScore : -whiteScore, -32767, 32767);
+        e.result = (int8_t)(white ? whiteResult : -whiteResult);
+        curr = next;
+        return true;
+    }
+
+    inline void writeText(std::vector<char>& buffer, const TrainingDataEntry& e) {
+        bool white = e.pos.sideToMove == WHITE;
+        int whiteResult = white ? e.result : -e.result;
+        std::string line = e.pos.fen() + " | " + std::to_string(white ? e.score : -e.score) + " | "
+            + (whiteResult > 0 ? "1.0" : whiteResult < 0 ? "0.0" : "0.5") + '\n';
+        buffer.insert(buffer.end(), line.begin(), line.end());
+    }
+
+    // A chained block is a header of CHAIN_HEADER_SIZE bytes, the payload size
+    // (uint32), the first position (PackedPosition), its score (int16) and the
+    // game result from white's point of view (int8), and flags (uint8), then
+    // the payload: for every following position the move that leads to it
+    // (uint16) and, unless it is hidden, the change of the score from white's
+    // point of view as a zigzag LEB128 number. Hidden positions have no score
+    // and are not read, they only link the scored positions of a game.
+    constexpr size_t CHAIN_HEADER_SIZE = sizeof(uint32_t) + sizeof(PackedPosition) + RECORD_TAIL_SIZE + 1;
+    constexpr uint8_t CHAIN_FIRST_HIDDEN = 1;
+
+    // A chained move is the from square, the to square and the promotion
+    // piece less KNIGHT, 6, 6 and 2 bits, and the flags below.
+    constexpr uint16_t CHAIN_RULE50_RESET = 1 << 14;
+    constexpr uint16_t CHAIN_HIDDEN = 1 << 15;
+
+    inline void writeVarint(std::vector<char>& buffer, int64_t value) {
+        uint64_t z = (uint64_t)value << 1 ^ (uint64_t)(value >> 63);
+        for (; z >= 0x80; z >>= 7)
+            buffer.push_back(char(z | 0x80));
+        buffer.push_back(char(z));
+    }
+
+    inline bool readVarint(const char*& curr, const char* end, int64_t& value) {
+        uint64_t z = 0;
+        for (int shift = 0; curr < end && shift < 64; shift += 7) {
+            uint8_t b = *curr++;
+            z |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                value = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Plays the chained move on pos. Castling is a king move by two files, en
+    // passant a pawn move to the en passant square; the en passant square is
+    // set after every double push, the rule 50 counter is reset by the flag.
+    // Returns false if there is no piece of the side to move on the from square.
+    inline bool applyChainMove(Position& pos, uint16_t move) {
+        Square from = move & 63;
+        Square to = move >> 6 & 63;
+        Piece pc = pos.board[from];
+        Color us = pos.sideToMove;
+        if (!pc || color::make(pc) != us || from == to) return false;
+        PieceType pt = pieceType::make(pc);
+
+        auto remove = [&](Square s) {
+            pos.board[s] = NO_PIECE;
+            pos.occupied.clear(s);
+        };
+        auto place = [&](Square s, Piece p) {
+            pos.board[s] = p;
+            pos.occupied.set(s);
+        };
+
+        remove(from);
+        if (pt == PAWN && pos.epSquare && to == pos.epSquare && !pos.board[to])
+            remove(to ^ 8);
+        if (pt == KING) {
+            pos.ksq[us] = to;
+            pos.castlingRights.data &= us == WHITE ? ~CastlingRights::WHITE_CASTLING : ~CastlingRights::BLACK_CASTLING;
+            if (std::abs(file::make(to) - file::make(from)) == 2) {
+                Square rookFrom = to > from ? from + 3 : from - 4;
+                Piece rook = pos.board[rookFrom];
+                remove(rookFrom);
+                place((from + to) / 2, rook);
+            }
+        }
+        if (pos.board[to]) remove(to);
+        Rank r = rank::make(to);
+        place(to, pt == PAWN && (r == RANK_1 || r == RANK_8) ? piece::make(us, KNIGHT + (move >> 12 & 3)) : pc);
+
+        for (Square s : { from, to }) {
+            switch (s) {
+            case A1: pos.castlingRights.data &= ~CastlingRights::WHITE_QUEEN_SIDE; break;
+            case H1: pos.castlingRights.data &= ~CastlingRights::WHITE_KING_SIDE; break;
+            case A8: pos.castlingRights.data &= ~CastlingRights::BLACK_QUEEN_SIDE; break;
+            case H8: pos.castlingRights.data &= ~CastlingRights::BLACK_KING_SIDE; break;
+            }
+        }
+
+        pos.epSquare = pt == PAWN && std::abs(to - from) == 16 ? (from + to) / 2 : 0;
+        pos.rule50Cnt = move & CHAIN_RULE50_RESET ? 0 : pos.rule50Cnt + 1;
+        pos.sideToMove = !us;
+        ++pos.ply;
+        return true;
+    }
+
+    // Finds the chained move from before to after, false if there is none
+    // that gives exactly after, e.g. because they are not consecutive.
+    inline bool findChainMove(const Position& before, const PackedPosition& after, uint16_t& move) {
+        Color us = before.sideToMove;
+        if (after.sideToMove == us) return false;
+        Position next = after.unpack();
+
+        // the king is preferred, castling moves the rook as well
+        int from = -1, to = -1;
+        for (Square s = A1; s < N_SQUARES; ++s) {
+            Piece b = before.board[s], a = next.board[s];
+            if (b == a) continue;
+            if (b && color::make(b) == us && !a && (from < 0 || pieceType::make(b) == KING)) from = s;
+            if (a && color::make(a) == us && (to < 0 || pieceType::make(a) == KING)) to = s;
+        }
+        if (from < 0 || to < 0) return false;
+
+        PieceType moved = pieceType::make(before.board[from]);
+        PieceType placed = pieceType::make(next.board[to]);
+        int promotion = moved == PAWN && placed >= KNIGHT && placed <= QUEEN ? placed - KNIGHT : 0;
+        move = (uint16_t)(from | to << 6 | promotion << 12);
+        if (!after.rule50Cnt) move |= CHAIN_RULE50_RESET;
+
+        Position p = before;
+        if (!applyChainMove(p, move)) return false;
+        PackedPosition packed(p);
+        return std::memcmp(&packed, &after, sizeof(PackedPosition)) == 0;
+    }
+
+    // Writes entries as chained blocks. An entry continues the block if a
+    // move leads to it from the previous one and the game result is the same,
+    // otherwise it starts a new block, so any sequence of entries is written
+    // exactly; games from start to end take 2-4 bytes per position. The block
+    // is only complete after finish(), buffer must not be flushed before.
+    struct ChainWriter {
+        static constexpr size_t MAX_PAYLOAD = 1 << 20;
+
+        Position pos;
+        size_t blockOffset = SIZE_MAX; // in buffer, SIZE_MAX if no block is open
+        int8_t whiteResult;
+        int whiteScore;
+        std::vector<TrainingDataEntry> hiddenEntries; // not yet followed by an entry
+
+        // Hidden entries are only written to link the following ones.
+        void add(std::vector<char>& buffer, const TrainingDataEntry& e, bool hidden = false) {
+            if (hidden) {
+                hiddenEntries.push_back(e);
+                return;
+            }
+            for (const TrainingDataEntry& h : hiddenEntries)
+                append(buffer, h, true);
+            hiddenEntries.clear();
+            append(buffer, e, false);
+        }
+
+        // Completes the open block.
+        void finish(std::vector<char>& buffer) {
+            hiddenEntries.clear();
+            closeBlock(buffer);
+        }
+
+    private:
+        void closeBlock(std::vector<char>& buffer) {
+            if (blockOffset == SIZE_MAX) return;
+            uint32_t size = (uint32_t)(buffer.size() - blockOffset - CHAIN_HEADER_SIZE);
+            std::memcpy(buffer.data() + blockOffset, &size, sizeof(uint32_t));
+            blockOffset = SIZE_MAX;
+        }
+
+        void append(std::vector<char>& buffer, const TrainingDataEntry& e, bool hidden) {
+            bool white = e.pos.sideToMove == WHITE;
+            int8_t result = white ? e.result : -e.result;
+            int score = white ? e.score : -e.score;
+            uint16_t move;
+            if (blockOffset != SIZE_MAX && result == whiteResult
+                && buffer.size() - blockOffset < CHAIN_HEADER_SIZE + MAX_PAYLOAD
+                && findChainMove(pos, e.pos, move)) {
+                if (hidden) move |= CHAIN_HIDDEN;
+                buffer.push_back(char(move));
+                buffer.push_back(char(move >> 8));
+                if (!hidden) {
+                    writeVarint(buffer, score - whiteScore);
+                    whiteScore = score;
+                }
+                applyChainMove(pos, move);
+                return;
+            }
+
+            closeBlock(buffer);
+            blockOffset = buffer.size();
+            buffer.resize(blockOffset + CHAIN_HEADER_SIZE);
+            char* header = buffer.data() + blockOffset;
+            int16_t firstScore = hidden ? 0 : e.score;
+            std::memcpy(header + sizeof(uint32_t), &e.pos, sizeof(PackedPosition));
+            std::memcpy(header + sizeof(uint32_t) + sizeof(PackedPosition), &firstScore, sizeof(int16_t));
+            header[sizeof(uint32_t) + sizeof(PackedPosition) + 2] = (char)result;
+            header[sizeof(uint32_t) + sizeof(PackedPosition) + 3] = hidden ? CHAIN_FIRST_HIDDEN : 0;
+            pos = e.pos.unpack();
+            whiteResult = result;
+            whiteScore = hidden ? 0 : score;
+        }
+    };
+
+    // Reads the entries of one chained block by replaying its moves.
+    struct ChainReader {
+        Position pos;
+        const char* block = nullptr;    // start of the block
+        const char* next = nullptr;     // next move
+        const char* payloadEnd = nullptr;
+        size_t count = 0;               // entries read from the block
+        int8_t whiteResult;
+        int whiteScore;
+        bool firstPending = false;
+        bool firstHidden;
+        bool malformed = false;
+
+        // Starts the block at curr and advances curr past it, returns false
+        // if no complete block is left.
+        bool start(const char*& curr, const char* end) {
+            if ((size_t)(end - curr) < CHAIN_HEADER_SIZE) return false;
+            uint32_t size;
+            std::memcpy(&size, curr, sizeof(uint32_t));
+            if ((size_t)(end - curr) - CHAIN_HEADER_SIZE < size) return false;
+
+            PackedPosition first;
+            int16_t score;
+            std::memcpy(&first, curr + sizeof(uint32_t), sizeof(PackedPosition));
+            std::memcpy(&score, curr + sizeof(uint32_t) + sizeof(PackedPosition), sizeof(int16_t));
+            whiteResult = (int8_t)curr[sizeof(uint32_t) + sizeof(PackedPosition) + 2];
+            firstHidden = curr[sizeof(uint32_t) + sizeof(PackedPosition) + 3] & CHAIN_FIRST_HIDDEN;
+            pos = first.unpack();
+            whiteScore = pos.sideToMove == WHITE ? score : -score;
+
+            block = curr;
+            next = curr + CHAIN_HEADER_SIZE;
+            payloadEnd = next + size;
+            curr = payloadEnd;
+            count = 0;
+            firstPending = true;
+            malformed = false;
+            return true;
+        }
+
+        bool done() const {
+            return !firstPending && next >= payloadEnd;
+        }
+
+        // Reads the next entry of the block, returns false at its end or if it
+        // is malformed.
+        bool read(TrainingDataEntry& e) {
+            bool found = false;
+            if (firstPending) {
+                firstPending = false;
+                found = !firstHidden;
+            }
+            while (!found && next < payloadEnd) {
+                uint16_t move;
+                int64_t delta = 0;
+                bool valid = payloadEnd - next >= 2;
+                if (valid) {
+                    std::memcpy(&move, next, sizeof(uint16_t));
+                    next += 2;
+                    valid = applyChainMove(pos, move) && (move & CHAIN_HIDDEN || readVarint(next, payloadEnd, delta));
+                }
+                if (!valid) {
+                    malformed = true;
+                    next = payloadEnd;
+                    return false;
+                }
+                if (move & CHAIN_HIDDEN) continue;
+                whiteScore += (int)delta;
+                found = true;
+            }
+            if (!found) return false;
+
+            bool white = pos.sideToMove == WHITE;
+            e.pos = PackedPosition(pos);
+            e.score = (int16_t)(white ? whiteScore : -whiteScore);
+            e.result = white ? whiteResult : -whiteResult;
+            ++count;
+            return true;
+        }
+    };
+
+    // Reads a record of any format but chained, see Reader.
+    inline bool read(Format format, const char*& curr, const char* end, TrainingDataEntry& e) {
+        switch (format) {
+        case PACKED: return readPacked(curr, end, e);
+        case TEXT:   return readText(curr, end, e);
+        default:     return read(curr, end, e);
+        }
+    }
+
+    // Writes a record of any format but chained, see Writer.
+    inline void write(Format format, std::vector<char>& buffer, const TrainingDataEntry& e) {
+        switch (format) {
+        case PACKED: writePacked(buffer, e); break;
+        case TEXT:   writeText(buffer, e); break;
+        default:     write(buffer, e.pos.fen(), e.score, e.result); break;
+        }
+    }
+
+    // First record boundary at or after target, or the end of the complete
+    // records if there is none.
+    inline const char* skipTo(Format format, const char* curr, const char* end, const char* target) {
+        switch (format) {
+        case PACKED: {
+            size_t n = std::min<size_t>((target - curr + PACKED_RECORD_SIZE - 1) / PACKED_RECORD_SIZE,
+                (end - curr) / PACKED_RECORD_SIZE);
+            return curr + n * PACKED_RECORD_SIZE;
+        }
+        case TEXT: {
+            if (target <= curr) return curr;
+            const char* eol = (const char*)std::memchr(target - 1, '\n', end - target + 1);
+            return eol ? eol + 1 : end;
+        }
+        case CHAINED:
+            // blocks are the records, a block is never split
+            while (curr < target && (size_t)(end - curr) >= CHAIN_HEADER_SIZE) {
+                uint32_t size;
+                std::memcpy(&size, curr, sizeof(uint32_t));
+                if ((size_t)(end - curr) - CHAIN_HEADER_SIZE < size) break;
+                curr += CHAIN_HEADER_SIZE + size;
+            }
+            return curr;
+        default:
+            while (curr < target && skip(curr, end));
+            return curr;
+        }
+    }
+
+    // Whether the piece placement of fen has eight ranks of eight squares and
+    // is followed by the side to move, enough to tell a FEN from other bytes.
+    inline bool plausibleFen(std::string_view fen) {
+        int ranks = 1, squares = 0;
+        size_t i = 0;
+        for (; i < fen.size() && fen[i] != ' '; ++i) {
+            char c = fen[i];
+            if (c == '/') {
+                if (squares != 8) return false;
+                ++ranks;
+                squares = 0;
+            }
+            else if (c >= '1' && c <= '8') squares += c - '0';
+            else if (std::string_view("pnbrqkPNBRQK").find(c) != std::string_view::npos) ++squares;
+            else return false;
+            if (squares > 8) return false;
+        }
+        return ranks == 8 && squares == 8 && i + 2 < fen.size() && (fen[i + 1] == 'w' || fen[i + 1] == 'b') && fen[i + 2] == ' ';
+    }
+
+    // Size of the td record or chained block at curr if it looks well formed,
+    // 0 if it does not and SIZE_MAX if it does not fit before end.
+    inline size_t plausibleRecordSize(Format format, const char* curr, const char* end) {
+        size_t left = end - curr;
+        if (format == CHAINED) {
+            if (left < CHAIN_HEADER_SIZE) return SIZE_MAX;
+            uint32_t size;
+            uint64_t occupied;
+            const char* pos = curr + sizeof(uint32_t);
+            std::memcpy(&size, curr, sizeof(uint32_t));
+            std::memcpy(&occupied, pos + offsetof(PackedPosition, occupied), sizeof(uint64_t));
+            uint8_t white = pos[offsetof(PackedPosition, ksq) + WHITE], black = pos[offsetof(PackedPosition, ksq) + BLACK];
+            uint8_t sideToMove = pos[offsetof(PackedPosition, sideToMove)];
+            uint8_t castling = pos[offsetof(PackedPosition, castlingRights)];
+            int8_t result = pos[sizeof(PackedPosition) + 2];
+            uint8_t flags = pos[sizeof(PackedPosition) + 3];
+            // a block ends with the first entry past MAX_PAYLOAD, of at most 12 bytes
+            if (size > ChainWriter::MAX_PAYLOAD + 12 || __builtin_popcountll(occupied) > 32
+                || white >= 64 || black >= 64 || !(occupied >> white & 1) || !(occupied >> black & 1)
+                || sideToMove > 1 || castling > 15 || result < -1 || result > 1 || flags & ~CHAIN_FIRST_HIDDEN)
+                return 0;
+            return left - CHAIN_HEADER_SIZE < size ? SIZE_MAX : CHAIN_HEADER_SIZE + size;
+        }
+
+        uint8_t fenSize = *(const uint8_t*)curr;
+        if (left < 1 + fenSize + RECORD_TAIL_SIZE) return SIZE_MAX;
+        int8_t result = curr[1 + fenSize + 2];
+        if (result < -1 || result > 1 || !plausibleFen(std::string_view(curr + 1, fenSize))) return 0;
+        return 1 + fenSize + RECORD_TAIL_SIZE;
+    }
+
+    // well formed records that make syncTo take a position as a boundary
+    constexpr int SYNC_RECORDS = 4;
+
+    // First record boundary at or after target in [data, end), where data is
+    // at dataOffset in the records, e.g. in a file, and end is their end
+    // unless endOfData is false. Returns end if there is none and nullptr if
+    // the data up to end does not tell. Unlike skipTo it only reads the bytes
+    // from target on, and the one before it for text, so data need not be a
+    // record boundary: td records and chained blocks have no sync marker, so
+    // the first position is taken from which SYNC_RECORDS records, or all up
+    // to the end of the records, look well formed. A last incomplete record
+    // counts as the end.
+    inline const char* syncTo(Format format, const char* data, const char* end, const char* target,
+        uint64_t dataOffset = 0, bool endOfData = true)
+    {
+        uint64_t offset = dataOffset + (target - data);
+        if (format == PACKED) {
+            size_t toBoundary = (PACKED_RECORD_SIZE - offset % PACKED_RECORD_SIZE) % PACKED_RECORD_SIZE;
+            if ((size_t)(end - target) >= toBoundary) return target + toBoundary;
+            return endOfData ? end : nullptr;
+        }
+        if (format == TEXT) {
+            if (!offset) return target;
+            const char* eol = (const char*)std::memchr(target - 1, '\n', end - target + 1);
+            if (eol) return eol + 1;
+            return endOfData ? end : nullptr;
+        }
+
+        for (const char* p = target; p < end; ++p) {
+            const char* curr = p;
+            int n = 0; // complete records
+            while (n < SYNC_RECORDS && curr < end) {
+                size_t size = plausibleRecordSize(format, curr, end);
+                if (!size) break;
+                if (size == SIZE_MAX) {
+                    curr = end;
+                    break;
+                }
+                curr += size;
+                ++n;
+            }
+            if (n == SYNC_RECORDS) return p;
+            if (curr == end) {
+                if (!endOfData) return nullptr;
+                if (n) return p;
+            }
+        }
+        return endOfData ? end : nullptr;
+    }
+
+    // Reads the entries of [curr, end) in any format, of the records that
+    // start before stop, end by default; the last of them may end after stop.
+    struct Reader {
+        Format format;
+        const char* curr;
+        const char* end;
+        const char* stop;
+        ChainReader chain;
+
+        Reader() = default;
+        Reader(Format format, const char* curr, const char* end, const char* stop = nullptr)
+            : format(format), curr(curr), end(end), stop(stop ? stop : end) {}
+
+        // Returns false at the end or at a malformed record.
+        bool read(TrainingDataEntry& e) {
+            if (format != CHAINED) return curr < stop && TrainingData::read(format, curr, end, e);
+            while (!chain.read(e))
+                if (chain.malformed || curr >= stop || !chain.start(curr, end)) return false;
+            return true;
+        }
+
+        // Where the current record started and how many entries of it were
+        // read, so that a reader can be restored with skip().
+        const char* recordStart() const {
+            return format == CHAINED && chain.block && !chain.done() ? chain.block : curr;
+        }
+
+        size_t readFromRecord() const {
+            return format == CHAINED && chain.block && !chain.done() ? chain.count : 0;
+        }
+
+        // Starts at record and skips the first count entries of it.
+        void skip(const char* record, size_t count) {
+            curr = record;
+            chain = {};
+            TrainingDataEntry e;
+            for (size_t i = 0; i < count && read(e); ++i);
+        }
+
+        // Whether all of the data was read and is well formed.
+        bool complete() const {
+            return curr == end && (format != CHAINED || !chain.block || chain.done() && !chain.malformed);
+        }
+    };
+
+    struct Writer {
+        Format format;
+        ChainWriter chain;
+
+        Writer(Format format) : format(format) {}
+
+        // Hidden entries are only written in the chained format, to link the
+        // positions of a game.
+        void write(std::vector<char>& buffer, const TrainingDataEntry& e, bool hidden = false) {
+            if (format == CHAINED) chain.add(buffer, e, hidden);
+            else if (!hidden) TrainingData::write(format, buffer, e);
+        }
+
+        // Completes the output, before buffer is flushed.
+        void finish(std::vector<char>& buffer) {
+            chain.finish(buffer);
+        }
+    };
+
+    // Splits [data, data + size) at record boundaries into windows of about
+    // windowSize bytes and these into chunks of about chunkSize bytes. Calls
+    // f(bounds) with the chunk bounds of every window in order, so that a tool
+    // can process the chunks of a window in parallel while the data is read
+    // in order. Returns false if the data ends with an incomplete record.
+    template<class F>
+    bool forEachWindow(Format format, const char* data, size_t size, size_t windowSize, size_t chunkSize, F&& f) {
+        const char* curr = data;
+        const char* end = data + size;
+        while (curr < end) {
+            const char* windowEnd = curr + std::min<size_t>(windowSize, end - curr);
+            std::vector<const char*> bounds = { curr };
+            while (curr < windowEnd) {
+                curr = skipTo(format, curr, end, curr + std::min<size_t>(chunkSize, windowEnd - curr));
+                if (curr == bounds.back()) return false;
+                bounds.push_back(curr);
+            }
+            f(bounds);
+        }
+        return true;
+    }
+
+} // namespace TrainingData
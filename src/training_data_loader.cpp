@@ -1,13 +1,5 @@
-#include<algorithm> // std::sort
-#include<cassert>
-#include<filesystem>
-#include<fstream>
-#include<numeric>
-#include<iostream>
-#include<vector>
-#include<random>
-
-#include"chess/position.h"
+#include"training_data_loader.h"
+#include"nnue/nnue_file.h"
 
 #if defined (__x86_64__)
 #define EXPORT
@@ -22,284 +14,174 @@
 #endif
 #endif
 
-using namespace chess;
-
-using IndexType = uint64_t;
-
-struct TrainingDataEntry {
-    Position pos;
-    int16_t score;
-    int8_t result; // -1, 0, 1
-};
+// reason of the last failed nnue_read on this thread
+static thread_local std::string nnueError;
 
-namespace FeatureTransformer {
+extern "C" {
 
-    template<class T>
-    constexpr T ceilToMultiple(T n, T r) {
-        return (n + r - 1) / r * r;
+    EXPORT void CDECL init() {
+        FeatureTransformer::init();
+        Position::init();
     }
 
-    constexpr int MAX_ACTIVE_FEATURES = 37;
-
-    constexpr int CASTLING_SIZE = 4;
-    constexpr int EN_PASSANT_SIZE = 8;
-    constexpr int MISC_SIZE = CASTLING_SIZE + EN_PASSANT_SIZE;
-    constexpr int PIECE_INPUT_SIZE = 41916;
-    constexpr int MISC_INPUT_SIZE = N_SQUARES * MISC_SIZE;  
+    // The stream reads shard workerId + rank * numWorkers of the file, see Shard.
+    EXPORT SparseBatchStream* CDECL create_sparse_batch_stream(const char* file, size_t batchSize, float skipEntryProb, uint8_t augmentation, uint8_t featureSet,
+        size_t rank, size_t worldSize, size_t workerId, size_t numWorkers, uint64_t seed)
+    {
+        Shard shard = { rank, std::max<size_t>(worldSize, 1), workerId, std::max<size_t>(numWorkers, 1) };
+        return new SparseBatchStream(file, batchSize, skipEntryProb, augmentation, featureSet, shard, seed);
+    }
 
-    constexpr int NUM_FEATURES = PIECE_INPUT_SIZE + MISC_INPUT_SIZE;
-    constexpr int PADDED_NUM_FEATURES = ceilToMultiple(NUM_FEATURES, 16);
-    constexpr int INPUT_HSIZE = PADDED_NUM_FEATURES;
-    constexpr int INPUT_SIZE = 2*INPUT_HSIZE;
-    constexpr int ACCUMULATOR_SIZE = 256;
-    constexpr int ACCUMULATOR_DSIZE = 2*ACCUMULATOR_SIZE;
-    constexpr int HIDDEN_1_SIZE = 32;
-    constexpr int HIDDEN_2_SIZE = 32;
+    // Describes a feature set, returns false for an unknown id.
+    EXPORT bool CDECL get_feature_set_info(uint8_t featureSet, FeatureSetInfo* info) {
+        if (featureSet >= FeatureTransformer::N_FEATURE_SETS) return false;
+        *info = FeatureTransformer::withFeatureSet(featureSet, [](auto set) {
+            using FeatureSet = decltype(set);
+            return FeatureSetInfo{ FeatureSet::NAME, FeatureSet::INPUT_SIZE, FeatureSet::MAX_ACTIVE };
+        });
+        return true;
+    }
 
-    uint16_t pieceIndices[N_COLORS][N_SQUARES][N_PIECES][N_SQUARES];
+    // Writes the virtual feature of every king-pieces feature of perspective c
+    // in the factorized set, -1 if there is none. Used to fold factorized weights.
+    EXPORT void CDECL get_feature_factors(uint8_t c, int64_t* map) {
+        FeatureTransformer::Factorized::factors(c, map);
+    }
 
-    void init() {
-        // initialize the index lookup table
-        size_t idx;
-        for (Color c : { WHITE, BLACK }) {
-            idx = 0;
-            for (Square ksq = A1; ksq < N_SQUARES; ++ksq) {
-                for (Color c_ : { WHITE, BLACK }) {
-                    for (PieceType pt = PAWN; pt < N_PIECE_TYPES; ++pt) {
-                        for (Square psq = A1; psq < N_SQUARES; ++psq) {
+    EXPORT void CDECL destroy_sparse_batch_stream(SparseBatchStream* stream) {
+        delete stream;
+    }
 
-                            Piece pc = piece::make(c_, pt);
+    EXPORT SparseBatch* CDECL next_sparse_batch(SparseBatchStream* stream) {
+        return stream->next();
+    }
 
-                            if (pc == piece::make(c, KING) ||
-                                psq == ksq ||
-                                pc == piece::make(!c, KING) && square::distance(psq, ksq) == 1 ||
-                                pt == PAWN && (RANK_1_BB | RANK_8_BB).isSet(psq))
-                                continue;
+    EXPORT void CDECL destroy_sparse_batch(SparseBatch* batch) {
+        delete batch;
+    }
 
-                            pieceIndices[c][ksq][pc][psq] = idx++;
-                        }
-                    }
-                }
-            }
-            assert(idx == PIECE_INPUT_SIZE);
-        }
+    // Builds the next batch and stores its arrays as DLPack tensors in the
+    // order of SparseBatchTensors, returns false at the end of the file. The
+    // caller owns the tensors and releases each through its deleter.
+    EXPORT bool CDECL next_sparse_batch_tensors(SparseBatchStream* stream, DLManagedTensor** tensors) {
+        SparseBatch* batch = stream->next();
+        if (!batch) return false;
+        auto* exported = new SparseBatchTensors(batch);
+        for (int i = 0; i < SparseBatchTensors::N_TENSORS; ++i)
+            tensors[i] = &exported->tensors[i];
+        return true;
     }
 
-    void fillFeatures(
-        IndexType i,
-        const TrainingDataEntry& e, 
-        Color c, 
-        IndexType* featureIndices, 
-        float* featureValues, 
-        IndexType& numActiveFeatures) 
+    // Calls onAllocate for every allocation of batch memory, which is then
+    // reused, and onFree before it is freed, e.g. to pin it with
+    // cudaHostRegister. Must be called before the first batch.
+    EXPORT void CDECL set_batch_memory_callbacks(SparseBatchStream* stream, BatchMemoryPool::Callback onAllocate,
+        BatchMemoryPool::Callback onFree)
     {
-        const Position& pos = e.pos;
-
-        Square ksq = pos.kingSquare(c);
-        Bitboard occupied = pos.occupied & ~Bitboard::fromSquare(ksq);
-
-        IndexType active[MAX_ACTIVE_FEATURES];
-        IndexType size = 0;
-
-        while (occupied) {
-            Square s = occupied.popLSB();
-            active[size++] = pieceIndices[c][ksq][pos.piece(s)][s];
-        }
-
-        if (pos.canCastle()) {
-
-            IndexType offset = PIECE_INPUT_SIZE + ksq * MISC_SIZE;
-            if (pos.canCastle(CastlingRights::WHITE_QUEEN_SIDE)) active[size++] = offset;
-            if (pos.canCastle(CastlingRights::WHITE_KING_SIDE))  active[size++] = offset+1;
-            if (pos.canCastle(CastlingRights::BLACK_QUEEN_SIDE)) active[size++] = offset+2;
-            if (pos.canCastle(CastlingRights::BLACK_KING_SIDE))  active[size++] = offset+3;
-        }
-
-        if (pos.epSquare)
-            active[size++] = PIECE_INPUT_SIZE + ksq * MISC_SIZE + CASTLING_SIZE + file::make(pos.epSquare);
-
-        // sort the active feature indices
-        std::sort(active, active+size);
-
-        for (IndexType j = 0; j < size; ++j) {
-            IndexType idx = 2 * numActiveFeatures;
-            featureIndices[idx] = i;
-            featureIndices[idx+1] = active[j];
-            featureValues[numActiveFeatures++] = 1;
-        }
+        stream->batchMemory->onAllocate = onAllocate;
+        stream->batchMemory->onFree = onFree;
     }
 
-} // namespace FeatureTransformer
-
-struct SparseBatch {
-    IndexType size;
-    IndexType numActiveWhiteFeatures;
-    IndexType numActiveBlackFeatures;
-    float* stm;
-    float* score;
-    float* gameResult;
-    IndexType* whiteFeatureIndices;
-    IndexType* blackFeatureIndices;
-    float* whiteFeatureValues;
-    float* blackFeatureValues;
-
-    SparseBatch() = default;
-
-    SparseBatch(const std::vector<TrainingDataEntry>& entries) {
-        using namespace FeatureTransformer;
-        assert(size * MAX_ACTIVE_FEATURES * 2 <= std::numeric_limits<IndexType>::max());
-
-        size = entries.size();
-        numActiveWhiteFeatures = 0;
-        numActiveBlackFeatures = 0;
-        stm = new float[size];
-        score = new float[size];
-        gameResult = new float[size];
-        whiteFeatureIndices = new IndexType[size * MAX_ACTIVE_FEATURES * 2];
-        blackFeatureIndices = new IndexType[size * MAX_ACTIVE_FEATURES * 2];
-        whiteFeatureValues = new float[size * MAX_ACTIVE_FEATURES];
-        blackFeatureValues = new float[size * MAX_ACTIVE_FEATURES];
-
-        for (IndexType i = 0; i < size; ++i)
-            fillEntry(i, entries[i]);
+    EXPORT void CDECL get_stream_stats(SparseBatchStream* stream, StreamStats* stats) {
+        *stats = stream->stats;
     }
 
-    ~SparseBatch() {
-        delete[] stm;
-        delete[] score;
-        delete[] gameResult;
-        delete[] whiteFeatureIndices;
-        delete[] blackFeatureIndices;
-        delete[] whiteFeatureValues;
-        delete[] blackFeatureValues;
+    // Sets the probabilities to keep a record, see SamplingWeights for the
+    // table sizes. A null table keeps every record as far as it is concerned.
+    EXPORT void CDECL set_sampling_weights(SparseBatchStream* stream, const float* pieceCount, const float* scoreBand,
+        const float* result, const float* plyBand)
+    {
+        stream->weights.set(pieceCount, scoreBand, result, plyBand);
     }
 
-    void fillEntry(IndexType i, const TrainingDataEntry& e) {
-        stm[i] = (float)e.pos.sideToMove;
-        score[i] = (float)e.score;
-        gameResult[i] = ((float)e.result+1)/2;
-        FeatureTransformer::fillFeatures(i, e, WHITE, whiteFeatureIndices, whiteFeatureValues, numActiveWhiteFeatures);
-        FeatureTransformer::fillFeatures(i, e, BLACK, blackFeatureIndices, blackFeatureValues, numActiveBlackFeatures);
+    // Reads the shard in shuffled blocks of about blockSize bytes and takes
+    // records at random from a buffer of bufferSize records, 0 disables either.
+    // Must be called before the first batch and before set_stream_state.
+    EXPORT void CDECL set_shuffle(SparseBatchStream* stream, size_t bufferSize, size_t blockSize) {
+        stream->setShuffle(bufferSize, blockSize);
     }
-};
-
-namespace rng {
-    uint64_t seed = 0;
-    std::mt19937_64 gen(seed);
-}
-
-struct SparseBatchStream {
-    size_t batchSize;
-    std::vector<TrainingDataEntry>entries;
-    std::filesystem::path file;
-    size_t fileSize;
-    char* buffer;
-    char* curr;
-    bool stop;
-    float skipEntryProb;
-    std::bernoulli_distribution dist;
-
-    SparseBatchStream(const char* file, size_t batchSize, float skipEntryProb) {
-        this->batchSize = batchSize;
-        this->file = file;
-
-        // Open the file.
-        std::ifstream is(this->file, std::ios::binary);
-        assert(is.is_open());
-
-        // Determine the file size.
-        is.seekg(0, std::ios::end);
-        fileSize = is.tellg();
-        is.seekg(0, std::ios::beg);
 
-        buffer = new char[fileSize];
-        is.read(buffer, fileSize);
-        
-        curr = buffer;
-        stop = false;
-
-        this->skipEntryProb = skipEntryProb;
-        dist = std::bernoulli_distribution(skipEntryProb);
+    // Reads the blocks of the shard ahead into queueDepth buffers, with direct
+    // I/O if direct is set and the file system supports it. Must be called after
+    // set_shuffle and before the first batch and set_stream_state.
+    EXPORT bool CDECL set_async_read(SparseBatchStream* stream, size_t queueDepth, bool direct) {
+        return stream->setAsyncRead(queueDepth, direct);
     }
 
-    ~SparseBatchStream() {
-        delete[] buffer;
+    // Copies the state of the stream to state if it has room for it,
+    // returns the size of the state.
+    EXPORT size_t CDECL get_stream_state(SparseBatchStream* stream, char* state, size_t size) {
+        std::string s = stream->state();
+        if (state && size >= s.size()) std::memcpy(state, s.data(), s.size());
+        return s.size();
     }
 
-    SparseBatch* next() {
-        entries.resize(batchSize);
-        for (size_t i = 0; i < batchSize; ++i) {
-            if (stop) return nullptr;
-
-            bool skipEntry = dist(rng::gen);
-            if (skipEntry) readEntry<true>(entries[i]);
-            else           readEntry<false>(entries[i]);
-        }
-        return new SparseBatch(entries);
+    // Continues the stream where get_stream_state was called, returns false
+    // if the state belongs to another file or shard.
+    EXPORT bool CDECL set_stream_state(SparseBatchStream* stream, const char* state, size_t size) {
+        return stream->setState(std::string(state, size));
     }
 
-    template<bool skipEntry>
-    void readEntry(TrainingDataEntry& e) {
-        if (skipEntry) {
-            if (curr - buffer >= fileSize) {
-                stop = true;
-                return;
-            }
-
-            uint8_t fenSize = *(uint8_t*)curr;
-            curr += 1;
-            const std::string_view fen(curr, fenSize);
-            curr += fenSize + 3;
-
-            readEntry<false>(e);
-        }
-
-        else {
-            if (curr - buffer >= fileSize) {
-                stop = true;
-                return;
-            }
-
-            uint8_t fenSize = *(uint8_t*)curr;
-            curr += 1;
-            const std::string_view fen(curr, fenSize);
-            curr += fenSize;
-
-            if (curr + 3 - buffer >= fileSize) {
-                stop = true;
-                return;
-            }
+    // Starts counting how often every input feature is active.
+    EXPORT void CDECL enable_feature_counts(SparseBatchStream* stream) {
+        stream->countFeatures();
+    }
 
-            e.pos = Position(fen);
-            e.score = *(int16_t*)curr;
-            curr += 2;
-            e.result = *(int8_t*)curr;
-            curr += 1;
-        }
+    // Copies one counter per input feature of the stream's feature set,
+    // returns false if counting is not enabled.
+    EXPORT bool CDECL get_feature_counts(SparseBatchStream* stream, uint64_t* counts) {
+        if (stream->featureCounts.empty()) return false;
+        std::copy(stream->featureCounts.begin(), stream->featureCounts.end(), counts);
+        return true;
     }
-};
 
-extern "C" {
+    // Number of float parameters of a network using the feature set, 0 if
+    // a quantized network cannot use it.
+    EXPORT size_t CDECL nnue_num_parameters(uint8_t featureSet) {
+        if (!FeatureTransformer::isQuantizable(featureSet)) return 0;
+        return nnue::Architecture(featureSet).numParameters();
+    }
 
-    EXPORT void CDECL init() {
-        FeatureTransformer::init();
-        Position::init();
+    // Feature set of a .nnue file, -1 if it cannot be read.
+    EXPORT int CDECL nnue_feature_set(const char* file) {
+        nnue::NetworkFile network;
+        if (!network.open(file)) {
+            nnueError = network.error;
+            return -1;
+        }
+        return network.arch.featureSet;
     }
 
-    EXPORT SparseBatchStream* CDECL create_sparse_batch_stream(const char* file, size_t batchSize, float skipEntryProb) {
-        return new SparseBatchStream(file, batchSize, skipEntryProb);
+    // Reads a .nnue file into nnue_num_parameters(nnue_feature_set(file))
+    // floats in the order of model.NN.
+    EXPORT bool CDECL nnue_read(const char* file, float* params) {
+        nnue::NetworkFile network;
+        if (!network.open(file)) {
+            nnueError = network.error;
+            return false;
+        }
+        network.dequantize(params);
+        return true;
     }
 
-    EXPORT void CDECL destroy_sparse_batch_stream(SparseBatchStream* stream) {
-        delete stream;
+    EXPORT const char* CDECL nnue_error() {
+        return nnueError.c_str();
     }
 
-    EXPORT SparseBatch* CDECL next_sparse_batch(SparseBatchStream* stream) {
-        return stream->next();
+    EXPORT bool CDECL nnue_write(const char* file, const float* params, uint8_t featureSet) {
+        if (!FeatureTransformer::isQuantizable(featureSet)) return false;
+        return nnue::writeNetwork(file, params, nnue::Architecture(featureSet));
     }
 
-    EXPORT void CDECL destroy_sparse_batch(SparseBatch* batch) {
-        delete batch;
+    // Writes a compacted .nnue file keeping the features active at least
+    // minCount times according to one counter per input feature.
+    EXPORT bool CDECL nnue_write_compact(const char* file, const float* params, uint8_t featureSet,
+        const uint64_t* counts, uint64_t minCount)
+    {
+        if (!FeatureTransformer::isQuantizable(featureSet)) return false;
+        nnue::Architecture arch(featureSet);
+        nnue::FeatureRemap remap = nnue::FeatureRemap::fromCounts(counts, minCount, arch.inputSize);
+        return nnue::writeNetwork(file, params, arch, &remap);
     }
 
 } // extern "C"
\ No newline at end of file
@@ -0,0 +1,832 @@
+#pragma once
+
+#include<algorithm>
+#include<atomic>
+#include<cassert>
+#include<chrono>
+#include<cstring> // std::memcpy
+#include<deque>
+#include<filesystem>
+#include<fstream>
+#include<numeric>
+#include<iostream>
+#include<memory>
+#include<mutex>
+#include<vector>
+#include<random>
+#include<sstream>
+#include<string>
+
+#include"async_reader.h"
+#include"dlpack.h"
+#include"feature_transformer.h"
+#include"mapped_file.h"
+#include"training_data_formats.h"
+
+using namespace chess;
+
+// Recycles the memory of the batches of a stream, so that it is pinned for
+// copies to the GPU once when it is allocated instead of for every batch.
+// Shared by the stream and its batches, which may outlive it and are freed
+// on other threads.
+struct BatchMemoryPool {
+    using Callback = void (*)(void* data, size_t size);
+    static constexpr size_t MAX_FREE = 8;
+
+    Callback onAllocate = nullptr;  // e.g. cudaHostRegister
+    Callback onFree = nullptr;      // e.g. cudaHostUnregister
+    std::mutex mutex;
+    std::vector<std::pair<char*, size_t>> freeMemory;
+
+    ~BatchMemoryPool() {
+        for (auto [data, size] : freeMemory)
+            release(data, size);
+    }
+
+    char* take(size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < freeMemory.size(); ++i)
+                if (freeMemory[i].second == size) {
+                    char* data = freeMemory[i].first;
+                    freeMemory[i] = freeMemory.back();
+                    freeMemory.pop_back();
+                    return data;
+                }
+        }
+        char* data = (char*)::operator new(size, std::align_val_t(64));
+        if (onAllocate) onAllocate(data, size);
+        return data;
+    }
+
+    void give(char* data, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (freeMemory.size() < MAX_FREE) {
+                freeMemory.emplace_back(data, size);
+                return;
+            }
+        }
+        release(data, size);
+    }
+
+    void release(char* data, size_t size) {
+        if (onFree) onFree(data, size);
+        ::operator delete(data, std::align_val_t(64));
+    }
+};
+
+// The arrays of a batch are one allocation, from the pool of its stream
+// if it has one.
+struct SparseBatch {
+    IndexType size;
+    IndexType numActiveWhiteFeatures;
+    IndexType numActiveBlackFeatures;
+    float* stm;
+    float* score;
+    float* gameResult;
+    IndexType* whiteFeatureIndices;
+    IndexType* blackFeatureIndices;
+    float* whiteFeatureValues;
+    float* blackFeatureValues;
+    char* memory;
+    size_t memorySize;
+    std::shared_ptr<BatchMemoryPool> pool;
+
+    template<class FeatureSet = FeatureTransformer::KingPieces>
+    SparseBatch(const std::vector<TrainingDataEntry>& entries, FeatureSet set = {}, std::shared_ptr<BatchMemoryPool> pool = nullptr) :
+        SparseBatch(entries.size(), FeatureSet::MAX_ACTIVE, std::move(pool))
+    {
+        fill(entries, set);
+    }
+
+    SparseBatch(IndexType size, IndexType maxActive = FeatureTransformer::MAX_ACTIVE_FEATURES, std::shared_ptr<BatchMemoryPool> pool = nullptr) :
+        pool(std::move(pool))
+    {
+        assert(size * maxActive * 2 <= std::numeric_limits<IndexType>::max());
+
+        this->size = size;
+        numActiveWhiteFeatures = 0;
+        numActiveBlackFeatures = 0;
+
+        size_t indices = (size_t)size * maxActive * 2 * sizeof(IndexType);
+        size_t values = (size_t)size * maxActive * sizeof(float);
+        memorySize = 2 * indices + 2 * values + 3 * size * sizeof(float);
+        memory = this->pool ? this->pool->take(memorySize) : (char*)::operator new(memorySize, std::align_val_t(64));
+        char* p = memory;
+        auto carve = [&](size_t bytes) {
+            char* array = p;
+            p += bytes;
+            return array;
+        };
+        whiteFeatureIndices = (IndexType*)carve(indices);
+        blackFeatureIndices = (IndexType*)carve(indices);
+        whiteFeatureValues = (float*)carve(values);
+        blackFeatureValues = (float*)carve(values);
+        stm = (float*)carve(size * sizeof(float));
+        score = (float*)carve(size * sizeof(float));
+        gameResult = (float*)carve(size * sizeof(float));
+    }
+
+    SparseBatch(const SparseBatch&) = delete;
+    SparseBatch& operator=(const SparseBatch&) = delete;
+
+    ~SparseBatch() {
+        if (pool) pool->give(memory, memorySize);
+        else ::operator delete(memory, std::align_val_t(64));
+    }
+
+    template<class FeatureSet = FeatureTransformer::KingPieces>
+    void fill(const std::vector<TrainingDataEntry>& entries, FeatureSet set = {}) {
+        assert(entries.size() == size);
+        for (IndexType i = 0; i < size; ++i)
+            fillEntry(i, entries[i], set);
+    }
+
+    template<class FeatureSet = FeatureTransformer::KingPieces>
+    void fillEntry(IndexType i, const TrainingDataEntry& e, FeatureSet = {}) {
+        stm[i] = (float)e.pos.sideToMove;
+        score[i] = (float)e.score;
+        gameResult[i] = ((float)e.result+1)/2;
+        FeatureTransformer::fillFeatures<FeatureSet>(i, e.pos, WHITE, whiteFeatureIndices, whiteFeatureValues, numActiveWhiteFeatures);
+        FeatureTransformer::fillFeatures<FeatureSet>(i, e.pos, BLACK, blackFeatureIndices, blackFeatureValues, numActiveBlackFeatures);
+    }
+};
+
+// DLPack views of the arrays of a batch: stm, score and game result
+// (size x 1), white and black feature indices (active x 2) and white and
+// black feature values (active). The tensors share the batch, it is
+// deleted with the last of them.
+struct SparseBatchTensors {
+    static constexpr int N_TENSORS = 7;
+
+    SparseBatch* batch;
+    std::atomic<int> refs;
+    int64_t shapes[N_TENSORS][2];
+    DLManagedTensor tensors[N_TENSORS];
+
+    // Takes ownership of batch.
+    explicit SparseBatchTensors(SparseBatch* batch) : batch(batch), refs(N_TENSORS) {
+        constexpr DLDataType FLOAT32 = { kDLFloat, 32, 1 };
+        constexpr DLDataType INT64 = { kDLInt, 64, 1 };
+        static_assert(sizeof(IndexType) == sizeof(int64_t));
+
+        int64_t size = batch->size;
+        int64_t white = batch->numActiveWhiteFeatures;
+        int64_t black = batch->numActiveBlackFeatures;
+        set(0, batch->stm, FLOAT32, 2, size, 1);
+        set(1, batch->score, FLOAT32, 2, size, 1);
+        set(2, batch->gameResult, FLOAT32, 2, size, 1);
+        set(3, batch->whiteFeatureIndices, INT64, 2, white, 2);
+        set(4, batch->blackFeatureIndices, INT64, 2, black, 2);
+        set(5, batch->whiteFeatureValues, FLOAT32, 1, white, 1);
+        set(6, batch->blackFeatureValues, FLOAT32, 1, black, 1);
+    }
+
+    ~SparseBatchTensors() {
+        delete batch;
+    }
+
+    void set(int i, void* data, DLDataType dtype, int32_t ndim, int64_t rows, int64_t cols) {
+        shapes[i][0] = rows;
+        shapes[i][1] = cols;
+        tensors[i].dl_tensor = { data, { kDLCPU, 0 }, ndim, dtype, shapes[i], nullptr, 0 };
+        tensors[i].manager_ctx = this;
+        tensors[i].deleter = release;
+    }
+
+    static void release(DLManagedTensor* tensor) {
+        auto* self = (SparseBatchTensors*)tensor->manager_ctx;
+        if (--self->refs == 0) delete self;
+    }
+};
+
+// The score and game result are relative to the side to move,
+// so neither transformation changes them.
+enum Augmentation : uint8_t {
+    NO_AUGMENTATION,
+    AUGMENT_FLIP = 1,  // mirror vertically and swap colors
+    AUGMENT_MIRROR = 2 // mirror horizontally, only without castling rights
+};
+
+// Sizes of a feature set, exported through get_feature_set_info.
+struct FeatureSetInfo {
+    const char* name;
+    int64_t inputSize;
+    int64_t maxActive;
+};
+
+// Counters describing the work done by a stream, exported through get_stream_stats.
+struct StreamStats {
+    uint64_t bytesRead;      // by reads, or parsed from the mapping without them
+    uint64_t entriesParsed;
+    uint64_t entriesSkipped;
+    uint64_t batchesBuilt;
+    double ioTime;           // seconds blocked on reading the file
+    double computeTime;      // seconds spent parsing entries and filling features
+    uint64_t queueOccupancy; // blocks read ahead, always 0 without read-ahead
+};
+
+// Selects the part of the training data read by a stream. Every data loader
+// worker of every rank reads its own shard, so that each record is read once
+// per epoch over all processes.
+struct Shard {
+    size_t rank = 0;
+    size_t worldSize = 1;
+    size_t workerId = 0;
+    size_t numWorkers = 1;
+
+    size_t index() const { return rank * numWorkers + workerId; }
+    size_t count() const { return worldSize * numWorkers; }
+
+    // Shard i holds the records that start in the i-th of count() equal byte
+    // ranges of the file, [first, last) is set to its range. Its first record
+    // is only found when it is read, see syncTo, and its last one may run
+    // past last.
+    void locate(const char* data, const char* end, const char*& first, const char*& last) const {
+        size_t size = end - data;
+        first = data + size * index() / count();
+        last = data + size * (index() + 1) / count();
+    }
+};
+
+// Probabilities to keep a record by phase, score, result and ply, applied
+// before its FEN is parsed. The probability is the product of one factor of
+// each table; every table is scaled so that its largest factor is 1.
+struct SamplingWeights {
+    static constexpr int N_PIECE_COUNTS = 33;
+    static constexpr int N_SCORE_BANDS = 16;
+    static constexpr int SCORE_BAND_WIDTH = 100;    // the last band holds every larger |score|
+    static constexpr int N_RESULTS = 3;             // loss, draw, win of the side to move
+    static constexpr int N_PLY_BANDS = 16;
+    static constexpr int PLY_BAND_WIDTH = 16;       // the last band holds every later ply
+
+    bool enabled = false;
+    float pieceCount[N_PIECE_COUNTS];
+    float scoreBand[N_SCORE_BANDS];
+    float result[N_RESULTS];
+    float plyBand[N_PLY_BANDS];
+
+    // A null table keeps every record as far as it is concerned.
+    void set(const float* pieceCount, const float* scoreBand, const float* result, const float* plyBand) {
+        enabled = pieceCount || scoreBand || result || plyBand;
+        assign(this->pieceCount, pieceCount, N_PIECE_COUNTS);
+        assign(this->scoreBand, scoreBand, N_SCORE_BANDS);
+        assign(this->result, result, N_RESULTS);
+        assign(this->plyBand, plyBand, N_PLY_BANDS);
+    }
+
+    float keepProbability(const TrainingData::RecordInfo& info) const {
+        return pieceCount[std::min(info.pieceCount, N_PIECE_COUNTS - 1)]
+            * scoreBand[std::min(std::abs(info.score) / SCORE_BAND_WIDTH, N_SCORE_BANDS - 1)]
+            * result[std::clamp(info.result + 1, 0, N_RESULTS - 1)]
+            * plyBand[std::min(info.ply / PLY_BAND_WIDTH, N_PLY_BANDS - 1)];
+    }
+
+    static void assign(float* table, const float* weights, int size) {
+        float max = 0;
+        for (int i = 0; i < size; ++i)
+            max = std::max(max, weights ? weights[i] : 1.0f);
+        for (int i = 0; i < size; ++i)
+            table[i] = max > 0 ? std::max(weights ? weights[i] : 1.0f, 0.0f) / max : 0;
+    }
+};
+
+// Reservoir of entries for reading the training data in file order: it is
+// filled with the first entries, then every entry taken from a random slot
+// is replaced by the next one read. Entries hold a PackedPosition, so a
+// slot takes 40 bytes.
+struct ShuffleBuffer {
+    size_t capacity = 0;    // entries, 0 disables the buffer
+    std::vector<TrainingDataEntry> slots;
+
+    void reset(size_t capacity) {
+        this->capacity = capacity;
+        slots.clear();
+        slots.reserve(capacity);
+    }
+
+    bool empty() const { return slots.empty(); }
+    bool full() const { return slots.size() >= capacity; }
+
+    void push(const TrainingDataEntry& e) {
+        slots.push_back(e);
+    }
+
+    template<class Rng>
+    void take(Rng& gen, TrainingDataEntry& e) {
+        size_t i = std::uniform_int_distribution<size_t>(0, slots.size() - 1)(gen);
+        e = slots[i];
+        slots[i] = slots.back();
+        slots.pop_back();
+    }
+};
+
+struct SparseBatchStream {
+    using Clock = std::chrono::steady_clock;
+
+    size_t batchSize;
+    std::vector<TrainingDataEntry>entries;
+    std::filesystem::path file;
+    TrainingData::Format format; // by the extension of file
+    // the file is mapped, so that all streams on a machine share its pages
+    MappedFile mapped;
+    Shard shard;
+    const char* buffer; // the byte range of the shard
+    const char* bufferEnd;
+    // The shard is read in blocks, in the order of blockOrder; a single
+    // block unless block shuffling is enabled with setShuffle() or blocks
+    // are read ahead with setAsyncRead(). A block holds the records that
+    // start in its byte range, the first of them is found with syncTo().
+    std::vector<const char*> blocks;    // range boundaries in the mapping, blocks.size() - 1 blocks
+    std::vector<uint32_t> blockOrder;
+    size_t blockSize;
+    size_t block;                       // index into blockOrder, SIZE_MAX before the first
+    const char* blockData;              // data of the current block, in the mapping, a read buffer or carry
+    const char* blockDataEnd;
+    bool blockDataAtEnd;                // blockDataEnd is the end of the file
+    size_t blockOffset;                 // of blockData in the file
+    TrainingData::Reader reader;        // over the current block
+    const char* countedUpTo;            // by countMappedBytes()
+    // Without setAsyncRead() the blocks are parsed from the mapping, else
+    // they are read into the buffers of io; readAhead holds the indices into
+    // blockOrder and the buffers of the reads in flight, in order. The mapping
+    // is then not read, unless a read fails.
+    AsyncReader io;
+    std::deque<std::pair<size_t, int>> readAhead;
+    int blockSlot = -1;                 // buffer of the current block
+    // the rest of a block read from where its buffer ends, see carryTail()
+    std::vector<char> carry;
+    ShuffleBuffer shuffle;
+    bool stop;
+    float skipEntryProb;
+    std::bernoulli_distribution dist;
+    SamplingWeights weights;
+    std::uniform_real_distribution<float> uniform;
+    // seeded from the seed and the shard index, all randomness of the stream
+    std::mt19937_64 gen;
+    uint8_t augmentation;
+    uint8_t featureSet;
+    StreamStats stats;
+    // how often every input feature was active, summed over both
+    // perspectives, empty unless enabled with countFeatures()
+    std::vector<uint64_t> featureCounts;
+    std::shared_ptr<BatchMemoryPool> batchMemory = std::make_shared<BatchMemoryPool>();
+
+    SparseBatchStream(const char* file, size_t batchSize, float skipEntryProb, uint8_t augmentation,
+        uint8_t featureSet = FeatureTransformer::KING_PIECES, Shard shard = {}, uint64_t seed = 0)
+    {
+        this->batchSize = batchSize;
+        this->file = file;
+        this->shard = shard;
+        format = TrainingData::formatOf(this->file);
+        stats = {};
+
+        bool opened = mapped.open(this->file);
+        assert(opened);
+        (void)opened;
+
+        shard.locate(mapped.data, mapped.data + mapped.size, buffer, bufferEnd);
+
+        blocks = { buffer, bufferEnd };
+        blockOrder = { 0 };
+        blockSize = 0;
+        stop = false;
+
+        this->skipEntryProb = skipEntryProb;
+        dist = std::bernoulli_distribution(skipEntryProb);
+        this->augmentation = augmentation;
+        this->featureSet = featureSet;
+
+        std::seed_seq seq{ seed, (uint64_t)shard.index() };
+        gen.seed(seq);
+        rewind();
+    }
+
+    // Reads the shard in blocks of about blockSize bytes in random order and
+    // takes records at random from a buffer of bufferSize records, 0 disables
+    // either. Together they give batches close to uniform sampling while the
+    // file is read in large sequential pieces. Only valid before the first batch.
+    void setShuffle(size_t bufferSize, size_t blockSize) {
+        shuffle.reset(bufferSize);
+        this->blockSize = blockSize;
+        splitBlocks(blockSize);
+        if (blockSize) std::shuffle(blockOrder.begin(), blockOrder.end(), gen);
+        rewind();
+    }
+
+    // blocks of a shard read ahead without block shuffling
+    static constexpr size_t READ_AHEAD_BLOCK_SIZE = 8 << 20;
+
+    // Reads the blocks into queueDepth buffers, starting the reads of the next
+    // blocks while the current one is parsed, with io_uring on Linux and
+    // pread elsewhere, and with direct I/O if it is enabled and supported.
+    // Without block shuffling the shard is read in blocks of
+    // READ_AHEAD_BLOCK_SIZE bytes. Must be called after setShuffle() and
+    // before the first batch, returns false if the file cannot be opened.
+    bool setAsyncRead(size_t queueDepth, bool direct) {
+        if (!blockSize) splitBlocks(READ_AHEAD_BLOCK_SIZE);
+        size_t maxBlockSize = 0;
+        for (size_t i = 0; i + 1 < blocks.size(); ++i)
+            maxBlockSize = std::max<size_t>(maxBlockSize, blocks[i + 1] - readStart(blocks[i]));
+
+        dropReadAhead();
+        if (!io.open(file, queueDepth, maxBlockSize, direct)) return false;
+        rewind();
+        return true;
+    }
+
+    // Sets blocks to byte ranges of the shard of size bytes, the whole shard
+    // if size is 0, in file order. No record is read, the records of a block
+    // are only found when it is started.
+    void splitBlocks(size_t size) {
+        blocks = { buffer };
+        while (size && (size_t)(bufferEnd - blocks.back()) > size)
+            blocks.push_back(blocks.back() + size);
+        blocks.push_back(bufferEnd);
+
+        blockOrder.resize(blocks.size() - 1);
+        std::iota(blockOrder.begin(), blockOrder.end(), 0);
+    }
+
+    // The read of a block starts a byte before its range, so that a text line
+    // starting at the range can be told from one that does not.
+    const char* readStart(const char* begin) const {
+        return begin > mapped.data ? begin - 1 : begin;
+    }
+
+    static constexpr int STATE_VERSION = 4;
+    static constexpr size_t ENTRY_STATE_SIZE = sizeof(PackedPosition) + sizeof(int16_t) + sizeof(int8_t);
+
+    // Everything needed to continue the stream exactly where it is: the end
+    // flag, the RNG state, the block order, the offset of the current record
+    // with the number of its entries read, which is only not 0 in a chained
+    // block, and the entries of the shuffle buffer, which follow the first line as
+    // ENTRY_STATE_SIZE bytes each. The file size, the shard and the shuffle settings are
+    // stored to reject the state of another stream.
+    std::string state() const {
+        std::ostringstream os;
+        os << STATE_VERSION << ' ' << mapped.size << ' ' << shard.index() << ' ' << shard.count() << ' '
+            << stop << ' ' << gen << ' ' << blockSize << ' ' << blockOrder.size();
+        for (uint32_t b : blockOrder)
+            os << ' ' << b;
+        // before the first block the start of its range
+        bool started = block < blockOrder.size();
+        os << ' ' << (started ? block : 0)
+            << ' ' << (started ? fileOffset(reader.recordStart()) : blocks[blockOrder[0]] - mapped.data)
+            << ' ' << (started ? reader.readFromRecord() : 0)
+            << ' ' << shuffle.capacity << ' ' << shuffle.slots.size() << '\n';
+        for (const TrainingDataEntry& e : shuffle.slots) {
+            os.write((const char*)&e.pos, sizeof(e.pos));
+            os.write((const char*)&e.score, sizeof(e.score));
+            os.write((const char*)&e.result, sizeof(e.result));
+        }
+        return os.str();
+    }
+
+    // Returns false and leaves the stream unchanged if state does not belong to it.
+    bool setState(const std::string& state) {
+        std::istringstream is(state);
+        int version;
+        size_t size, index, count, bsize, numBlocks;
+        bool stopped;
+        std::mt19937_64 g;
+        is >> version >> size >> index >> count >> stopped >> g >> bsize >> numBlocks;
+        if (!is || version != STATE_VERSION || size != mapped.size || index != shard.index() || count != shard.count()
+            || bsize != blockSize || numBlocks != blockOrder.size())
+            return false;
+
+        std::vector<uint32_t> order(numBlocks);
+        for (uint32_t& b : order)
+            if (!(is >> b) || b >= numBlocks) return false;
+        size_t blk, offset, readFromRecord, capacity, numRecords;
+        is >> blk >> offset >> readFromRecord >> capacity >> numRecords;
+        if (!is || is.get() != '\n' || blk >= numBlocks || capacity != shuffle.capacity || numRecords > capacity)
+            return false;
+        if (offset < (size_t)(blocks[order[blk]] - mapped.data) || offset > mapped.size)
+            return false;
+
+        const char* entries = state.data() + (size_t)is.tellg();
+        if ((size_t)(state.data() + state.size() - entries) != numRecords * ENTRY_STATE_SIZE)
+            return false;
+
+        stop = stopped;
+        gen = g;
+        blockOrder = order;
+        dropReadAhead();
+        startBlock(blk);
+        // an offset before the first record of the block is its start
+        if (offset >= fileOffset(reader.stop)) endBlock();
+        else if (offset >= fileOffset(reader.curr)) {
+            reader.curr = blockData + (offset - blockOffset);
+            carryTail();
+            reader.skip(reader.curr, readFromRecord);
+            countedUpTo = reader.curr;
+        }
+        shuffle.reset(capacity);
+        for (size_t i = 0; i < numRecords; ++i) {
+            TrainingDataEntry e;
+            const char* p = entries + i * ENTRY_STATE_SIZE;
+            std::memcpy(&e.pos, p, sizeof(e.pos));
+            std::memcpy(&e.score, p + sizeof(e.pos), sizeof(e.score));
+            std::memcpy(&e.result, p + sizeof(e.pos) + sizeof(e.score), sizeof(e.result));
+            shuffle.push(e);
+        }
+        return true;
+    }
+
+    // The time blocked on reading blocks during the batch counts as io, the
+    // rest as compute.
+    SparseBatch* next() {
+        auto t0 = Clock::now();
+        double ioBefore = stats.ioTime;
+        SparseBatch* batch = nullptr;
+        if (readBatch())
+            batch = FeatureTransformer::withFeatureSet(featureSet, [&](auto set) {
+                return new SparseBatch(entries, set, batchMemory);
+            });
+        if (batch && !featureCounts.empty()) count(*batch);
+        stats.computeTime += std::chrono::duration<double>(Clock::now() - t0).count() - (stats.ioTime - ioBefore);
+        if (batch) ++stats.batchesBuilt;
+        return batch;
+    }
+
+    void countFeatures() {
+        featureCounts.assign(inputSize(), 0);
+    }
+
+    IndexType inputSize() const {
+        return FeatureTransformer::withFeatureSet(featureSet, [](auto set) {
+            return (IndexType)decltype(set)::INPUT_SIZE;
+        });
+    }
+
+    void count(const SparseBatch& batch) {
+        for (IndexType i = 0; i < batch.numActiveWhiteFeatures; ++i)
+            ++featureCounts[batch.whiteFeatureIndices[2 * i + 1]];
+        for (IndexType i = 0; i < batch.numActiveBlackFeatures; ++i)
+            ++featureCounts[batch.blackFeatureIndices[2 * i + 1]];
+    }
+
+    // Reads the entries of the next batch, returns false at the end of the file.
+    bool readBatch() {
+        entries.resize(batchSize);
+        for (size_t i = 0; i < batchSize; ++i)
+            if (stop || !readEntry(entries[i])) {
+                stop = true;
+                countMappedBytes();
+                return false;
+            }
+        countMappedBytes();
+        if (augmentation) augment();
+        return true;
+    }
+
+    // Adds the bytes the reader moved over in the mapping since the last call
+    // to bytesRead, the reads count their own.
+    void countMappedBytes() {
+        if (blockData == mapped.data && reader.curr > countedUpTo) stats.bytesRead += reader.curr - countedUpTo;
+        countedUpTo = reader.curr;
+    }
+
+    // Applies each enabled transformation to a random half of the entries.
+    void augment() {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (i % 32 == 0) bits = gen();
+            PackedPosition& pos = entries[i].pos;
+
+            if (augmentation & AUGMENT_FLIP && bits & 1)
+                pos.flip();
+            if (augmentation & AUGMENT_MIRROR && bits & 2 && !pos.canCastle())
+                pos.mirror();
+            bits >>= 2;
+        }
+    }
+
+    bool readEntry(TrainingDataEntry& e) {
+        if (!shuffle.capacity) return parseRecord(e);
+
+        TrainingDataEntry next;
+        while (!shuffle.full() && parseRecord(next))
+            shuffle.push(next);
+        if (shuffle.empty()) return false;
+        shuffle.take(gen, e);
+        return true;
+    }
+
+    bool parseRecord(TrainingDataEntry& e) {
+        if (format != TrainingData::TD) return decodeRecord(e);
+        const char* record;
+        if (!readRecord(record) || !TrainingData::read(record, reader.curr, e)) return false;
+        ++stats.entriesParsed;
+        return true;
+    }
+
+    // Same as readRecord for the other formats, which are decoded before
+    // an entry is skipped or sampled; a chained block only by replaying it.
+    bool decodeRecord(TrainingDataEntry& e) {
+        if (dist(gen)) {
+            if (!decodeNext(e)) return false;
+            ++stats.entriesSkipped;
+        }
+
+        for (;;) {
+            if (!decodeNext(e)) return false;
+            if (weights.enabled && uniform(gen) >= weights.keepProbability(TrainingData::info(e))) {
+                ++stats.entriesSkipped;
+                continue;
+            }
+            ++stats.entriesParsed;
+            return true;
+        }
+    }
+
+    // Reads the next entry, a malformed rest of a block is dropped.
+    bool decodeNext(TrainingDataEntry& e) {
+        while (!reader.read(e)) {
+            if (carryTail()) continue;
+            if (block + 1 >= blockOrder.size()) return false;
+            startBlock(block + 1);
+        }
+        return true;
+    }
+
+    // Finds the next record of the shard kept by skipping and sampling,
+    // returns false at the end of the shard.
+    bool readRecord(const char*& record) {
+        if (dist(gen)) {
+            if (!skipRecord()) return false;
+            ++stats.entriesSkipped;
+        }
+
+        for (;;) {
+            if (!nextBlock()) return false;
+            if (weights.enabled) {
+                TrainingData::RecordInfo info;
+                if (!TrainingData::peek(reader.curr, reader.end, info)) {
+                    if (!carryTail()) endBlock();
+                    continue;
+                }
+                if (uniform(gen) >= weights.keepProbability(info)) {
+                    TrainingData::skip(reader.curr, reader.end);
+                    ++stats.entriesSkipped;
+                    continue;
+                }
+            }
+            record = reader.curr;
+            if (TrainingData::skip(reader.curr, reader.end)) return true;
+            if (!carryTail()) endBlock();
+        }
+    }
+
+    bool skipRecord() {
+        while (nextBlock()) {
+            if (TrainingData::skip(reader.curr, reader.end)) return true;
+            if (!carryTail()) endBlock();
+        }
+        return false;
+    }
+
+    // Moves on to the next block once the current one is read, an incomplete
+    // record at its end is dropped. Returns false after the last block.
+    bool nextBlock() {
+        while (reader.curr >= reader.stop) {
+            if (block + 1 >= blockOrder.size()) return false;
+            startBlock(block + 1);
+        }
+        return true;
+    }
+
+    // Starts over before the first block, block + 1 is then 0. The block is
+    // only started with the next record, so that setting up the stream reads
+    // no data.
+    void rewind() {
+        block = SIZE_MAX;
+        blockData = nullptr;
+        reader = TrainingData::Reader(format, nullptr, nullptr);
+        countedUpTo = nullptr;
+    }
+
+    void endBlock() {
+        countMappedBytes();
+        reader.curr = reader.stop = reader.end;
+        countedUpTo = reader.curr;
+    }
+
+    // A block is parsed from the read of its range if there is one, else from
+    // the mapping, which holds the records running past the end of the range
+    // as well. In a read the first record is found in the buffer, unless the
+    // range is too short to tell.
+    void startBlock(size_t i) {
+        countMappedBytes();
+        block = i;
+        const char* begin = blocks[blockOrder[i]];
+        size_t size;
+        const char* data = io.isOpen() ? readBlock(i, size) : nullptr;
+        size_t offset = readStart(begin) - mapped.data;
+        if (data) setBlockData(data, size, offset, blocks[blockOrder[i] + 1] - mapped.data - offset);
+        else setBlockData(mapped.data, mapped.size, 0, mapped.size);
+
+        const char* first;
+        while (!(first = TrainingData::syncTo(format, blockData, blockDataEnd, blockData + (begin - mapped.data - blockOffset),
+            blockOffset, blockDataAtEnd)))
+            readIntoCarry(blockOffset, std::max<size_t>(2 * (blockDataEnd - blockData), CARRY_SIZE));
+        startReader(first);
+        countedUpTo = reader.curr;
+    }
+
+    // Sets the data of the current block to size of the requested bytes at
+    // offset, it ends the file if fewer were read.
+    void setBlockData(const char* data, size_t size, size_t offset, size_t requested) {
+        blockData = data;
+        blockDataEnd = data + size;
+        blockDataAtEnd = size < requested || offset + size >= mapped.size;
+        blockOffset = offset;
+    }
+
+    // Reads the records of the current block from curr on. Before the end of
+    // the file the last text line of the data may be cut off, it is left out.
+    void startReader(const char* curr) {
+        const char* end = blockDataEnd;
+        if (format == TrainingData::TEXT && !blockDataAtEnd)
+            while (end > curr && end[-1] != '\n') --end;
+        const char* stop = blockData + (blocks[blockOrder[block] + 1] - mapped.data - blockOffset);
+        reader = TrainingData::Reader(format, curr, end, stop);
+    }
+
+    // first read of carryTail(), doubled until the record is complete
+    static constexpr size_t CARRY_SIZE = 4096;
+
+    // If the record at the reader starts in the range of the block but is cut
+    // off by the end of its read, continues the block with it in carry, read
+    // with pread. Returns false otherwise, e.g. at a malformed record.
+    bool carryTail() {
+        if (reader.curr >= reader.stop || blockDataAtEnd || complete(reader.curr, reader.end)) return false;
+        size_t offset = fileOffset(reader.curr);
+        for (size_t size = std::max<size_t>(blockDataEnd - reader.curr, CARRY_SIZE / 2); ; ) {
+            size *= 2;
+            readIntoCarry(offset, size);
+            startReader(blockData);
+            if (blockDataAtEnd || complete(reader.curr, reader.end)) break;
+        }
+        return true;
+    }
+
+    // Whether the record at curr is in [curr, end).
+    bool complete(const char* curr, const char* end) const {
+        return curr < end && TrainingData::skipTo(format, curr, end, curr + 1) != curr;
+    }
+
+    // Makes size bytes at offset the data of the current block.
+    void readIntoCarry(size_t offset, size_t size) {
+        auto t0 = Clock::now();
+        std::vector<char> data(size);   // the current block may be in carry
+        data.resize(io.readNow(offset, data.data(), size));
+        stats.bytesRead += data.size();
+        carry.swap(data);
+        setBlockData(carry.data(), carry.size(), offset, size);
+        stats.ioTime += std::chrono::duration<double>(Clock::now() - t0).count();
+    }
+
+    // Waits for the read of block i, after starting the reads of the blocks
+    // that follow it as far as there are free buffers. Returns nullptr if
+    // the read fails, the block is then parsed from the mapping.
+    const char* readBlock(size_t i, size_t& size) {
+        auto t0 = Clock::now();
+        if (blockSlot >= 0) io.release(blockSlot);
+        blockSlot = -1;
+        if (!readAhead.empty() && readAhead.front().first != i) dropReadAhead();
+        for (size_t next = readAhead.empty() ? i : readAhead.back().first + 1; next < blockOrder.size(); ++next) {
+            const char* begin = readStart(blocks[blockOrder[next]]);
+            int slot = io.queue(begin - mapped.data, blocks[blockOrder[next] + 1] - begin);
+            if (slot < 0) break;
+            readAhead.emplace_back(next, slot);
+        }
+        io.submitQueued();
+        if (readAhead.empty()) return nullptr;  // every buffer is lost
+        stats.queueOccupancy = readAhead.size() - 1;
+
+        blockSlot = readAhead.front().second;
+        readAhead.pop_front();
+        const char* data = io.wait(blockSlot);
+        size = io.readSize(blockSlot);
+        if (data) stats.bytesRead += size;
+        stats.ioTime += std::chrono::duration<double>(Clock::now() - t0).count();
+        return data;
+    }
+
+    // Frees the buffers of every block, for a new block order.
+    void dropReadAhead() {
+        if (blockSlot >= 0) io.release(blockSlot);
+        for (const auto& ahead : readAhead)
+            io.release(ahead.second);
+        readAhead.clear();
+        blockSlot = -1;
+    }
+
+    // Offset in the file of p in the current block.
+    size_t fileOffset(const char* p) const {
+        return blockOffset + (p - blockData);
+    }
+};